@@ -0,0 +1,285 @@
+/**
+ *
+ *   File:   gen-media.c
+ *           Generates the synthetic clips the benchmarks run on. Every clip is
+ *           encoded bitexact and single threaded from computed patterns, so the
+ *           same FFmpeg build always produces the same bytes.
+ *
+ *           Usage: gen-media <output directory>
+ *
+ *           Created on 10/19/26.
+ *
+ **/
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavutil/avassert.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/opt.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+/**
+ * Description of one generated clip.
+ */
+typedef struct ClipSpec
+{
+    const char *name;
+    int width;
+    int height;
+    int fps;
+    int gop_size;                   // 1 for intra only codecs
+    enum AVCodecID video_codec;
+    enum AVPixelFormat pix_fmt;
+    enum AVCodecID audio_codec;
+    enum AVSampleFormat sample_fmt;
+    int sample_rate;
+    uint64_t channel_layout;
+    int duration;                   // in seconds
+} ClipSpec;
+
+/**
+ * Resolutions, codecs, GOP lengths and audio layouts covered by the suite.
+ * Only encoders native to libavcodec are used.
+ */
+static const ClipSpec clips[] = {
+    { "360p-mpeg4-gop12-aac-stereo",    640,  360, 25,  12, AV_CODEC_ID_MPEG4,      AV_PIX_FMT_YUV420P,  AV_CODEC_ID_AAC,       AV_SAMPLE_FMT_FLTP, 48000, AV_CH_LAYOUT_STEREO,  10 },
+    { "1080p-mpeg4-gop250-aac-5.1",    1920, 1080, 25, 250, AV_CODEC_ID_MPEG4,      AV_PIX_FMT_YUV420P,  AV_CODEC_ID_AAC,       AV_SAMPLE_FMT_FLTP, 48000, AV_CH_LAYOUT_5POINT1, 10 },
+    { "1080p-mpeg2-gop12-mp2-stereo",  1920, 1080, 30,  12, AV_CODEC_ID_MPEG2VIDEO, AV_PIX_FMT_YUV420P,  AV_CODEC_ID_MP2,       AV_SAMPLE_FMT_S16,  44100, AV_CH_LAYOUT_STEREO,  10 },
+    { "2160p-mjpeg-intra-pcm-mono",    3840, 2160, 25,   1, AV_CODEC_ID_MJPEG,      AV_PIX_FMT_YUVJ420P, AV_CODEC_ID_PCM_S16LE, AV_SAMPLE_FMT_S16,  48000, AV_CH_LAYOUT_MONO,     4 },
+};
+
+/**
+ * Encoder and generator state of one output stream.
+ */
+typedef struct OutputStream
+{
+    AVStream *st;
+    AVCodecContext *enc;
+    AVFrame *frame;
+    int64_t next_pts;               // in the encoder time base
+} OutputStream;
+
+/**
+ * Moving luma gradient with a bouncing box, and a chroma sweep. Everything
+ * moves so motion estimation and the GOP structure matter.
+ */
+static void fill_picture(AVFrame *frame, int64_t n)
+{
+    int box = frame->height / 6;
+    int bx = (int)(n * 7 % (frame->width - box));
+    int by = (int)(n * 3 % (frame->height - box));
+    int x, y;
+
+    for (y = 0; y < frame->height; y++) {
+        uint8_t *line = frame->data[0] + y * frame->linesize[0];
+        for (x = 0; x < frame->width; x++)
+            line[x] = (x + y + n * 3) & 0xff;
+        if (y >= by && y < by + box)
+            memset(line + bx, 235, box);
+    }
+    for (y = 0; y < frame->height / 2; y++) {
+        uint8_t *cb = frame->data[1] + y * frame->linesize[1];
+        uint8_t *cr = frame->data[2] + y * frame->linesize[2];
+        for (x = 0; x < frame->width / 2; x++) {
+            cb[x] = 128 + (int)(64 * sin((x + n) * 0.02));
+            cr[x] = 128 + (int)(64 * cos((y + n) * 0.03));
+        }
+    }
+}
+
+/**
+ * One sine tone per channel, 220Hz apart.
+ */
+static void fill_samples(AVFrame *frame, int channels, int64_t first_sample)
+{
+    int i, ch;
+
+    for (ch = 0; ch < channels; ch++) {
+        double freq = 220.0 * (ch + 2);
+        for (i = 0; i < frame->nb_samples; i++) {
+            double v = 0.25 * sin(2 * M_PI * freq * (first_sample + i) / frame->sample_rate);
+            if (frame->format == AV_SAMPLE_FMT_FLTP)
+                ((float *)frame->data[ch])[i] = (float)v;
+            else
+                ((int16_t *)frame->data[0])[i * channels + ch] = (int16_t)(v * 32767);
+        }
+    }
+}
+
+static int add_stream(OutputStream *ost, AVFormatContext *oc, enum AVCodecID codec_id, const ClipSpec *spec)
+{
+    AVCodec *codec = avcodec_find_encoder(codec_id);
+    AVCodecContext *enc;
+    int ret;
+
+    if (!codec) {
+        fprintf(stderr, "Encoder %s not available.\n", avcodec_get_name(codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if (!(ost->st = avformat_new_stream(oc, NULL)) || !(ost->enc = enc = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+
+    enc->flags        |= AV_CODEC_FLAG_BITEXACT;
+    enc->thread_count  = 1;
+    if (codec->type == AVMEDIA_TYPE_VIDEO) {
+        enc->width     = spec->width;
+        enc->height    = spec->height;
+        enc->pix_fmt   = spec->pix_fmt;
+        enc->time_base = (AVRational){ 1, spec->fps };
+        enc->gop_size  = spec->gop_size;
+        enc->bit_rate  = (int64_t)spec->width * spec->height * spec->fps / 8;
+        if (codec_id == AV_CODEC_ID_MPEG2VIDEO)
+            enc->max_b_frames = 2;
+    } else {
+        enc->sample_fmt     = spec->sample_fmt;
+        enc->sample_rate    = spec->sample_rate;
+        enc->channel_layout = spec->channel_layout;
+        enc->channels       = av_get_channel_layout_nb_channels(spec->channel_layout);
+        enc->time_base      = (AVRational){ 1, spec->sample_rate };
+        enc->bit_rate       = 64000 * enc->channels;
+    }
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((ret = avcodec_open2(enc, codec, NULL)) < 0)
+        return ret;
+    if ((ret = avcodec_parameters_from_context(ost->st->codecpar, enc)) < 0)
+        return ret;
+    ost->st->time_base = enc->time_base;
+
+    if (!(ost->frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (codec->type == AVMEDIA_TYPE_VIDEO) {
+        ost->frame->format = enc->pix_fmt;
+        ost->frame->width  = enc->width;
+        ost->frame->height = enc->height;
+    } else {
+        ost->frame->format         = enc->sample_fmt;
+        ost->frame->sample_rate    = enc->sample_rate;
+        ost->frame->channel_layout = enc->channel_layout;
+        ost->frame->nb_samples     = enc->frame_size ? enc->frame_size : 1024;
+    }
+    return av_frame_get_buffer(ost->frame, 0);
+}
+
+/* encode frame (NULL to drain) and write the packets */
+static int encode(AVFormatContext *oc, OutputStream *ost, AVFrame *frame)
+{
+    AVPacket pkt = { 0 };
+    int ret;
+
+    if ((ret = avcodec_send_frame(ost->enc, frame)) < 0)
+        return ret;
+    for (;;) {
+        ret = avcodec_receive_packet(ost->enc, &pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
+        av_packet_rescale_ts(&pkt, ost->enc->time_base, ost->st->time_base);
+        pkt.stream_index = ost->st->index;
+        if ((ret = av_interleaved_write_frame(oc, &pkt)) < 0)
+            return ret;
+    }
+}
+
+static void close_stream(OutputStream *ost)
+{
+    avcodec_free_context(&ost->enc);
+    av_frame_free(&ost->frame);
+}
+
+static int generate_clip(const ClipSpec *spec, const char *dir)
+{
+    AVFormatContext *oc = NULL;
+    OutputStream video = { 0 }, audio = { 0 };
+    char filename[1024];
+    int video_done = 0, audio_done = 0;
+    int ret;
+
+    snprintf(filename, sizeof(filename), "%s/%s.mkv", dir, spec->name);
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, "matroska", filename)) < 0)
+        return ret;
+    oc->flags |= AVFMT_FLAG_BITEXACT;
+
+    if ((ret = add_stream(&video, oc, spec->video_codec, spec)) < 0 ||
+        (ret = add_stream(&audio, oc, spec->audio_codec, spec)) < 0)
+        goto end;
+    if ((ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+    if ((ret = avformat_write_header(oc, NULL)) < 0)
+        goto end;
+
+    /* interleave by always encoding the stream that is behind */
+    while (!video_done || !audio_done) {
+        int write_video = !video_done &&
+                          (audio_done || av_compare_ts(video.next_pts, video.enc->time_base,
+                                                       audio.next_pts, audio.enc->time_base) <= 0);
+        OutputStream *ost = write_video ? &video : &audio;
+
+        if (av_compare_ts(ost->next_pts, ost->enc->time_base, spec->duration, (AVRational){ 1, 1 }) >= 0) {
+            if ((ret = encode(oc, ost, NULL)) < 0)
+                goto end;
+            if (write_video)
+                video_done = 1;
+            else
+                audio_done = 1;
+            continue;
+        }
+
+        if ((ret = av_frame_make_writable(ost->frame)) < 0)
+            goto end;
+        if (write_video) {
+            fill_picture(ost->frame, ost->next_pts);
+            ost->frame->pts = ost->next_pts++;
+        } else {
+            fill_samples(ost->frame, ost->enc->channels, ost->next_pts);
+            ost->frame->pts = ost->next_pts;
+            ost->next_pts  += ost->frame->nb_samples;
+        }
+        if ((ret = encode(oc, ost, ost->frame)) < 0)
+            goto end;
+    }
+    ret = av_write_trailer(oc);
+
+    end:
+    if (ret < 0)
+        fprintf(stderr, "Could not generate %s: %s\n", filename, av_err2str(ret));
+    else
+        printf("%s\n", filename);
+    close_stream(&video);
+    close_stream(&audio);
+    if (oc && oc->pb)
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    return ret;
+}
+
+/**
+ * Entry point.
+ *
+ * @param   argc    command line arguments counter.
+ * @param   argv    command line arguments.
+ *
+ * @return          0 if every clip was generated.
+ */
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <output directory>\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < FF_ARRAY_ELEMS(clips); i++)
+        if (generate_clip(&clips[i], argv[1]) < 0)
+            ret = 1;
+
+    return ret;
+}
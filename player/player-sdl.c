@@ -14,6 +14,7 @@
 #include <signal.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
 
 #include <libavutil/avstring.h>
 #include <libavutil/eval.h>
@@ -22,10 +23,12 @@
 #include <libavutil/imgutils.h>
 #include <libavutil/dict.h>
 #include <libavutil/bprint.h>
+#include <libavutil/cpu.h>
 #include <libavutil/parseutils.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/avassert.h>
 #include <libavutil/display.h>
+#include <libavutil/lfg.h>
 #include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libavdevice/avdevice.h>
@@ -40,8 +43,51 @@
 #include <SDL.h>
 #include <SDL_thread.h>
 
+#include <errno.h>
+#include <fcntl.h>
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#else
+#define HAVE_SSE2 0
+#endif
+
+/* AVX2 kernels are built with a target attribute and picked at runtime */
+#if HAVE_SSE2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define HAVE_AVX2_KERNELS 0
+#endif
+
+/* glibc lets the executable replace malloc() and still reach its own, only
+   in the builds made for checking allocations (cmake -DPLAYER_ALLOC_CHECK=ON) */
+#if defined(__GLIBC__) && defined(PLAYER_ALLOC_CHECK) && PLAYER_ALLOC_CHECK
+#include <malloc.h>
+#define HAVE_MALLOC_INTERPOSE 1
+#else
+#define HAVE_MALLOC_INTERPOSE 0
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#define AUDIO_BOUNDED_WAIT 1
+#else
+#define AUDIO_BOUNDED_WAIT 0
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#define HAVE_PROXY 1
+#define HAVE_PEAKS 1
+#define HAVE_GETRUSAGE 1
 #endif
 
 /**
@@ -64,6 +110,77 @@
  */
 #define EXTERNAL_CLOCK_MAX_FRAMES 10
 
+/**
+ * Not available on Windows, where a -metrics FIFO is not supported either.
+ */
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+
+/**
+ * Most verbose level of the hot path messages compiled in, HOT_LOG() calls
+ * above it cost nothing. Override with -DPLAYER_LOG_LEVEL=AV_LOG_TRACE.
+ */
+#ifndef PLAYER_LOG_LEVEL
+#define PLAYER_LOG_LEVEL AV_LOG_INFO
+#endif
+
+/**
+ * Logs from per-frame code paths: the message is formatted into the log ring
+ * and written by the log thread, so a slow terminal cannot stall playback.
+ */
+#define HOT_LOG(level, ...) do { if ((level) <= PLAYER_LOG_LEVEL) hot_log_post(level, __VA_ARGS__); } while (0)
+
+/**
+ * USDT probes of the pipeline stages, listed by "perf list sdt_player:*" or
+ * "bpftrace -l 'usdt:./player-sdl:*'" when built with sys/sdt.h. A probe is
+ * a single nop until a tracer attaches, and nothing without sys/sdt.h.
+ *
+ *   packet_enqueue, packet_dequeue  stream index, pts (stream time base), serial, queue packets, queue bytes
+ *   queue_flush                     serial, queue packets, queue bytes
+ *   frame_decoded                   media type, pts (us), serial
+ *   frame_queued                    pts (us), serial
+ *   frame_presented                 pts (us, unset for previews), serial, after SDL_RenderPresent()
+ *   frame_dropped                   reason (0 early, 1 late, 2 exact seek pre-roll), pts (us), serial
+ *   audio_callback_start, _end      bytes requested, audio clock (us), serial
+ *   seek_start                      target (us, bytes for byte seeks), flags, serial the seek will start
+ *   seek_end                        latency (us), serial
+ */
+#if HAVE_SYS_SDT_H
+#define PLAYER_PROBE(name, ...) STAP_PROBEV(player, name, __VA_ARGS__)
+#else
+#define PLAYER_PROBE(name, ...) do { } while (0)
+#endif
+
+/**
+ * Seconds to integer microseconds for probe arguments, AV_NOPTS_VALUE if unknown.
+ */
+#define PROBE_US(t) (isnan(t) ? AV_NOPTS_VALUE : (int64_t)((t) * 1000000))
+
+/**
+ * Time -seek_test gives a seek to show its frame before moving on, in
+ * microseconds.
+ */
+#define SEEK_TEST_TIMEOUT 5000000
+
+/**
+ * Rows of the -alloc_stats table, and the playback time after the first
+ * frame that -alloc_check leaves to the queues and textures to fill up.
+ */
+#define ALLOC_STATS_TOP 5
+#define ALLOC_CHECK_WARMUP 2000000
+
+/**
+ * Slots of the log ring, a power of two, and the longest queued message.
+ */
+#define LOG_RING_SIZE 1024
+#define LOG_MSG_SIZE 256
+
+/**
+ * Polling period of the log thread when the ring is empty, in milliseconds.
+ */
+#define LOG_DRAIN_INTERVAL 10
+
 /**
  * Minimum SDL audio buffer size, in samples.
  */
@@ -74,11 +191,51 @@
  */
 #define SDL_AUDIO_MAX_CALLBACKS_PER_SEC 30
 
+/**
+ * SDL audio buffer sizes of -audio_adaptive, in samples. It starts at the
+ * minimum and doubles on underruns, at most once per interval (in us).
+ */
+#define AUDIO_ADAPTIVE_MIN_SAMPLES 128
+#define AUDIO_ADAPTIVE_MAX_SAMPLES 8192
+#define AUDIO_ADAPTIVE_INTERVAL 500000
+
 /**
  * Step size for volume control in dB.
  */
 #define SDL_VOLUME_STEP (0.75)
 
+/**
+ * Playback speed range of -speed and of the [ and ] keys.
+ */
+#define PLAYBACK_SPEED_MIN 0.5
+#define PLAYBACK_SPEED_MAX 4.0
+#define PLAYBACK_SPEED_STEP 0.25
+
+/**
+ * Above 1x the video decoder keeps at most this many frames per second of
+ * presentation time, and skips non reference frames from this speed on.
+ */
+#define SPEED_PRESENT_FPS 60
+#define SPEED_SKIP_NONREF 2.0
+
+/**
+ * WSOLA time stretching of the audio at speeds other than 1x. Segments of two
+ * hops overlap by half, each one starts within the search distance of its
+ * nominal position, where it best continues the previous one.
+ */
+#define STRETCH_HOP_MS 10
+#define STRETCH_SEARCH_MS 5
+
+/**
+ * Level meter overlay. The levels are published once per block, the RMS and
+ * the momentary loudness are averaged over the last METER_WINDOW_BLOCKS
+ * blocks (400 ms as in EBU R128). The bars start at METER_FLOOR_DB.
+ */
+#define METER_MAX_CHANNELS 8
+#define METER_BLOCK_MS 100
+#define METER_WINDOW_BLOCKS 4
+#define METER_FLOOR_DB -60.0f
+
 /**
  * No AV sync correction is done if below the minimum AV sync threshold.
  */
@@ -129,12 +286,23 @@
  */
 #define REFRESH_RATE 0.01
 
-//TODO: We assume that a decoded and resampled frame fits into this buffer
 /**
- * NOTE: the size must be big enough to compensate the hardware audio buffer size size.
+ * Samples kept for the waves and RDFT displays. The size must be big enough
+ * to cover the decoded frames waiting in sampq and the hardware audio buffer.
  */
 #define SAMPLE_ARRAY_SIZE (8 * 65536)
 
+/**
+ * Columns of the RDFT display computed ahead by the audio decoder thread, they
+ * must cover the audio queued between the decoder and the device at rdftspeed.
+ */
+#define SPECTRUM_NB_COLUMNS 128
+
+/**
+ * Rows of a spectrum column, taller displays leave the top empty.
+ */
+#define SPECTRUM_MAX_HEIGHT 2048
+
 /**
  *
  */
@@ -170,6 +338,94 @@
  */
 #define FF_QUIT_EVENT    (SDL_USEREVENT + 2)
 
+/**
+ * Number of log2 buckets of a Histogram, the last one is open ended.
+ */
+#define HISTOGRAM_NB_BUCKETS 48
+
+/**
+ * Samples a Histogram keeps as they are, its percentiles are exact up to this
+ * many samples and bucket bounds beyond.
+ */
+#define HISTOGRAM_NB_SAMPLES 1024
+
+/**
+ * Number of speculative seek targets of the prefetcher, one per arrow key.
+ */
+#define PREFETCH_NB_TARGETS 4
+
+/**
+ * Number of prefetched GOPs kept. More than the targets, so a GOP a target
+ * just left stays until playback has passed it instead of being fetched again
+ * when the target moves back and forth across a short GOP boundary.
+ */
+#define PREFETCH_NB_SLOTS 8
+
+/**
+ * Maximum number of packets read while looking for the end of a prefetched GOP.
+ */
+#define PREFETCH_MAX_PACKETS 1024
+
+/**
+ * The prefetcher re-evaluates its targets at least this often, in milliseconds.
+ */
+#define PREFETCH_POLL_INTERVAL 100
+
+/**
+ * Back-off after a failed prefetch before the targets are retried, in milliseconds.
+ */
+#define PREFETCH_RETRY_DELAY 1000
+
+/**
+ * A mouse drag is considered settled after this long without motion, in microseconds.
+ */
+#define SCRUB_SETTLE_DELAY 150000
+
+/**
+ * Cached keyframes further than this from the drag position are not shown, in AV_TIME_BASE units.
+ */
+#define SCRUB_MAX_DISTANCE (10 * AV_TIME_BASE)
+
+/**
+ * Until the first scrub, playback caches at most one keyframe per this span,
+ * in AV_TIME_BASE units. Well under SCRUB_MAX_DISTANCE, so every played
+ * position has one close enough.
+ */
+#define SCRUB_PLAYBACK_INTERVAL (2 * AV_TIME_BASE)
+
+/**
+ * Identifies a proxy sidecar file and its layout version.
+ */
+#define PROXY_MAGIC MKTAG('F', 'V', 'P', 'X')
+#define PROXY_VERSION 1
+
+/**
+ * Time in ms the proxy generator sleeps while playback is short of packets.
+ */
+#define PROXY_YIELD_DELAY 20
+
+/**
+ * Identifies a waveform overview sidecar file and its layout version.
+ */
+#define PEAKS_MAGIC MKTAG('F', 'V', 'P', 'K')
+#define PEAKS_VERSION 1
+
+/**
+ * Waveform overview: level 0 has PEAKS_RATE bins per second, every further
+ * level PEAKS_LEVEL_FACTOR times fewer. The builders split the file in chunks
+ * of PEAKS_CHUNK_BINS level 0 bins, which fill whole bins at every level.
+ */
+#define PEAKS_RATE 100
+#define PEAKS_LEVEL_FACTOR 4
+#define PEAKS_NB_LEVELS 7
+#define PEAKS_CHUNK_BINS 4096
+#define PEAKS_MAX_WORKERS 4
+
+/**
+ * Height in pixels of the waveform seek bar at the bottom of the window.
+ */
+#define PEAKS_BAR_HEIGHT 48
+
 /**
  * Add indentation when printing to console.
  */
@@ -366,6 +622,7 @@ typedef struct MyAVPacketList
 typedef struct PacketQueue
 {
     MyAVPacketList *first_pkt, *last_pkt;
+    MyAVPacketList *free_pkt;       // released nodes, reused before allocating
     int nb_packets;
     int size;
     int64_t duration;
@@ -388,6 +645,93 @@ typedef struct AudioParams
     int bytes_per_sec;
 } AudioParams;
 
+/**
+ * Where the last captured frame ends in the sample ring.
+ */
+typedef struct SampleCapturePos
+{
+    int end_index;                  // ring position after the last frame
+    double end_pts;                 // stream time at end_index
+    int serial;
+    int channels;
+    int freq;
+} SampleCapturePos;
+
+/**
+ * Samples of the waves and RDFT displays. The audio decoder thread appends the
+ * decoded frames while one of these displays is shown, and publishes the end
+ * of the last one with a seqlock: seq is odd while pos is written. The display
+ * reads pos and finds the samples playing now from the audio clock.
+ */
+typedef struct SampleCapture
+{
+    int16_t *samples;               // SAMPLE_ARRAY_SIZE, allocated when first needed
+    int index;                      // next write position, decoder thread only
+    SDL_atomic_t seq;
+    SampleCapturePos pos;
+} SampleCapture;
+
+/**
+ * RDFT display. The audio decoder thread runs the transform on the captured
+ * samples every rdftspeed seconds of stream time and queues the finished
+ * columns in a single producer, single consumer ring; the display uploads the
+ * columns whose time has come and advances read.
+ */
+typedef struct Spectrum
+{
+    RDFTContext *rdft;              // audio decoder thread only, up to next_pts
+    int rdft_bits;
+    float *window;                  // 1 - w * w for the 2 * nb_freq samples of a transform
+    FFTSample *data;                // 2 channels of 2 * nb_freq
+    double next_pts;                // stream time of the next column
+    int serial;
+    uint32_t *pixels;               // SPECTRUM_NB_COLUMNS columns of SPECTRUM_MAX_HEIGHT, top row first
+    double pts[SPECTRUM_NB_COLUMNS];
+    int column_serial[SPECTRUM_NB_COLUMNS];
+    int height[SPECTRUM_NB_COLUMNS];
+    SDL_atomic_t write;             // columns queued
+    SDL_atomic_t read;              // columns shown or dropped
+} Spectrum;
+
+/**
+ * Levels of the last meter block, dBFS for peak and RMS, LUFS for loudness.
+ */
+typedef struct MeterLevels
+{
+    int channels;
+    float peak[METER_MAX_CHANNELS];
+    float rms[METER_MAX_CHANNELS];
+    float loudness[METER_MAX_CHANNELS];     // momentary, K-weighted
+    float momentary;                        // momentary loudness of all channels
+} MeterLevels;
+
+/**
+ * Audio level meter. The audio thread runs the K-weighting filters of
+ * ITU-R BS.1770 on the samples sent to the device and publishes the levels of
+ * each block with a seqlock: seq is odd while levels is written, the renderer
+ * copies levels and retries when seq moved meanwhile.
+ */
+typedef struct Meter
+{
+    int channels;                           // metered, at most METER_MAX_CHANNELS
+    int freq;
+    int64_t channel_layout;
+    int block_len;                          // frames per block
+    int block_pos;
+    float coef[2][5];                       // b0 b1 b2 a1 a2 of the shelving and high pass stages
+    float state[2][2][METER_MAX_CHANNELS];  // transposed direct form II state of both stages
+    float weight[METER_MAX_CHANNELS];       // BS.1770 channel weights, 0 for LFE
+    float peak[METER_MAX_CHANNELS];         // of the current block
+    float sum[METER_MAX_CHANNELS];          // squares of the current block
+    float ksum[METER_MAX_CHANNELS];         // K-weighted squares of the current block
+    float energy[METER_WINDOW_BLOCKS][METER_MAX_CHANNELS];  // mean squares of the last blocks
+    float kenergy[METER_WINDOW_BLOCKS][METER_MAX_CHANNELS];
+    int block_index;
+    int nb_blocks;
+    SDL_atomic_t seq;
+    MeterLevels levels;
+} Meter;
+
 /**
  *
  */
@@ -446,6 +790,7 @@ enum
     AV_SYNC_AUDIO_MASTER, /* default choice */
     AV_SYNC_VIDEO_MASTER,
     AV_SYNC_EXTERNAL_CLOCK, /* synchronize to an external clock */
+    AV_SYNC_NB_TYPES
 };
 
 /**
@@ -468,109 +813,646 @@ typedef struct Decoder
 } Decoder;
 
 /**
- *
+ * Log2-bucketed histogram of non-negative integer samples (e.g. latencies in
+ * microseconds). Bucket 0 holds the zero samples, bucket i > 0 the samples in
+ * [2^(i-1), 2^i - 1]. The first HISTOGRAM_NB_SAMPLES samples are also kept
+ * for exact percentiles. Not thread safe: callers serialize histogram_add().
  */
-typedef struct VideoState
+typedef struct Histogram
 {
-    SDL_Thread *read_tid;
-    AVInputFormat *iformat;
-    int abort_request;
-    int force_refresh;
-    int paused;
-    int last_paused;
-    int queue_attachments_req;
-    int seek_req;
-    int seek_flags;
-    int64_t seek_pos;
-    int64_t seek_rel;
-    int read_pause_return;
-    AVFormatContext *ic;
-    int realtime;
-
-    Clock audclk;
-    Clock vidclk;
-    Clock extclk;
-
-    FrameQueue pictq;
-    FrameQueue subpq;
-    FrameQueue sampq;
-
-    Decoder auddec;
-    Decoder viddec;
-    Decoder subdec;
-
-    int audio_stream;
+    const char *name;
+    const char *unit;
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+    int64_t buckets[HISTOGRAM_NB_BUCKETS];
+    int64_t samples[HISTOGRAM_NB_SAMPLES];
+} Histogram;
 
-    int av_sync_type;
+/**
+ * How well sync was held while one master clock was in charge. The
+ * histograms hold microseconds. av_diff and lateness are written by the main
+ * thread, callback_jitter by the audio callback only.
+ */
+typedef struct SyncStats
+{
+    Histogram av_diff;              // |A-V| at each presented frame
+    Histogram lateness;             // presentation time minus the scheduled time
+    Histogram callback_jitter;      // |interval between audio callbacks - buffer duration|
+    int64_t last_callback_time;
+    int nb_video_ahead;             // presented frames with the video clock ahead of the audio clock
+    int nb_video_behind;
+    int nb_delay_shortened;         // compute_target_delay() skipped to catch up with the master
+    int nb_delay_lengthened;        // compute_target_delay() repeated to wait for the master
+    int nb_frame_timer_resets;      // the display fell more than AV_SYNC_THRESHOLD_MAX behind
+    int nb_audio_corrections;       // synchronize_audio() asked for fewer or more samples
+    int nb_audio_resets;            // the A-V filter was reset on a difference over AV_NOSYNC_THRESHOLD
+} SyncStats;
 
-    double audio_clock;
-    int audio_clock_serial;
-    double audio_diff_cum; /* used for AV difference average computation */
-    double audio_diff_avg_coef;
-    double audio_diff_threshold;
-    int audio_diff_avg_count;
-    AVStream *audio_st;
-    PacketQueue audioq;
-    int audio_hw_buf_size;
-    uint8_t *audio_buf;
-    uint8_t *audio_buf1;
-    unsigned int audio_buf_size; /* in bytes */
-    unsigned int audio_buf1_size;
-    int audio_buf_index; /* in bytes */
-    int audio_write_buf_size;
-    int audio_volume;
-    int muted;
-    struct AudioParams audio_src;
-    struct AudioParams audio_filter_src;
-    struct AudioParams audio_tgt;
-    struct SwrContext *swr_ctx;
-    int frame_drops_early;
-    int frame_drops_late;
+/**
+ * A speculative seek target read ahead by prefetch_thread: the compressed
+ * packets of the video GOP the seek would land in, and its decoded keyframe.
+ */
+typedef struct PrefetchSlot
+{
+    int valid;
+    int64_t key_pts;                // pts of the GOP keyframe, in stream time base
+    int64_t end_pts;                // pts of the next keyframe, INT64_MAX if the GOP runs to EOF
+    MyAVPacketList *first_pkt, *last_pkt;   // a prefix of the GOP without holes
+    int truncated;                  // the budget ended the packets before end_pts
+    AVFrame *keyframe;              // decoded keyframe, unset if not decoded
+    size_t mem;                     // bytes accounted against the prefetch budget
+} PrefetchSlot;
 
-    enum ShowMode
-    {
-        SHOW_MODE_NONE = -1,
-        SHOW_MODE_VIDEO = 0,
-        SHOW_MODE_WAVES,
-        SHOW_MODE_RDFT,
-        SHOW_MODE_NB
-    } show_mode;
+/**
+ * A decoded keyframe downscaled to the window size, kept for scrubbing.
+ */
+typedef struct ScrubCacheEntry
+{
+    int64_t pts;                    // AV_TIME_BASE units
+    AVFrame *frame;
+    size_t mem;
+    struct ScrubCacheEntry *prev, *next;
+} ScrubCacheEntry;
 
-    int16_t sample_array[SAMPLE_ARRAY_SIZE];
-    int sample_array_index;
-    int last_i_start;
-    RDFTContext *rdft;
-    int rdft_bits;
-    FFTSample *rdft_data;
-    int xpos;
-    double last_vis_time;
-    SDL_Texture *vis_texture;
-    SDL_Texture *sub_texture;
-    SDL_Texture *vid_texture;
+/**
+ * LRU cache of downscaled keyframes, most recently used first. Filled by
+ * video_thread from the start of playback, with one keyframe per
+ * SCRUB_PLAYBACK_INTERVAL so plain playback converts few of them, and with
+ * every keyframe once the user scrubbed. Looked up by the event loop while
+ * the mouse drags.
+ */
+typedef struct ScrubCache
+{
+    SDL_atomic_t active;            // set by the first scrub
+    int64_t last_playback_pts;      // keyframe last cached before it, video_thread only
+    SDL_mutex *mutex;
+    ScrubCacheEntry *first, *last;
+    int nb_entries;
+    size_t mem;
+    size_t max_mem;
+    struct SwsContext *sws_ctx;
+    int nb_hits;
+    int nb_misses;
+} ScrubCache;
 
-    int subtitle_stream;
-    AVStream *subtitle_st;
-    PacketQueue subtitleq;
+/**
+ * State of the seek target prefetcher. It owns a second demuxer and video
+ * decoder so its I/O never blocks read_thread.
+ */
+typedef struct Prefetcher
+{
+    SDL_Thread *tid;
+    SDL_mutex *mutex;               // protects everything below
+    SDL_cond *cond;
+    int abort_request;
+    int generation;                 // bumped by every executed seek, cancels in-flight fetches
+    double position;                // master clock as the main loop last saw it, NAN while a seek is pending
+    int stream_index;
+    AVRational time_base;
+    AVCodecParameters *codecpar;
+    const AVCodec *codec;
+    PrefetchSlot slots[PREFETCH_NB_SLOTS];
+    size_t mem;
+    int nb_hits;
+    int nb_misses;
+} Prefetcher;
 
-    double frame_timer;
-    double frame_last_returned_time;
-    double frame_last_filter_delay;
-    int video_stream;
-    AVStream *video_st;
-    PacketQueue videoq;
-    double max_frame_duration;      // maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
-    struct SwsContext *img_convert_ctx;
-    struct SwsContext *sub_convert_ctx;
-    int eof;
+/**
+ * Header of a proxy sidecar file. It is followed by fixed size records, each
+ * an int64_t pts in AV_TIME_BASE units and a YUV420P picture of width x height.
+ */
+typedef struct ProxyHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int64_t source_size;            // to notice a replaced source file
+    int64_t source_duration;
+    uint32_t complete;              // set once the whole source was converted
+    uint32_t reserved[7];
+} ProxyHeader;
 
-    char *filename;
+/**
+ * Low resolution, keyframe only copy of the video stream, generated on disk
+ * by a background thread and memory mapped for display while scrubbing.
+ */
+typedef struct Proxy
+{
+    SDL_Thread *tid;
+    SDL_mutex *mutex;               // protects nb_records and the mapping
+    int abort_request;
+    char *path;
+    int stream_index;
+    AVRational time_base;
+    AVCodecParameters *codecpar;
+    const AVCodec *codec;
     int width;
     int height;
-    int xleft;
-    int ytop;
-    int step;
+    size_t record_size;
+    int nb_records;                 // records written so far
+    int in_fd;
+    uint8_t *map;
+    size_t map_size;
+    int nb_hits;
+} Proxy;
 
-    int vfilter_idx;
+/**
+ * One bin of the waveform overview, all channels together, full scale is 32767.
+ */
+typedef struct PeakBin
+{
+    int16_t min;
+    int16_t max;
+    uint16_t rms;
+} PeakBin;
+
+/**
+ * Header of a peaks sidecar file. It is followed by the bins of every level,
+ * finest first, then by one byte per chunk set once the chunk is built, so an
+ * interrupted build resumes with the missing chunks.
+ */
+typedef struct PeaksHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t stream_index;
+    int32_t nb_chunks;
+    int64_t source_size;            // to notice a replaced source file
+    int64_t source_duration;
+    uint32_t complete;              // set once every chunk is built
+    uint32_t reserved[7];
+} PeaksHeader;
+
+/**
+ * Whole file waveform overview of the audio stream, built by worker threads
+ * that each decode chunks of the file into a shared memory mapped sidecar,
+ * and drawn as a seek bar.
+ */
+typedef struct Peaks
+{
+    SDL_Thread *tids[PEAKS_MAX_WORKERS];
+    int nb_workers;
+    int abort_request;
+    SDL_atomic_t next_chunk;        // next chunk a worker claims
+    SDL_atomic_t nb_done;
+    char *path;
+    int stream_index;
+    AVRational time_base;
+    int64_t start_time;             // of the file, in AV_TIME_BASE units
+    int64_t duration;
+    AVCodecParameters *codecpar;
+    const AVCodec *codec;
+    int nb_chunks;
+    int nb_bins[PEAKS_NB_LEVELS];   // covering the duration, the levels are nb_chunks long
+    PeakBin *levels[PEAKS_NB_LEVELS];
+    uint8_t *done;                  // per chunk, set once its bins are written, NULL until mapped
+    uint8_t *map;
+    size_t map_size;
+} Peaks;
+
+/**
+ * Events per trace chunk, and chunks a thread may allocate before events
+ * are dropped.
+ */
+#define TRACE_CHUNK_SIZE 4096
+#define TRACE_MAX_CHUNKS 256
+
+/**
+ * Records a begin or end event of a pipeline stage when -trace is given, a
+ * single well predicted branch otherwise. pts is in seconds, NAN if unknown.
+ */
+#define TRACE_BEGIN(name, pts, serial) do { if (trace_enabled) trace_event('B', name, pts, serial); } while (0)
+#define TRACE_END(name, pts, serial)   do { if (trace_enabled) trace_event('E', name, pts, serial); } while (0)
+
+/**
+ * Iterations of the -bench_micro benchmarks.
+ */
+#define BENCH_NB_PACKETS 1000000
+#define BENCH_PACKET_SIZE 4096
+#define BENCH_NB_FRAMES 200000
+#define BENCH_NB_AUDIO_FRAMES 20000
+#define BENCH_NB_UPLOADS 200
+#define BENCH_NB_SEEKS 100              // at most HISTOGRAM_NB_SAMPLES, for exact percentiles
+
+/**
+ * Stages of a seek, timed from the input event to the first frame presented.
+ */
+enum
+{
+    SEEK_STAGE_INPUT,               // input event to stream_seek()
+    SEEK_STAGE_QUEUED,              // stream_seek() to read_thread picking it up
+    SEEK_STAGE_SEEK,                // avformat_seek_file()
+    SEEK_STAGE_FLUSH,               // packet queue flush
+    SEEK_STAGE_DECODE,              // flush to first frame decoded with the new serial
+    SEEK_STAGE_PRESENT,             // first frame decoded to presented
+    SEEK_STAGE_TOTAL,               // input event to first frame presented
+    SEEK_NB_STAGES
+};
+
+/**
+ * Timestamps of the executed seek not presented yet, av_gettime_relative()
+ * microseconds, AV_NOPTS_VALUE while a stage is not reached.
+ */
+typedef struct SeekTiming
+{
+    int64_t input;
+    int64_t request;
+    int64_t start;
+    int64_t seeked;
+    int64_t flushed;
+    int64_t decoded;
+} SeekTiming;
+
+/**
+ * State of -seek_test.
+ */
+typedef struct SeekTest
+{
+    AVLFG lfg;
+    int nb_done;
+    int nb_timeouts;
+    int64_t last_request;
+} SeekTest;
+
+/**
+ * Where the playback timeline reads the time from: the monotonic wall clock,
+ * or with -virtual_clock a timeline that only moves when the main loop sleeps.
+ */
+typedef struct TimeSource
+{
+    const char *name;
+    int64_t (*now)(void);           // microseconds
+    void (*sleep)(int64_t us);
+} TimeSource;
+
+/**
+ * A seek issued at a point of the virtual timeline, see -virtual_seeks.
+ */
+typedef struct VirtualSeek
+{
+    int64_t at;                     // virtual time, in microseconds
+    int64_t target;                 // in AV_TIME_BASE units
+} VirtualSeek;
+
+/**
+ * The null audio sink of -virtual_clock: plays device buffers on the virtual
+ * timeline instead of an audio device.
+ */
+typedef struct VirtualSink
+{
+    uint8_t *buf;
+    unsigned int buf_size;
+    int64_t next_callback;          // virtual time of the next buffer, AV_NOPTS_VALUE before the first
+    int next_seek;                  // index in virtual_seeks
+} VirtualSink;
+
+/**
+ * Allocation sites of the per-frame paths accounted by -alloc_stats.
+ */
+enum
+{
+    ALLOC_SITE_PACKET_NODE,
+    ALLOC_SITE_TEXTURE,
+    ALLOC_SITE_RDFT,
+    ALLOC_SITE_AUDIO_BUF,
+    ALLOC_SITE_SAMPLES,
+    ALLOC_SITE_ALL,                 // every malloc() of the process, when interposed
+    ALLOC_NB_SITES
+};
+
+/**
+ * Counters of one allocation site. The counters are updated from any thread
+ * under lock, a spinlock since it is taken inside malloc(), the last_*
+ * snapshots by the main thread only.
+ */
+typedef struct AllocSite
+{
+    const char *name;
+    SDL_SpinLock lock;
+    int64_t count;
+    int64_t bytes;
+    int64_t live;                   // bytes allocated and not released yet
+    int64_t high_water;             // maximum of live
+    int64_t last_count;
+    int64_t last_bytes;
+} AllocSite;
+
+/**
+ * A message of the log ring. seq equals the ring position while the slot is
+ * free for that position, and the position + 1 once the message is written.
+ */
+typedef struct LogSlot
+{
+    SDL_atomic_t seq;
+    int level;
+    char msg[LOG_MSG_SIZE];
+} LogSlot;
+
+/**
+ * Bounded multi producer, single consumer queue of hot path messages.
+ */
+typedef struct LogRing
+{
+    LogSlot slots[LOG_RING_SIZE];
+    SDL_atomic_t tail;              // next position producers claim
+    int head;                       // next position the log thread reads
+    SDL_atomic_t nb_dropped;
+    SDL_atomic_t abort_request;
+    SDL_Thread *tid;
+} LogRing;
+
+/**
+ *
+ */
+typedef struct TraceEvent
+{
+    int64_t ts;
+    const char *name;               // static string
+    double pts;
+    int serial;
+    char phase;                     // 'B'egin or 'E'nd
+} TraceEvent;
+
+/**
+ *
+ */
+typedef struct TraceChunk
+{
+    TraceEvent events[TRACE_CHUNK_SIZE];
+    struct TraceChunk *next;
+} TraceChunk;
+
+/**
+ * Events of one thread. Only the owning thread appends, the buffers are read
+ * at exit once every thread has been joined, so no lock is needed.
+ */
+typedef struct TraceBuffer
+{
+    SDL_threadID tid;
+    const char *name;
+    TraceChunk *first;
+    TraceChunk *last;
+    int nb_events;                  // used in the last chunk
+    int nb_chunks;
+    int64_t nb_dropped;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+/**
+ * Threads whose real and CPU time are reported in benchmark mode.
+ */
+enum {
+    BENCHMARK_THREAD_READ,
+    BENCHMARK_THREAD_VIDEO,
+    BENCHMARK_THREAD_AUDIO,
+    BENCHMARK_THREAD_SUBTITLE,
+    BENCHMARK_THREAD_VIDEO_SINK,
+    BENCHMARK_THREAD_AUDIO_SINK,
+    BENCHMARK_NB_THREADS
+};
+
+/**
+ *
+ */
+typedef struct BenchmarkThread
+{
+    int64_t real_time;
+    int64_t cpu_time;
+} BenchmarkThread;
+
+/**
+ * Throughput counters of the -benchmark mode.
+ */
+typedef struct Benchmark
+{
+    int64_t start_time;
+    int64_t end_time;
+    BenchmarkThread threads[BENCHMARK_NB_THREADS];
+    int64_t nb_video_frames;
+    int64_t nb_audio_frames;
+    int64_t nb_audio_samples;
+} Benchmark;
+
+/**
+ * State of the -metrics output.
+ */
+typedef struct Metrics
+{
+    int fd;                         // -1 while closed
+    int failed;                     // the output could not be opened, give up
+    int header_written;
+    int64_t last_time;
+    int last_decoded_frames;
+    int64_t nb_lost;                // lines not written because the reader was slow or gone
+} Metrics;
+
+/**
+ * Decoded pictures of one GOP, or of its tail when the GOP does not fit in
+ * half of the reverse playback budget. Covers [start_pts, end_pts).
+ */
+typedef struct ReverseChunk
+{
+    int64_t start_pts;
+    int64_t end_pts;
+    int64_t key_pts;
+    AVFrame **frames;               // in pts order, pts in AV_TIME_BASE units
+    int nb_frames;
+    size_t mem;
+    struct ReverseChunk *next;
+} ReverseChunk;
+
+/**
+ * State of reverse stepping and playback. A thread with its own demuxer and
+ * decoder keeps the GOP before the displayed picture and the one before it
+ * decoded, the pictures are shown through the preview frame.
+ */
+typedef struct Reverser
+{
+    SDL_Thread *tid;
+    SDL_mutex *mutex;               // protects everything below
+    SDL_cond *cond;
+    int abort_request;
+    int generation;                 // bumped when the position jumps, cancels in-flight decodes
+    int active;
+    int playing;
+    int step;
+    int stream_index;
+    AVRational time_base;
+    AVCodecParameters *codecpar;
+    const AVCodec *codec;
+    int64_t pos;                    // pts of the displayed picture
+    int64_t bof_pts;                // no picture before this one
+    double frame_timer;
+    double frame_duration;
+    ReverseChunk *chunks;
+    size_t mem;
+    int64_t blocked_end;            // end of the GOP ahead that did not fit, AV_NOPTS_VALUE if none
+    size_t blocked_mem;             // and its size
+    int nb_stalls;
+} Reverser;
+
+/**
+ *
+ */
+typedef struct VideoState
+{
+    SDL_Thread *read_tid;
+    AVInputFormat *iformat;
+    int abort_request;
+    int force_refresh;
+    int paused;
+    int last_paused;
+    int queue_attachments_req;
+    int seek_req;
+    int seek_flags;
+    int64_t seek_pos;
+    int64_t seek_rel;
+    int64_t seek_req_time;          // time of the most recent seek request, latest one wins
+    int64_t seek_input_time;        // time of the input event behind it
+    int64_t input_time;             // time of the input event being handled, AV_NOPTS_VALUE otherwise
+    SDL_mutex *seek_mutex;          // protects the seek_* request and latency fields
+    int seek_serial;                // packet queue serial started by the last executed seek
+    int64_t seek_latency_start;     // request time of the executed seek not yet displayed
+    int seek_nb_requests;
+    int seek_nb_coalesced;          // requests overwritten before read_thread picked them up
+    int seek_nb_cancelled;          // executed seeks superseded before showing a frame
+    Histogram seek_latency;         // request to first displayed frame, in microseconds
+    SeekTiming seek_timing;
+    Histogram seek_stages[SEEK_NB_STAGES];
+    SeekTest seek_test;
+    SyncStats sync_stats[AV_SYNC_NB_TYPES]; // indexed by the master sync type in charge
+    int64_t seek_latency_last;      // latency of the last displayed seek, in microseconds
+
+    Prefetcher prefetch;
+    Proxy proxy;
+    Peaks peaks;
+    Reverser reverse;
+    Benchmark bench;
+    Metrics metrics;
+    VirtualSink virtual_sink;
+    int64_t prefetch_skip_dts;      // video packets up to this dts were queued from the prefetcher
+    int prefetch_skip_count;        // packets queued from the prefetcher the demuxer has not returned yet
+
+    int seek_exact;                 // the pending seek drops the frames before its target
+    int preroll_video_serial;       // videoq serial of the last exact seek, -1 if none
+    int preroll_audio_serial;       // audioq serial of the last exact seek, -1 if none
+    double preroll_target;          // target of the last exact seek, in seconds
+
+    ScrubCache scrub_cache;
+    int64_t scrub_target;           // drag position not yet seeked to, AV_NOPTS_VALUE if none
+    int64_t scrub_last_motion;
+
+    SDL_mutex *preview_mutex;       // protects the preview_* fields
+    AVFrame *preview_frame;         // shown instead of the picture queue, see set_preview_frame()
+    int preview_serial;
+    int preview_uploaded;
+    double presented_pts;           // picture drawn by the current video_display()
+    int presented_serial;           // -1 if none
+    int read_pause_return;
+    AVFormatContext *ic;
+    int realtime;
+
+    Clock audclk;
+    Clock vidclk;
+    Clock extclk;
+
+    FrameQueue pictq;
+    FrameQueue subpq;
+    FrameQueue sampq;
+
+    Decoder auddec;
+    Decoder viddec;
+    Decoder subdec;
+
+    int audio_stream;
+
+    int av_sync_type;
+
+    double audio_clock;
+    int audio_clock_serial;
+    double audio_diff_cum; /* used for AV difference average computation */
+    double audio_diff_avg_coef;
+    double audio_diff_threshold;
+    int audio_diff_avg_count;
+    AVStream *audio_st;
+    PacketQueue audioq;
+    int audio_hw_buf_size;
+    int audio_buf_samples;          // samples per callback the device was opened with
+    int audio_underruns_handled;    // audio_underruns already answered by a bigger buffer
+    int64_t audio_adapt_time;       // last time the device was reopened
+    SDL_Thread *audio_push_tid;     // -audio_backend queue
+    uint8_t *audio_push_buf;        // samples at the current volume for SDL_QueueAudio()
+    unsigned int audio_push_buf_size;
+    int64_t audio_output_cpu;       // cpu time of the callback or of the push thread, in us
+    struct Stretch *stretch;        // time stretching at playback speeds other than 1x
+    int stretch_serial;             // serial the stretcher holds samples of, -1 when bypassed
+    double stretch_delay;           // input the stretcher has not played yet, in seconds
+    Meter meter;                    // -meter, fed by the audio thread
+    int meter_seq_shown;            // meter.seq of the levels on screen
+    uint8_t *audio_buf;
+    uint8_t *audio_buf1;
+    unsigned int audio_buf_size; /* in bytes */
+    unsigned int audio_buf1_size;
+    int audio_buf_index; /* in bytes */
+    int audio_write_buf_size;
+    int audio_volume;
+    int muted;
+    struct AudioParams audio_src;
+    struct AudioParams audio_filter_src;
+    struct AudioParams audio_tgt;
+    struct SwrContext *swr_ctx;
+    int frame_drops_early;
+    int frame_drops_late;
+    int frame_drops_preroll;        // decoded before the target of an exact seek
+    int nb_decoded_frames;
+    int audio_underruns;            // callbacks that had to output silence
+
+    enum ShowMode
+    {
+        SHOW_MODE_NONE = -1,
+        SHOW_MODE_VIDEO = 0,
+        SHOW_MODE_WAVES,
+        SHOW_MODE_RDFT,
+        SHOW_MODE_NB
+    } show_mode;
+
+    SampleCapture capture;
+    int last_i_start;
+    Spectrum spectrum;
+    int xpos;
+    double last_vis_time;
+    SDL_Texture *vis_texture;
+    SDL_Texture *sub_texture;
+    SDL_Texture *vid_texture;
+
+    int subtitle_stream;
+    AVStream *subtitle_st;
+    PacketQueue subtitleq;
+
+    double frame_timer;
+    double frame_last_returned_time;
+    double frame_last_filter_delay;
+    double speed_last_kept;         // pts of the last frame kept above 1x
+    enum AVDiscard skip_frame;      // skip_frame of the video decoder at 1x
+    int video_stream;
+    AVStream *video_st;
+    PacketQueue videoq;
+    double max_frame_duration;      // maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
+    struct SwsContext *img_convert_ctx;
+    struct SwsContext *sub_convert_ctx;
+    int eof;
+
+    char *filename;
+    int width;
+    int height;
+    int xleft;
+    int ytop;
+    int step;
+
+    int vfilter_idx;
     AVFilterContext *in_video_filter;   // the first filter in the video chain
     AVFilterContext *out_video_filter;  // the last filter in the video chain
     AVFilterContext *in_audio_filter;   // the first filter in the audio chain
@@ -700,73 +1582,194 @@ static const char *video_codec_name;
 double rdftspeed = 0.02;
 
 //
-static int64_t cursor_last_shown;
+static int prefetch_mem = 32;
 
 //
-static int cursor_hidden = 0;
+static int prefetch_keyframe = 1;
 
 //
-static const char **vfilters_list = NULL;
+static int scrub_cache_mem = 64;
 
 //
-static int nb_vfilters = 0;
+static int reverse_mem = 256;
 
 //
-static char *afilters = NULL;
+static int benchmark;
 
 //
-static int autorotate = 1;
+static int benchmark_filters;
 
 //
-static int find_stream_info = 1;
+static int bench_micro;
 
 //
-static int is_full_screen;
+static int bench_failures;
 
 //
-static int64_t audio_callback_time;
+static LogRing log_ring;
 
 //
-static AVPacket flush_pkt;
+static int virtual_clock;
 
 //
-static SDL_Window *window;
+static double clock_drift;
 
 //
-static SDL_Renderer *renderer;
+static VirtualSeek *virtual_seeks;
 
 //
-static SDL_RendererInfo renderer_info = {0};
+static int nb_virtual_seeks;
 
 //
-static SDL_AudioDeviceID audio_dev;
+static int64_t virtual_time;
 
-/**
- *
- */
-static const struct TextureFormatEntry
-{
-    enum AVPixelFormat format;
-    int texture_fmt;
-} sdl_texture_format_map[] = {
-        { AV_PIX_FMT_RGB8,           SDL_PIXELFORMAT_RGB332 },
-        { AV_PIX_FMT_RGB444,         SDL_PIXELFORMAT_RGB444 },
-        { AV_PIX_FMT_RGB555,         SDL_PIXELFORMAT_RGB555 },
-        { AV_PIX_FMT_BGR555,         SDL_PIXELFORMAT_BGR555 },
-        { AV_PIX_FMT_RGB565,         SDL_PIXELFORMAT_RGB565 },
-        { AV_PIX_FMT_BGR565,         SDL_PIXELFORMAT_BGR565 },
-        { AV_PIX_FMT_RGB24,          SDL_PIXELFORMAT_RGB24 },
-        { AV_PIX_FMT_BGR24,          SDL_PIXELFORMAT_BGR24 },
-        { AV_PIX_FMT_0RGB32,         SDL_PIXELFORMAT_RGB888 },
-        { AV_PIX_FMT_0BGR32,         SDL_PIXELFORMAT_BGR888 },
-        { AV_PIX_FMT_NE(RGB0, 0BGR), SDL_PIXELFORMAT_RGBX8888 },
-        { AV_PIX_FMT_NE(BGR0, 0RGB), SDL_PIXELFORMAT_BGRX8888 },
-        { AV_PIX_FMT_RGB32,          SDL_PIXELFORMAT_ARGB8888 },
-        { AV_PIX_FMT_RGB32_1,        SDL_PIXELFORMAT_RGBA8888 },
-        { AV_PIX_FMT_BGR32,          SDL_PIXELFORMAT_ABGR8888 },
-        { AV_PIX_FMT_BGR32_1,        SDL_PIXELFORMAT_BGRA8888 },
-        { AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
-        { AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
+// the main loop moves virtual_time, the decoder and audio threads read it
+static SDL_SpinLock virtual_time_lock;
+
+// set once at startup, before any thread reads the time
+static const TimeSource *time_source;
+
+//
+static int alloc_stats;
+
+//
+static int alloc_check;
+
+//
+static int alloc_check_failures;
+
+//
+static AllocSite alloc_sites[ALLOC_NB_SITES] = {
+    [ALLOC_SITE_PACKET_NODE] = { "packet_queue_put_private" },
+    [ALLOC_SITE_TEXTURE]     = { "realloc_texture" },
+    [ALLOC_SITE_RDFT]        = { "spectrum_update rdft" },
+    [ALLOC_SITE_AUDIO_BUF]   = { "audio_decode_frame audio_buf1" },
+    [ALLOC_SITE_SAMPLES]     = { "sample_capture_add samples" },
+    [ALLOC_SITE_ALL]         = { "all malloc() calls" },
+};
+
+//
+static const char *trace_filename;
+
+//
+static const char *metrics_filename;
+
+//
+static int sync_report;
+
+//
+static int audio_adaptive;
+
+//
+static int audio_backend_queue;
+
+//
+static double playback_speed = 1.0;
+
+//
+static int show_meter;
+
+//
+static int seek_test;
+
+//
+static const char *metrics_format = "json";
+
+//
+static int metrics_interval = 1000;
+
+//
+static int trace_enabled;
+
+//
+static SDL_TLSID trace_tls;
+
+//
+static int64_t trace_start;
+
+// every thread's trace buffer, pushed lock-free
+static TraceBuffer *trace_buffers;
+
+//
+static const char *bench_results;
+
+//
+static int proxy_enable = 0;
+
+//
+static int proxy_height = 270;
+
+//
+static int peaks_enable = 0;
+
+//
+static int64_t cursor_last_shown;
+
+//
+static int cursor_hidden = 0;
+
+//
+static const char **vfilters_list = NULL;
+
+//
+static int nb_vfilters = 0;
+
+//
+static char *afilters = NULL;
+
+//
+static int autorotate = 1;
+
+//
+static int find_stream_info = 1;
+
+//
+static int is_full_screen;
+
+//
+static int64_t audio_callback_time;
+
+//
+static AVPacket flush_pkt;
+
+//
+static SDL_Window *window;
+
+//
+static SDL_Renderer *renderer;
+
+//
+static SDL_RendererInfo renderer_info = {0};
+
+//
+static SDL_AudioDeviceID audio_dev;
+
+/**
+ *
+ */
+static const struct TextureFormatEntry
+{
+    enum AVPixelFormat format;
+    int texture_fmt;
+} sdl_texture_format_map[] = {
+        { AV_PIX_FMT_RGB8,           SDL_PIXELFORMAT_RGB332 },
+        { AV_PIX_FMT_RGB444,         SDL_PIXELFORMAT_RGB444 },
+        { AV_PIX_FMT_RGB555,         SDL_PIXELFORMAT_RGB555 },
+        { AV_PIX_FMT_BGR555,         SDL_PIXELFORMAT_BGR555 },
+        { AV_PIX_FMT_RGB565,         SDL_PIXELFORMAT_RGB565 },
+        { AV_PIX_FMT_BGR565,         SDL_PIXELFORMAT_BGR565 },
+        { AV_PIX_FMT_RGB24,          SDL_PIXELFORMAT_RGB24 },
+        { AV_PIX_FMT_BGR24,          SDL_PIXELFORMAT_BGR24 },
+        { AV_PIX_FMT_0RGB32,         SDL_PIXELFORMAT_RGB888 },
+        { AV_PIX_FMT_0BGR32,         SDL_PIXELFORMAT_BGR888 },
+        { AV_PIX_FMT_NE(RGB0, 0BGR), SDL_PIXELFORMAT_RGBX8888 },
+        { AV_PIX_FMT_NE(BGR0, 0RGB), SDL_PIXELFORMAT_BGRX8888 },
+        { AV_PIX_FMT_RGB32,          SDL_PIXELFORMAT_ARGB8888 },
+        { AV_PIX_FMT_RGB32_1,        SDL_PIXELFORMAT_RGBA8888 },
+        { AV_PIX_FMT_BGR32,          SDL_PIXELFORMAT_ABGR8888 },
+        { AV_PIX_FMT_BGR32_1,        SDL_PIXELFORMAT_BGRA8888 },
+        { AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
+        { AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
         { AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
         { AV_PIX_FMT_NONE,           SDL_PIXELFORMAT_UNKNOWN },
 };
@@ -1094,6 +2097,395 @@ static inline int64_t get_valid_channel_layout(int64_t channel_layout, int chann
     }
 }
 
+/**
+ * Queue a hot path message for the log thread, never blocking the caller.
+ * Producers claim a slot by advancing the tail and publish it through its
+ * sequence number; a full ring drops the message.
+ */
+static void hot_log_post(int level, const char *fmt, ...)
+{
+    LogSlot *slot;
+    va_list vl;
+    int pos, seq;
+
+    if (level > av_log_get_level())
+        return;
+
+    for (;;) {
+        pos  = SDL_AtomicGet(&log_ring.tail);
+        slot = &log_ring.slots[pos & (LOG_RING_SIZE - 1)];
+        seq  = SDL_AtomicGet(&slot->seq);
+        if (seq - pos < 0) {
+            /* the slot still holds a message of the previous lap: full */
+            SDL_AtomicAdd(&log_ring.nb_dropped, 1);
+            return;
+        }
+        if (seq == pos && SDL_AtomicCAS(&log_ring.tail, pos, pos + 1))
+            break;
+    }
+
+    slot->level = level;
+    va_start(vl, fmt);
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, vl);
+    va_end(vl);
+    SDL_AtomicSet(&slot->seq, pos + 1);
+}
+
+/* write the queued messages in order, returns the number written */
+static int log_ring_drain(void)
+{
+    int nb = 0;
+
+    for (;;) {
+        LogSlot *slot = &log_ring.slots[log_ring.head & (LOG_RING_SIZE - 1)];
+        if (SDL_AtomicGet(&slot->seq) != log_ring.head + 1)
+            break;
+        av_log(NULL, slot->level, "%s", slot->msg);
+        SDL_AtomicSet(&slot->seq, log_ring.head + LOG_RING_SIZE);
+        log_ring.head++;
+        nb++;
+    }
+    return nb;
+}
+
+static int log_thread(void *arg)
+{
+    int nb_dropped, nb_reported = 0;
+
+    while (!SDL_AtomicGet(&log_ring.abort_request)) {
+        if (!log_ring_drain())
+            SDL_Delay(LOG_DRAIN_INTERVAL);
+        nb_dropped = SDL_AtomicGet(&log_ring.nb_dropped);
+        if (nb_dropped != nb_reported) {
+            av_log(NULL, AV_LOG_WARNING, "%d log messages dropped\n", nb_dropped - nb_reported);
+            nb_reported = nb_dropped;
+        }
+    }
+    log_ring_drain();
+    return 0;
+}
+
+static void log_ring_init(void)
+{
+    int i;
+
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        SDL_AtomicSet(&log_ring.slots[i].seq, i);
+    if (!(log_ring.tid = SDL_CreateThread(log_thread, "log", NULL)))
+        av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s, hot path messages are not logged\n", SDL_GetError());
+}
+
+/* stop the log thread once it wrote what was queued */
+static void log_ring_uninit(void)
+{
+    if (!log_ring.tid)
+        return;
+    SDL_AtomicSet(&log_ring.abort_request, 1);
+    SDL_WaitThread(log_ring.tid, NULL);
+    log_ring.tid = NULL;
+}
+
+/* account an allocation made by the player at site */
+static void alloc_stats_add(int site, size_t size)
+{
+    AllocSite *s = &alloc_sites[site];
+
+    if (!alloc_stats)
+        return;
+    SDL_AtomicLock(&s->lock);
+    s->count++;
+    s->bytes += size;
+    s->live  += size;
+    s->high_water = FFMAX(s->high_water, s->live);
+    SDL_AtomicUnlock(&s->lock);
+}
+
+/* account the release of an allocation made at site */
+static void alloc_stats_free(int site, size_t size)
+{
+    AllocSite *s = &alloc_sites[site];
+
+    if (!alloc_stats)
+        return;
+    SDL_AtomicLock(&s->lock);
+    s->live -= size;
+    SDL_AtomicUnlock(&s->lock);
+}
+
+#if HAVE_MALLOC_INTERPOSE
+/*
+ * Every allocation of the process, FFmpeg and SDL included, goes through these
+ * once the dynamic linker bound them in place of the C library's.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* the process wide row only counts allocations, live bytes are not tracked */
+static void alloc_stats_add_any(size_t size)
+{
+    AllocSite *s = &alloc_sites[ALLOC_SITE_ALL];
+
+    if (!alloc_stats)
+        return;
+    SDL_AtomicLock(&s->lock);
+    s->count++;
+    s->bytes += size;
+    SDL_AtomicUnlock(&s->lock);
+}
+
+void *malloc(size_t size)
+{
+    alloc_stats_add_any(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    /* an overflowing size fails in the C library without allocating */
+    if (!size || nmemb <= SIZE_MAX / size)
+        alloc_stats_add_any(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    /* realloc(p, 0) frees, shrinking or growing within the block allocates nothing */
+    if (!ptr || (size && size > malloc_usable_size(ptr)))
+        alloc_stats_add_any(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    alloc_stats_add_any(size);
+    if (!(*memptr = __libc_memalign(alignment, size)))
+        return ENOMEM;
+    return 0;
+}
+#endif
+
+/* print the allocations of the last second, busiest sites first, and check the steady state */
+static void alloc_stats_update(VideoState *is)
+{
+    static int64_t last_time, first_frame_time;
+    static int last_frames;
+    int64_t cur_time = av_gettime_relative();
+    int64_t count[ALLOC_NB_SITES], bytes[ALLOC_NB_SITES], live, high_water, player_count = 0;
+    int order[ALLOC_NB_SITES];
+    int i, j, frames;
+
+    if (!first_frame_time && is->nb_decoded_frames)
+        first_frame_time = cur_time;
+    if (last_time && cur_time - last_time < 1000000)
+        return;
+
+    for (i = 0; i < ALLOC_NB_SITES; i++) {
+        AllocSite *s = &alloc_sites[i];
+        int64_t c, b;
+
+        SDL_AtomicLock(&s->lock);
+        c = s->count;
+        b = s->bytes;
+        SDL_AtomicUnlock(&s->lock);
+        count[i] = c - s->last_count;
+        bytes[i] = b - s->last_bytes;
+        s->last_count = c;
+        s->last_bytes = b;
+        if (i != ALLOC_SITE_ALL)
+            player_count += count[i];
+
+        for (j = i; j > 0 && count[order[j - 1]] < count[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    frames = is->nb_decoded_frames - last_frames;
+    last_frames = is->nb_decoded_frames;
+
+    if (last_time) {
+        av_log(NULL, AV_LOG_INFO, "allocations in the last second (%d frames):\n", frames);
+        for (i = 0; i < FFMIN(ALLOC_STATS_TOP, ALLOC_NB_SITES); i++) {
+            AllocSite *s = &alloc_sites[order[i]];
+            if (!count[order[i]])
+                break;
+            SDL_AtomicLock(&s->lock);
+            live       = s->live;
+            high_water = s->high_water;
+            SDL_AtomicUnlock(&s->lock);
+            av_log(NULL, AV_LOG_INFO, "  %-32s count=%6"PRId64" bytes=%9"PRId64" per_frame=%6.2f live=%9"PRId64" high_water=%9"PRId64"\n",
+                   s->name, count[order[i]], bytes[order[i]], frames ? count[order[i]] / (double)frames : 0.0,
+                   live, high_water);
+        }
+    }
+
+    if (alloc_check && first_frame_time && cur_time - first_frame_time >= ALLOC_CHECK_WARMUP && player_count) {
+        av_log(NULL, AV_LOG_ERROR, "alloc check: %"PRId64" allocations by the player in steady state\n", player_count);
+        alloc_check_failures += (int)FFMIN(player_count, INT_MAX - alloc_check_failures);
+    }
+    last_time = cur_time;
+}
+
+static int64_t wall_time_now(void)
+{
+    return av_gettime_relative();
+}
+
+static void wall_time_sleep(int64_t us)
+{
+    if (us > 0)
+        av_usleep(us);
+}
+
+/* the virtual timeline only moves when the main loop sleeps */
+static int64_t virtual_time_now(void)
+{
+    int64_t now;
+
+    SDL_AtomicLock(&virtual_time_lock);
+    now = virtual_time;
+    SDL_AtomicUnlock(&virtual_time_lock);
+    return now;
+}
+
+static void virtual_time_sleep(int64_t us)
+{
+    if (us <= 0)
+        return;
+    SDL_AtomicLock(&virtual_time_lock);
+    virtual_time += us;
+    SDL_AtomicUnlock(&virtual_time_lock);
+}
+
+static const TimeSource wall_time_source    = { "wall",    wall_time_now,    wall_time_sleep };
+static const TimeSource virtual_time_source = { "virtual", virtual_time_now, virtual_time_sleep };
+
+/* current time of the playback timeline, in microseconds */
+static int64_t player_time(void)
+{
+    return time_source->now();
+}
+
+/* let the playback timeline move by us microseconds */
+static void player_sleep(int64_t us)
+{
+    time_source->sleep(us);
+}
+
+/* the calling thread's trace buffer, registered on first use */
+static TraceBuffer *trace_get_buffer(void)
+{
+    TraceBuffer *b = SDL_TLSGet(trace_tls);
+
+    if (b || !(b = av_mallocz(sizeof(*b))))
+        return b;
+    b->tid = SDL_ThreadID();
+    SDL_TLSSet(trace_tls, b, NULL);
+    do {
+        b->next = trace_buffers;
+    } while (!SDL_AtomicCASPtr((void **)&trace_buffers, b->next, b));
+    return b;
+}
+
+/* record an event in the calling thread's buffer, only that thread writes to it */
+static void trace_event(char phase, const char *name, double pts, int serial)
+{
+    TraceBuffer *b = trace_get_buffer();
+    TraceEvent *e;
+
+    if (!b)
+        return;
+    if (!b->last || b->nb_events == TRACE_CHUNK_SIZE) {
+        TraceChunk *c;
+        if (b->nb_chunks >= TRACE_MAX_CHUNKS || !(c = av_malloc(sizeof(*c)))) {
+            b->nb_dropped++;
+            return;
+        }
+        c->next = NULL;
+        if (b->last)
+            b->last->next = c;
+        else
+            b->first = c;
+        b->last = c;
+        b->nb_chunks++;
+        b->nb_events = 0;
+    }
+    e = &b->last->events[b->nb_events++];
+    e->ts     = av_gettime_relative();
+    e->name   = name;
+    e->phase  = phase;
+    e->pts    = pts;
+    e->serial = serial;
+}
+
+/* name the calling thread in the trace */
+static void trace_thread_name(const char *name)
+{
+    TraceBuffer *b;
+
+    if (trace_enabled && (b = trace_get_buffer()))
+        b->name = name;
+}
+
+static void trace_init(void)
+{
+    trace_tls     = SDL_TLSCreate();
+    trace_start   = av_gettime_relative();
+    trace_enabled = !!trace_tls;
+    trace_thread_name("main");
+}
+
+/* write all the buffers as Chrome trace JSON, called once every thread is gone */
+static void trace_flush(void)
+{
+    TraceBuffer *b, *next;
+    FILE *f;
+    int first = 1;
+
+    if (!trace_enabled)
+        return;
+    trace_enabled = 0;
+
+    if (!(f = fopen(trace_filename, "w")))
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s': %s\n", trace_filename, strerror(errno));
+    if (f)
+        fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    for (b = trace_buffers; b; b = next) {
+        TraceChunk *c, *cnext;
+
+        if (f && b->name) {
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", (unsigned long)b->tid, b->name);
+            first = 0;
+        }
+        for (c = b->first; c; c = cnext) {
+            int i, nb = c == b->last ? b->nb_events : TRACE_CHUNK_SIZE;
+            for (i = 0; f && i < nb; i++) {
+                TraceEvent *e = &c->events[i];
+                fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %"PRId64", \"pid\": 1, \"tid\": %lu, \"args\": {\"serial\": %d",
+                        first ? "" : ",\n", e->name, e->phase, e->ts - trace_start, (unsigned long)b->tid, e->serial);
+                if (!isnan(e->pts))
+                    fprintf(f, ", \"pts\": %0.6f", e->pts);
+                fprintf(f, "}}");
+                first = 0;
+            }
+            cnext = c->next;
+            av_free(c);
+        }
+        if (b->nb_dropped)
+            av_log(NULL, AV_LOG_WARNING, "trace: dropped %"PRId64" events of thread %lu\n", b->nb_dropped, (unsigned long)b->tid);
+        next = b->next;
+        av_free(b);
+    }
+    trace_buffers = NULL;
+
+    if (f) {
+        fprintf(f, "\n]}\n");
+        fclose(f);
+    }
+}
+
 /**
  * Put the given AVPacket in the given PacketQueue.
  *
@@ -1113,9 +2505,13 @@ static int packet_queue_put_private(PacketQueue *queue, AVPacket *packet)
         return -1;
     }
 
-    pkt1 = av_malloc(sizeof(MyAVPacketList));
-    if (!pkt1)
-        return -1;
+    if ((pkt1 = queue->free_pkt)) {
+        queue->free_pkt = pkt1->next;
+    } else {
+        if (!(pkt1 = av_malloc(sizeof(MyAVPacketList))))
+            return -1;
+        alloc_stats_add(ALLOC_SITE_PACKET_NODE, sizeof(MyAVPacketList));
+    }
     pkt1->pkt = *packet;
     pkt1->next = NULL;
     if (packet == &flush_pkt)
@@ -1130,6 +2526,7 @@ static int packet_queue_put_private(PacketQueue *queue, AVPacket *packet)
     queue->nb_packets++;
     queue->size += pkt1->pkt.size + sizeof(*pkt1);
     queue->duration += pkt1->pkt.duration;
+    PLAYER_PROBE(packet_enqueue, pkt1->pkt.stream_index, pkt1->pkt.pts, pkt1->serial, queue->nb_packets, queue->size);
     /* XXX: should duplicate packet data in DV case */
     SDL_CondSignal(queue->cond);
     return 0;
@@ -1198,10 +2595,12 @@ static void packet_queue_flush(PacketQueue *q)
     MyAVPacketList *pkt, *pkt1;
 
     SDL_LockMutex(q->mutex);
+    PLAYER_PROBE(queue_flush, q->serial, q->nb_packets, q->size);
     for (pkt = q->first_pkt; pkt; pkt = pkt1) {
         pkt1 = pkt->next;
         av_packet_unref(&pkt->pkt);
-        av_freep(&pkt);
+        pkt->next = q->free_pkt;
+        q->free_pkt = pkt;
     }
     q->last_pkt = NULL;
     q->first_pkt = NULL;
@@ -1213,7 +2612,15 @@ static void packet_queue_flush(PacketQueue *q)
 
 static void packet_queue_destroy(PacketQueue *q)
 {
-    packet_queue_flush(q);
+    MyAVPacketList *pkt, *pkt1;
+
+    packet_queue_flush(q);
+    for (pkt = q->free_pkt; pkt; pkt = pkt1) {
+        pkt1 = pkt->next;
+        av_free(pkt);
+        alloc_stats_free(ALLOC_SITE_PACKET_NODE, sizeof(MyAVPacketList));
+    }
+    q->free_pkt = NULL;
     SDL_DestroyMutex(q->mutex);
     SDL_DestroyCond(q->cond);
 }
@@ -1259,10 +2666,12 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
             q->nb_packets--;
             q->size -= pkt1->pkt.size + sizeof(*pkt1);
             q->duration -= pkt1->pkt.duration;
+            PLAYER_PROBE(packet_dequeue, pkt1->pkt.stream_index, pkt1->pkt.pts, pkt1->serial, q->nb_packets, q->size);
             *pkt = pkt1->pkt;
             if (serial)
                 *serial = pkt1->serial;
-            av_free(pkt1);
+            pkt1->next = q->free_pkt;
+            q->free_pkt = pkt1;
             ret = 1;
             break;
         } else if (!block) {
@@ -1296,7 +2705,11 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
             do {
                 if (d->queue->abort_request)
                     return -1;
+                /* a seek flushed the queue: drop the pre-roll of the old position */
+                if (d->queue->serial != d->pkt_serial)
+                    break;
 
+                TRACE_BEGIN("receive_frame", NAN, d->pkt_serial);
                 switch (d->avctx->codec_type) {
                     case AVMEDIA_TYPE_VIDEO:
                         ret = avcodec_receive_frame(d->avctx, frame);
@@ -1323,6 +2736,17 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
                         }
                         break;
                 }
+                /* frame is NULL for subtitles, which return from here with ret 0 */
+                TRACE_END("receive_frame", ret < 0 || !frame || frame->pts == AV_NOPTS_VALUE ? NAN :
+                          frame->pts * av_q2d(d->avctx->codec_type == AVMEDIA_TYPE_AUDIO ?
+                                              (AVRational){1, frame->sample_rate} : d->avctx->pkt_timebase),
+                          d->pkt_serial);
+                if (ret >= 0 && frame)
+                    PLAYER_PROBE(frame_decoded, d->avctx->codec_type,
+                                 frame->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                                 av_rescale_q(frame->pts, d->avctx->codec_type == AVMEDIA_TYPE_AUDIO ?
+                                              (AVRational){1, frame->sample_rate} : d->avctx->pkt_timebase, AV_TIME_BASE_Q),
+                                 d->pkt_serial);
                 if (ret == AVERROR_EOF) {
                     d->finished = d->pkt_serial;
                     avcodec_flush_buffers(d->avctx);
@@ -1353,7 +2777,9 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
         } else {
             if (d->avctx->codec_type == AVMEDIA_TYPE_SUBTITLE) {
                 int got_frame = 0;
+                TRACE_BEGIN("decode_subtitle", NAN, d->pkt_serial);
                 ret = avcodec_decode_subtitle2(d->avctx, sub, &got_frame, &pkt);
+                TRACE_END("decode_subtitle", NAN, d->pkt_serial);
                 if (ret < 0) {
                     ret = AVERROR(EAGAIN);
                 } else {
@@ -1364,7 +2790,11 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
                     ret = got_frame ? 0 : (pkt.data ? AVERROR(EAGAIN) : AVERROR_EOF);
                 }
             } else {
-                if (avcodec_send_packet(d->avctx, &pkt) == AVERROR(EAGAIN)) {
+                double pts = pkt.pts == AV_NOPTS_VALUE ? NAN : pkt.pts * av_q2d(d->avctx->pkt_timebase);
+                TRACE_BEGIN("send_packet", pts, d->pkt_serial);
+                ret = avcodec_send_packet(d->avctx, &pkt);
+                TRACE_END("send_packet", pts, d->pkt_serial);
+                if (ret == AVERROR(EAGAIN)) {
                     av_log(d->avctx, AV_LOG_ERROR, "Receive_frame and send_packet both returned EAGAIN, which is an API violation.\n");
                     d->packet_pending = 1;
                     av_packet_move_ref(&d->pkt, &pkt);
@@ -1523,6 +2953,195 @@ static void decoder_abort(Decoder *d, FrameQueue *fq)
     packet_queue_flush(d->queue);
 }
 
+static void histogram_init(Histogram *h, const char *name, const char *unit)
+{
+    memset(h, 0, sizeof(*h));
+    h->name = name;
+    h->unit = unit;
+    h->min  = INT64_MAX;
+}
+
+static void histogram_add(Histogram *h, int64_t value)
+{
+    int bucket;
+
+    value  = FFMAX(value, 0);
+    bucket = 0;
+    while (bucket < HISTOGRAM_NB_BUCKETS - 1 && (value >> bucket))
+        bucket++;
+
+    if (h->count < HISTOGRAM_NB_SAMPLES)
+        h->samples[h->count] = value;
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += value;
+    h->min  = FFMIN(h->min, value);
+    h->max  = FFMAX(h->max, value);
+}
+
+static int histogram_cmp(const void *a, const void *b)
+{
+    return FFDIFFSIGN(*(const int64_t *)a, *(const int64_t *)b);
+}
+
+/* return the given percentile (0..100) by nearest rank, exact while all the
+   samples are kept, else an upper bound exact to a factor of 2 */
+static int64_t histogram_percentile(const Histogram *h, double percentile)
+{
+    int64_t rank, seen = 0;
+    int i;
+
+    if (!h->count)
+        return 0;
+
+    rank = av_clip64((int64_t)ceil(h->count * percentile / 100.0), 1, h->count);
+    if (h->count <= HISTOGRAM_NB_SAMPLES) {
+        int64_t sorted[HISTOGRAM_NB_SAMPLES];
+
+        memcpy(sorted, h->samples, h->count * sizeof(*sorted));
+        qsort(sorted, h->count, sizeof(*sorted), histogram_cmp);
+        return sorted[rank - 1];
+    }
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i >= HISTOGRAM_NB_BUCKETS - 1)
+        return h->max;
+    return av_clip64(i ? (INT64_C(1) << i) - 1 : 0, h->min, h->max);
+}
+
+static void histogram_print(const Histogram *h, int level)
+{
+    int64_t peak = 0;
+    int i, first = -1, last = -1;
+
+    if (!h->count)
+        return;
+
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+        if (!h->buckets[i])
+            continue;
+        if (first < 0)
+            first = i;
+        last = i;
+        peak = FFMAX(peak, h->buckets[i]);
+    }
+
+    av_log(NULL, level, "%s (%s): n=%"PRId64" min=%"PRId64" avg=%"PRId64" p50=%"PRId64" p95=%"PRId64" p99=%"PRId64" max=%"PRId64"\n",
+           h->name, h->unit, h->count, h->min, h->sum / h->count,
+           histogram_percentile(h, 50), histogram_percentile(h, 95), histogram_percentile(h, 99), h->max);
+    for (i = first; i <= last; i++) {
+        char bar[41];
+        int len = peak ? (int)(h->buckets[i] * 40 / peak) : 0;
+
+        memset(bar, '#', len);
+        bar[len] = 0;
+        av_log(NULL, level, "  [%10"PRId64", %10"PRId64"] %8"PRId64" %s\n",
+               i ? INT64_C(1) << (i - 1) : 0, i ? (INT64_C(1) << i) - 1 : 0, h->buckets[i], bar);
+    }
+}
+
+/* log a benchmark result and append it as a JSON line to the -bench_results file */
+static void bench_report(const char *name, const char *input, double value, const char *unit, int64_t n)
+{
+    AVBPrint buf;
+    FILE *f;
+
+    av_log(NULL, AV_LOG_INFO, "bench: %-32s %12.3f %s\n", name, value, unit);
+    /* e.g. no iteration ran: a broken benchmark, and not a JSON number */
+    if (!isfinite(value)) {
+        av_log(NULL, AV_LOG_ERROR, "bench: %s has no finite result\n", name);
+        bench_failures++;
+    }
+    if (!bench_results)
+        return;
+
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&buf, "{\"bench\": \"%s\", \"input\": \"", name);
+    av_bprint_escape(&buf, input ? av_basename(input) : "", "\"\\", AV_ESCAPE_MODE_BACKSLASH, 0);
+    if (isfinite(value))
+        av_bprintf(&buf, "\", \"value\": %f", value);
+    else
+        av_bprintf(&buf, "\", \"value\": null");
+    av_bprintf(&buf, ", \"unit\": \"%s\", \"n\": %"PRId64"}\n", unit, n);
+    if ((f = fopen(bench_results, "a"))) {
+        fputs(buf.str, f);
+        fclose(f);
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s': %s\n", bench_results, strerror(errno));
+    }
+    av_bprint_finalize(&buf, NULL);
+}
+
+/* CPU time consumed by the calling thread in microseconds, -1 if unknown */
+static int64_t thread_cpu_time(void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+#elif defined(_WIN32)
+    FILETIME c, e, k, u;
+    if (GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u))
+        return (((int64_t)k.dwHighDateTime << 32 | k.dwLowDateTime) +
+                ((int64_t)u.dwHighDateTime << 32 | u.dwLowDateTime)) / 10;
+#endif
+    return -1;
+}
+
+static void benchmark_thread_begin(VideoState *is, int id)
+{
+    if (!benchmark)
+        return;
+    is->bench.threads[id].real_time = -av_gettime_relative();
+    is->bench.threads[id].cpu_time  = -thread_cpu_time();
+}
+
+static void benchmark_thread_end(VideoState *is, int id)
+{
+    if (!benchmark)
+        return;
+    is->bench.threads[id].real_time += av_gettime_relative();
+    is->bench.threads[id].cpu_time  += thread_cpu_time();
+}
+
+static void print_benchmark_stats(VideoState *is)
+{
+    static const char *const names[BENCHMARK_NB_THREADS] = {
+        "read", "video decoder", "audio decoder", "subtitle decoder", "video sink", "audio sink",
+    };
+    Benchmark *b = &is->bench;
+    double rtime = (b->end_time - b->start_time) / 1000000.0;
+    int i;
+
+    if (rtime <= 0)
+        return;
+    bench_report("decode_video_fps", is->filename, b->nb_video_frames / rtime, "frames/s", b->nb_video_frames);
+    bench_report("decode_audio_rate", is->filename, b->nb_audio_samples / rtime, "samples/s", b->nb_audio_frames);
+    for (i = 0; i < BENCHMARK_NB_THREADS; i++) {
+        if (!b->threads[i].real_time)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "bench: %-16s rtime=%0.3fs ctime=%0.3fs (%0.0f%%)\n", names[i],
+               b->threads[i].real_time / 1000000.0, b->threads[i].cpu_time / 1000000.0,
+               100.0 * b->threads[i].cpu_time / b->threads[i].real_time);
+    }
+#if HAVE_GETRUSAGE
+    {
+        struct rusage rusage;
+        getrusage(RUSAGE_SELF, &rusage);
+        av_log(NULL, AV_LOG_INFO, "bench: rtime=%0.3fs utime=%0.3fs stime=%0.3fs maxrss=%ldkB\n", rtime,
+               rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1000000.0,
+               rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1000000.0,
+               rusage.ru_maxrss);
+        bench_report("decode_maxrss", is->filename, rusage.ru_maxrss, "kB", 1);
+    }
+#else
+    av_log(NULL, AV_LOG_INFO, "bench: rtime=%0.3fs\n", rtime);
+#endif
+}
+
 static inline void fill_rectangle(int x, int y, int w, int h)
 {
     SDL_Rect rect;
@@ -1534,6 +3153,12 @@ static inline void fill_rectangle(int x, int y, int w, int h)
         SDL_RenderFillRect(renderer, &rect);
 }
 
+/* approximate memory of a texture, planar YUV formats have no bytes per pixel */
+static int texture_size(Uint32 format, int w, int h)
+{
+    return SDL_BYTESPERPIXEL(format) ? w * h * SDL_BYTESPERPIXEL(format) : w * h * 3 / 2;
+}
+
 static int realloc_texture(SDL_Texture **texture, Uint32 new_format, int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
 {
     Uint32 format;
@@ -1541,10 +3166,13 @@ static int realloc_texture(SDL_Texture **texture, Uint32 new_format, int new_wid
     if (!*texture || SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 || new_width != w || new_height != h || new_format != format) {
         void *pixels;
         int pitch;
-        if (*texture)
+        if (*texture) {
             SDL_DestroyTexture(*texture);
+            alloc_stats_free(ALLOC_SITE_TEXTURE, texture_size(format, w, h));
+        }
         if (!(*texture = SDL_CreateTexture(renderer, new_format, SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
             return -1;
+        alloc_stats_add(ALLOC_SITE_TEXTURE, texture_size(new_format, new_width, new_height));
         if (SDL_SetTextureBlendMode(*texture, blendmode) < 0)
             return -1;
         if (init_texture) {
@@ -1675,11 +3303,377 @@ static void set_sdl_yuv_conversion_mode(AVFrame *frame)
     #endif
 }
 
+/**
+ * Shows the given frame instead of the picture queue until a frame of the
+ * given serial (or a later one) is presented. Gives immediate feedback on a
+ * seek while the decoders are still working on the real picture.
+ */
+static void set_preview_frame(VideoState *is, AVFrame *frame, int serial)
+{
+    SDL_LockMutex(is->preview_mutex);
+    av_frame_unref(is->preview_frame);
+    if (av_frame_ref(is->preview_frame, frame) >= 0) {
+        is->preview_serial   = serial;
+        is->preview_uploaded = 0;
+        is->force_refresh    = 1;
+    }
+    SDL_UnlockMutex(is->preview_mutex);
+}
+
+/* drop the preview once the picture queue caught up with it */
+static void clear_preview_frame(VideoState *is, int serial)
+{
+    SDL_LockMutex(is->preview_mutex);
+    if (is->preview_frame->buf[0] && serial >= is->preview_serial)
+        av_frame_unref(is->preview_frame);
+    SDL_UnlockMutex(is->preview_mutex);
+}
+
+/* display the preview frame, if any, return 0 if there is none */
+static int video_preview_display(VideoState *is)
+{
+    AVFrame *frame = is->preview_frame;
+    SDL_Rect rect;
+    int ret = 0;
+
+    SDL_LockMutex(is->preview_mutex);
+    if (frame->buf[0]) {
+        calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, frame->width, frame->height, frame->sample_aspect_ratio);
+        if (!is->preview_uploaded && upload_texture(&is->vid_texture, frame, &is->img_convert_ctx) >= 0) {
+            is->preview_uploaded = 1;
+            /* the texture no longer holds the last queued picture */
+            frame_queue_peek_last(&is->pictq)->uploaded = 0;
+        }
+        if (is->preview_uploaded) {
+            set_sdl_yuv_conversion_mode(frame);
+            SDL_RenderCopyEx(renderer, is->vid_texture, NULL, &rect, 0, NULL, frame->linesize[0] < 0 ? SDL_FLIP_VERTICAL : 0);
+            set_sdl_yuv_conversion_mode(NULL);
+            is->presented_pts    = NAN;
+            is->presented_serial = is->preview_serial;
+        }
+        ret = 1;
+    }
+    SDL_UnlockMutex(is->preview_mutex);
+    return ret;
+}
+
+static void scrub_cache_unlink(ScrubCache *c, ScrubCacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->first = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->last = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void scrub_cache_push_front(ScrubCache *c, ScrubCacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->first;
+    if (c->first)
+        c->first->prev = e;
+    else
+        c->last = e;
+    c->first = e;
+}
+
+static void scrub_cache_free_entry(ScrubCache *c, ScrubCacheEntry *e)
+{
+    scrub_cache_unlink(c, e);
+    c->mem -= e->mem;
+    c->nb_entries--;
+    av_frame_free(&e->frame);
+    av_free(e);
+}
+
+static void scrub_cache_free(ScrubCache *c)
+{
+    while (c->first)
+        scrub_cache_free_entry(c, c->first);
+    sws_freeContext(c->sws_ctx);
+    c->sws_ctx = NULL;
+    SDL_DestroyMutex(c->mutex);
+    c->mutex = NULL;
+}
+
+/* store a downscaled copy of the decoded keyframe, evicting the least recently used ones */
+static void scrub_cache_add(VideoState *is, AVFrame *src, AVRational tb)
+{
+    ScrubCache *c = &is->scrub_cache;
+    ScrubCacheEntry *e;
+    SDL_Rect rect;
+    int64_t pts;
+    int size;
+
+    if (!c->max_mem || src->pts == AV_NOPTS_VALUE || !src->width || !src->height)
+        return;
+    pts = av_rescale_q(src->pts, tb, AV_TIME_BASE_Q);
+    if (!SDL_AtomicGet(&c->active)) {
+        if (c->last_playback_pts != AV_NOPTS_VALUE && FFABS(pts - c->last_playback_pts) < SCRUB_PLAYBACK_INTERVAL)
+            return;
+        c->last_playback_pts = pts;
+    }
+
+    SDL_LockMutex(c->mutex);
+    for (e = c->first; e; e = e->next) {
+        if (e->pts == pts) {
+            scrub_cache_unlink(c, e);
+            scrub_cache_push_front(c, e);
+            goto end;
+        }
+    }
+
+    /* fit the window, never upscale */
+    calculate_display_rect(&rect, 0, 0, is->width ? is->width : default_width, is->height ? is->height : default_height,
+                           src->width, src->height, src->sample_aspect_ratio);
+    if (rect.w > src->width || rect.h > src->height)
+        calculate_display_rect(&rect, 0, 0, src->width, src->height, src->width, src->height, src->sample_aspect_ratio);
+    size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, rect.w, rect.h, 1);
+    if (size <= 0 || size > c->max_mem)
+        goto end;
+
+    c->sws_ctx = sws_getCachedContext(c->sws_ctx, src->width, src->height, src->format,
+                                      rect.w, rect.h, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (!c->sws_ctx || !(e = av_mallocz(sizeof(*e))))
+        goto end;
+    if (!(e->frame = av_frame_alloc()))
+        goto fail;
+    e->frame->format = AV_PIX_FMT_YUV420P;
+    e->frame->width  = rect.w;
+    e->frame->height = rect.h;
+    if (av_frame_get_buffer(e->frame, 0) < 0)
+        goto fail;
+    sws_scale(c->sws_ctx, (const uint8_t * const *)src->data, src->linesize, 0, src->height,
+              e->frame->data, e->frame->linesize);
+    e->frame->pts         = src->pts;
+    e->frame->color_range = src->color_range;
+    e->frame->colorspace  = src->colorspace;
+    e->pts = pts;
+    e->mem = size + sizeof(*e);
+
+    scrub_cache_push_front(c, e);
+    c->mem += e->mem;
+    c->nb_entries++;
+    while (c->mem > c->max_mem && c->last != e)
+        scrub_cache_free_entry(c, c->last);
+    goto end;
+
+    fail:
+    av_frame_free(&e->frame);
+    av_free(e);
+    end:
+    SDL_UnlockMutex(c->mutex);
+}
+
+/* preview the cached keyframe nearest to pts until the next seek is displayed, return 1 on hit */
+static int scrub_cache_preview(VideoState *is, int64_t pts)
+{
+    ScrubCache *c = &is->scrub_cache;
+    ScrubCacheEntry *e, *nearest = NULL;
+
+    if (!c->max_mem)
+        return 0;
+    /* from now on every keyframe the drag seeks decode is kept */
+    SDL_AtomicSet(&c->active, 1);
+
+    SDL_LockMutex(c->mutex);
+    for (e = c->first; e; e = e->next)
+        if (!nearest || FFABS(e->pts - pts) < FFABS(nearest->pts - pts))
+            nearest = e;
+    if (nearest && FFABS(nearest->pts - pts) <= SCRUB_MAX_DISTANCE) {
+        scrub_cache_unlink(c, nearest);
+        scrub_cache_push_front(c, nearest);
+        set_preview_frame(is, nearest->frame, is->videoq.serial + 1);
+        c->nb_hits++;
+    } else {
+        nearest = NULL;
+        c->nb_misses++;
+    }
+    SDL_UnlockMutex(c->mutex);
+    return nearest != NULL;
+}
+
+/* preview the proxy picture nearest to pts until the next seek is displayed, return 1 on hit */
+static int proxy_preview(VideoState *is, int64_t pts)
+{
+#if HAVE_PROXY
+    Proxy *px = &is->proxy;
+    uint8_t *data[4];
+    int linesize[4];
+    AVFrame *frame = NULL;
+    int64_t nearest_pts;
+    size_t needed;
+    int nb_records, lo, hi, ret = 0;
+
+    if (!px->mutex || px->stream_index != is->video_stream)
+        return 0;
+
+    SDL_LockMutex(px->mutex);
+    nb_records = px->nb_records;
+    needed = sizeof(ProxyHeader) + nb_records * px->record_size;
+    if (!nb_records)
+        goto end;
+    /* follow the generator with room for twice the records, so a drag does not
+       remap on every event; only the records written so far are ever read */
+    if (needed > px->map_size) {
+        size_t size = FFMAX(needed, sizeof(ProxyHeader) + 2 * (px->map_size - FFMIN(px->map_size, sizeof(ProxyHeader))));
+        uint8_t *map;
+        if (px->map)
+            munmap(px->map, px->map_size);
+        px->map      = NULL;
+        px->map_size = 0;
+        if (px->in_fd < 0 && (px->in_fd = open(px->path, O_RDONLY)) < 0)
+            goto end;
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, px->in_fd, 0);
+        if (map == MAP_FAILED)
+            goto end;
+        px->map      = map;
+        px->map_size = size;
+    }
+
+    /* records are in pts order, find the first one at or after pts */
+    lo = 0;
+    hi = nb_records;
+#define PROXY_RECORD(i) (px->map + sizeof(ProxyHeader) + (size_t)(i) * px->record_size)
+#define PROXY_PTS(i) (*(const int64_t *)PROXY_RECORD(i))
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (PROXY_PTS(mid) < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == nb_records ||
+        (lo > 0 && pts - PROXY_PTS(lo - 1) < PROXY_PTS(lo) - pts))
+        lo--;
+    nearest_pts = PROXY_PTS(lo);
+    if (FFABS(nearest_pts - pts) > SCRUB_MAX_DISTANCE)
+        goto end;
+
+    if (!(frame = av_frame_alloc()))
+        goto end;
+    frame->format      = AV_PIX_FMT_YUV420P;
+    frame->width       = px->width;
+    frame->height      = px->height;
+    frame->color_range = px->codecpar->color_range;
+    frame->colorspace  = px->codecpar->color_space;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        goto end;
+    av_image_fill_arrays(data, linesize, PROXY_RECORD(lo) + sizeof(int64_t), AV_PIX_FMT_YUV420P, px->width, px->height, 1);
+    av_image_copy(frame->data, frame->linesize, (const uint8_t **)data, linesize, AV_PIX_FMT_YUV420P, px->width, px->height);
+#undef PROXY_PTS
+#undef PROXY_RECORD
+    frame->pts = nearest_pts;
+    set_preview_frame(is, frame, is->videoq.serial + 1);
+    px->nb_hits++;
+    ret = 1;
+
+    end:
+    SDL_UnlockMutex(px->mutex);
+    av_frame_free(&frame);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+static double get_clock(Clock *c);
+static double get_master_clock(VideoState *is);
+static int get_master_sync_type(VideoState *is);
+
+/* height of the waveform seek bar, 0 when there is none */
+static int peaks_bar_height(VideoState *is)
+{
+    return is->peaks.done && is->height > 4 * PEAKS_BAR_HEIGHT ? PEAKS_BAR_HEIGHT : 0;
+}
+
+/* draw the waveform seek bar at the bottom of the window, with the level of
+   the overview that has at least one bin per pixel. Chunks not built yet
+   stay empty. */
+static void peaks_display(VideoState *is)
+{
+    Peaks *pk = &is->peaks;
+    SDL_Rect rects[256];
+    int h = peaks_bar_height(is), y, x, level, nb_bins, chunk_bins, mid, n = 0;
+    double pos;
+
+    if (!h)
+        return;
+    y   = is->ytop + is->height - h;
+    mid = y + h / 2;
+    for (level = PEAKS_NB_LEVELS - 1; level > 0 && pk->nb_bins[level] < is->width; level--)
+        ;
+    nb_bins    = pk->nb_bins[level];
+    chunk_bins = PEAKS_CHUNK_BINS >> (2 * level);
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    fill_rectangle(is->xleft, y, is->width, h);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+
+#define PEAKS_FLUSH(force) do {                                 \
+        if (n == FF_ARRAY_ELEMS(rects) || (force && n)) {       \
+            SDL_RenderFillRects(renderer, rects, n);            \
+            n = 0;                                              \
+        }                                                       \
+    } while (0)
+    /* extremes first, then the RMS over them */
+    SDL_SetRenderDrawColor(renderer, 90, 140, 200, 255);
+    for (x = 0; x < is->width; x++) {
+        int b0 = (int64_t)x * nb_bins / is->width, b1 = FFMAX((int64_t)(x + 1) * nb_bins / is->width, b0 + 1), b;
+        int lo = 0, hi = 0;
+
+        if (!pk->done[b0 / chunk_bins])
+            continue;
+        SDL_MemoryBarrierAcquire();
+        for (b = b0; b < b1; b++) {
+            lo = FFMIN(lo, pk->levels[level][b].min);
+            hi = FFMAX(hi, pk->levels[level][b].max);
+        }
+        rects[n++] = (SDL_Rect){ is->xleft + x, mid - hi * (h / 2) / 32768, 1, FFMAX((hi - lo) * (h / 2) / 32768, 1) };
+        PEAKS_FLUSH(0);
+    }
+    PEAKS_FLUSH(1);
+    SDL_SetRenderDrawColor(renderer, 170, 210, 255, 255);
+    for (x = 0; x < is->width; x++) {
+        int b0 = (int64_t)x * nb_bins / is->width, b1 = FFMAX((int64_t)(x + 1) * nb_bins / is->width, b0 + 1), b;
+        int rms = 0;
+
+        if (!pk->done[b0 / chunk_bins])
+            continue;
+        SDL_MemoryBarrierAcquire();
+        for (b = b0; b < b1; b++)
+            rms = FFMAX(rms, pk->levels[level][b].rms);
+        rects[n++] = (SDL_Rect){ is->xleft + x, mid - rms * (h / 2) / 32768, 1, FFMAX(2 * rms * (h / 2) / 32768, 1) };
+        PEAKS_FLUSH(0);
+    }
+    PEAKS_FLUSH(1);
+#undef PEAKS_FLUSH
+
+    /* playback position */
+    pos = get_master_clock(is);
+    if (!isnan(pos)) {
+        if (pk->start_time != AV_NOPTS_VALUE)
+            pos -= pk->start_time / (double)AV_TIME_BASE;
+        x = av_clip(lrint(pos * AV_TIME_BASE / pk->duration * is->width), 0, is->width - 1);
+        SDL_SetRenderDrawColor(renderer, 230, 40, 40, 255);
+        fill_rectangle(is->xleft + x, y, 2, h);
+    }
+}
+
 static void video_image_display(VideoState *is)
 {
     Frame *vp;
     Frame *sp = NULL;
     SDL_Rect rect;
+    int ret;
+
+    if (video_preview_display(is))
+        return;
 
     vp = frame_queue_peek_last(&is->pictq);
     if (is->subtitle_st) {
@@ -1730,7 +3724,10 @@ static void video_image_display(VideoState *is)
     calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp->width, vp->height, vp->sar);
 
     if (!vp->uploaded) {
-        if (upload_texture(&is->vid_texture, vp->frame, &is->img_convert_ctx) < 0)
+        TRACE_BEGIN("upload_texture", vp->pts, vp->serial);
+        ret = upload_texture(&is->vid_texture, vp->frame, &is->img_convert_ctx);
+        TRACE_END("upload_texture", vp->pts, vp->serial);
+        if (ret < 0)
             return;
         vp->uploaded = 1;
         vp->flip_v = vp->frame->linesize[0] < 0;
@@ -1739,6 +3736,8 @@ static void video_image_display(VideoState *is)
     set_sdl_yuv_conversion_mode(vp->frame);
     SDL_RenderCopyEx(renderer, is->vid_texture, NULL, &rect, 0, NULL, vp->flip_v ? SDL_FLIP_VERTICAL : 0);
     set_sdl_yuv_conversion_mode(NULL);
+    is->presented_pts    = vp->pts;
+    is->presented_serial = vp->serial;
     if (sp) {
         #if USE_ONEPASS_SUBTITLE_RENDER
             SDL_RenderCopy(renderer, is->sub_texture, NULL, &rect);
@@ -1763,173 +3762,955 @@ static inline int compute_mod(int a, int b)
     return a < 0 ? a%b + b : a%b;
 }
 
-static void video_audio_display(VideoState *s)
+/* size of the spectrum buffers for a transform of rdft_bits */
+static size_t spectrum_buffers_size(int rdft_bits)
 {
-    int i, i_start, x, y1, y, ys, delay, n, nb_display_channels;
-    int ch, channels, h, h2;
-    int64_t time_diff;
-    int rdft_bits, nb_freq;
+    return (1 << rdft_bits) * (sizeof(float) + 2 * sizeof(FFTSample));
+}
 
-    for (rdft_bits = 1; (1 << rdft_bits) < 2 * s->height; rdft_bits++)
-        ;
-    nb_freq = 1 << (rdft_bits - 1);
+static void spectrum_free(Spectrum *sp)
+{
+    if (sp->rdft_bits)
+        alloc_stats_free(ALLOC_SITE_RDFT, spectrum_buffers_size(sp->rdft_bits));
+    if (sp->pixels)
+        alloc_stats_free(ALLOC_SITE_RDFT, SPECTRUM_NB_COLUMNS * SPECTRUM_MAX_HEIGHT * sizeof(*sp->pixels));
+    av_rdft_end(sp->rdft);
+    av_freep(&sp->window);
+    av_freep(&sp->data);
+    av_freep(&sp->pixels);
+    sp->rdft = NULL;
+    sp->rdft_bits = 0;
+    sp->next_pts = NAN;
+    SDL_AtomicSet(&sp->write, 0);
+    SDL_AtomicSet(&sp->read, 0);
+}
 
-    /* compute display index : center on currently output samples */
-    channels = s->audio_tgt.channels;
-    nb_display_channels = channels;
-    if (!s->paused) {
-        int data_used= s->show_mode == SHOW_MODE_WAVES ? s->width : (2*nb_freq);
-        n = 2 * channels;
-        delay = s->audio_write_buf_size;
-        delay /= n;
+/* transform and window table for columns of nb_freq = 1 << (rdft_bits - 1) rows */
+static int spectrum_configure(Spectrum *sp, int rdft_bits)
+{
+    int x, nb_freq = 1 << (rdft_bits - 1);
 
-        /* to be more precise, we take into account the time spent since
-           the last buffer computation */
-        if (audio_callback_time) {
-            time_diff = av_gettime_relative() - audio_callback_time;
-            delay -= (time_diff * s->audio_tgt.freq) / 1000000;
-        }
+    if (sp->rdft_bits == rdft_bits)
+        return 0;
+    if (sp->rdft_bits)
+        alloc_stats_free(ALLOC_SITE_RDFT, spectrum_buffers_size(sp->rdft_bits));
+    av_rdft_end(sp->rdft);
+    av_freep(&sp->window);
+    av_freep(&sp->data);
+    sp->rdft_bits = 0;
+
+    sp->rdft   = av_rdft_init(rdft_bits, DFT_R2C);
+    sp->window = av_malloc_array(2 * nb_freq, sizeof(*sp->window));
+    sp->data   = av_malloc_array(nb_freq, 4 * sizeof(*sp->data));
+    if (!sp->pixels) {
+        sp->pixels = av_malloc_array(SPECTRUM_NB_COLUMNS * SPECTRUM_MAX_HEIGHT, sizeof(*sp->pixels));
+        if (sp->pixels)
+            alloc_stats_add(ALLOC_SITE_RDFT, SPECTRUM_NB_COLUMNS * SPECTRUM_MAX_HEIGHT * sizeof(*sp->pixels));
+    }
+    if (!sp->rdft || !sp->window || !sp->data || !sp->pixels) {
+        av_rdft_end(sp->rdft);
+        av_freep(&sp->window);
+        av_freep(&sp->data);
+        sp->rdft = NULL;
+        return AVERROR(ENOMEM);
+    }
+    sp->rdft_bits = rdft_bits;
+    alloc_stats_add(ALLOC_SITE_RDFT, spectrum_buffers_size(rdft_bits));
 
-        delay += 2 * data_used;
-        if (delay < data_used)
-            delay = data_used;
+    for (x = 0; x < 2 * nb_freq; x++) {
+        float w = (x - nb_freq) * (1.0f / nb_freq);
+        sp->window[x] = 1.0f - w * w;
+    }
+    return 0;
+}
 
-        i_start= x = compute_mod(s->sample_array_index - delay * channels, SAMPLE_ARRAY_SIZE);
-        if (s->show_mode == SHOW_MODE_WAVES) {
-            h = INT_MIN;
-            for (i = 0; i < 1000; i += channels) {
-                int idx = (SAMPLE_ARRAY_SIZE + x - i) % SAMPLE_ARRAY_SIZE;
-                int a = s->sample_array[idx];
-                int b = s->sample_array[(idx + 4 * channels) % SAMPLE_ARRAY_SIZE];
-                int c = s->sample_array[(idx + 5 * channels) % SAMPLE_ARRAY_SIZE];
-                int d = s->sample_array[(idx + 9 * channels) % SAMPLE_ARRAY_SIZE];
-                int score = a - d;
-                if (h < score && (b ^ c) < 0) {
-                    h = score;
-                    i_start = idx;
-                }
-            }
+/* pixels of rows bins of one or two transformed channels, top row first. The
+   intensity is the quarter power of the magnitude over sqrt(nb_freq). */
+static void spectrum_column(uint32_t *column, const FFTSample *data0, const FFTSample *data1,
+                            int rows, int nb_freq)
+{
+    const float scale = 1.0f / nb_freq;
+    int y = 0;
+
+#if HAVE_SSE2
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vmax   = _mm_set1_ps(255.0f);
+
+    for (; y + 4 <= rows; y += 4) {
+        __m128 lo = _mm_loadu_ps(data0 + 2 * y);
+        __m128 hi = _mm_loadu_ps(data0 + 2 * y + 4);
+        __m128 re = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 p  = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)), vscale);
+        __m128i a = _mm_cvttps_epi32(_mm_min_ps(_mm_sqrt_ps(_mm_sqrt_ps(p)), vmax));
+        __m128i b = a, pix;
+
+        if (data1) {
+            lo = _mm_loadu_ps(data1 + 2 * y);
+            hi = _mm_loadu_ps(data1 + 2 * y + 4);
+            re = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+            im = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+            p  = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)), vscale);
+            b  = _mm_cvttps_epi32(_mm_min_ps(_mm_sqrt_ps(_mm_sqrt_ps(p)), vmax));
         }
+        pix = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(a, 16), _mm_slli_epi32(b, 8)),
+                           _mm_srli_epi32(_mm_add_epi32(a, b), 1));
+        /* the lowest bin is the bottom row */
+        _mm_storeu_si128((__m128i *)(column + rows - 4 - y), _mm_shuffle_epi32(pix, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; y < rows; y++) {
+        float re = data0[2 * y], im = data0[2 * y + 1];
+        int a = FFMIN(sqrtf(sqrtf((re * re + im * im) * scale)), 255.0f);
+        int b = a;
+
+        if (data1) {
+            re = data1[2 * y];
+            im = data1[2 * y + 1];
+            b  = FFMIN(sqrtf(sqrtf((re * re + im * im) * scale)), 255.0f);
+        }
+        column[rows - 1 - y] = (a << 16) + (b << 8) + ((a + b) >> 1);
+    }
+}
 
-        s->last_i_start = i_start;
-    } else {
-        i_start = s->last_i_start;
+/* queue the columns of the RDFT display that the samples captured up to now
+   complete, one per rdftspeed seconds. Called by the audio decoder thread. */
+static void spectrum_update(VideoState *is, double pts, int serial)
+{
+    Spectrum *sp = &is->spectrum;
+    SampleCapture *sc = &is->capture;
+    int channels = sc->pos.channels, freq = sc->pos.freq;
+    int rows = av_clip(is->height, 1, SPECTRUM_MAX_HEIGHT);
+    int rdft_bits, nb_freq, nb_display_channels = FFMIN(channels, 2);
+    double step = FFMAX(rdftspeed, 0.001);
+
+    for (rdft_bits = 1; (1 << rdft_bits) < 2 * rows; rdft_bits++)
+        ;
+    nb_freq = 1 << (rdft_bits - 1);
+    if (spectrum_configure(sp, rdft_bits) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to allocate buffers for RDFT, switching to waves display\n");
+        is->show_mode = SHOW_MODE_WAVES;
+        return;
     }
 
-    if (s->show_mode == SHOW_MODE_WAVES) {
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    /* restart after a seek and when the display comes back to the spectrum */
+    if (sp->serial != serial || isnan(sp->next_pts) ||
+        sp->next_pts < pts - 1.0 || sp->next_pts > sc->pos.end_pts + 1.0) {
+        sp->serial   = serial;
+        sp->next_pts = pts;
+    }
+
+    for (; sp->next_pts <= sc->pos.end_pts; sp->next_pts += step) {
+        int write = SDL_AtomicGet(&sp->write);
+        int slot = write % SPECTRUM_NB_COLUMNS;
+        int ch, x, i, end;
 
-        /* total height for one channel */
-        h = s->height / nb_display_channels;
-        /* graph height / 2 */
-        h2 = (h * 9) / 20;
+        /* the display is behind, paused or gone: drop the column */
+        if (write - SDL_AtomicGet(&sp->read) >= SPECTRUM_NB_COLUMNS)
+            continue;
+
+        /* the transform ends with the sample playing at next_pts */
+        end = lrint((sc->pos.end_pts - sp->next_pts) * freq);
+        if (end + 2 * nb_freq > SAMPLE_ARRAY_SIZE / channels / 2)
+            continue;
         for (ch = 0; ch < nb_display_channels; ch++) {
-            i = i_start + ch;
-            y1 = s->ytop + ch * h + (h / 2); /* position of center line */
-            for (x = 0; x < s->width; x++) {
-                y = (s->sample_array[i] * h2) >> 15;
-                if (y < 0) {
-                    y = -y;
-                    ys = y1 - y;
-                } else {
-                    ys = y1;
-                }
-                fill_rectangle(s->xleft + x, ys, 1, y);
+            FFTSample *data = sp->data + 2 * nb_freq * ch;
+
+            i = compute_mod(sc->pos.end_index - (end + 2 * nb_freq) * channels + ch, SAMPLE_ARRAY_SIZE);
+            for (x = 0; x < 2 * nb_freq; x++) {
+                data[x] = sc->samples[i] * sp->window[x];
                 i += channels;
                 if (i >= SAMPLE_ARRAY_SIZE)
                     i -= SAMPLE_ARRAY_SIZE;
             }
+            av_rdft_calc(sp->rdft, data);
         }
+        spectrum_column(sp->pixels + slot * SPECTRUM_MAX_HEIGHT, sp->data,
+                        nb_display_channels == 2 ? sp->data + 2 * nb_freq : NULL, rows, nb_freq);
+        sp->pts[slot]           = sp->next_pts;
+        sp->column_serial[slot] = serial;
+        sp->height[slot]        = rows;
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&sp->write, write + 1);
+    }
+}
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+/* upload the queued columns that are playing by now, one texture update each */
+static void spectrum_display(VideoState *s)
+{
+    Spectrum *sp = &s->spectrum;
+    int read = SDL_AtomicGet(&sp->read);
+    int write = SDL_AtomicGet(&sp->write);
+    double clock = get_clock(&s->audclk);
 
-        for (ch = 1; ch < nb_display_channels; ch++) {
-            y = s->ytop + ch * h;
-            fill_rectangle(s->xleft, y, s->width, 1);
-        }
-    } else {
-        if (realloc_texture(&s->vis_texture, SDL_PIXELFORMAT_ARGB8888, s->width, s->height, SDL_BLENDMODE_NONE, 1) < 0)
-            return;
+    if (realloc_texture(&s->vis_texture, SDL_PIXELFORMAT_ARGB8888, s->width, s->height, SDL_BLENDMODE_NONE, 1) < 0)
+        return;
 
-        nb_display_channels= FFMIN(nb_display_channels, 2);
-        if (rdft_bits != s->rdft_bits) {
-            av_rdft_end(s->rdft);
-            av_free(s->rdft_data);
-            s->rdft = av_rdft_init(rdft_bits, DFT_R2C);
-            s->rdft_bits = rdft_bits;
-            s->rdft_data = av_malloc_array(nb_freq, 4 *sizeof(*s->rdft_data));
-        }
-        if (!s->rdft || !s->rdft_data){
-            av_log(NULL, AV_LOG_ERROR, "Failed to allocate buffers for RDFT, switching to waves display\n");
-            s->show_mode = SHOW_MODE_WAVES;
-        } else {
-            FFTSample *data[2];
-            SDL_Rect rect = {.x = s->xpos, .y = 0, .w = 1, .h = s->height};
-            uint32_t *pixels;
-            int pitch;
-            for (ch = 0; ch < nb_display_channels; ch++) {
-                data[ch] = s->rdft_data + 2 * nb_freq * ch;
-                i = i_start + ch;
-                for (x = 0; x < 2 * nb_freq; x++) {
-                    double w = (x-nb_freq) * (1.0 / nb_freq);
-                    data[ch][x] = s->sample_array[i] * (1.0 - w * w);
-                    i += channels;
-                    if (i >= SAMPLE_ARRAY_SIZE)
-                        i -= SAMPLE_ARRAY_SIZE;
-                }
-                av_rdft_calc(s->rdft, data[ch]);
-            }
-            /* Least efficient way to do this, we should of course
-             * directly access it but it is more than fast enough. */
-            if (!SDL_LockTexture(s->vis_texture, &rect, (void **)&pixels, &pitch)) {
-                pitch >>= 2;
-                pixels += pitch * s->height;
-                for (y = 0; y < s->height; y++) {
-                    double w = 1 / sqrt(nb_freq);
-                    int a = sqrt(w * sqrt(data[0][2 * y + 0] * data[0][2 * y + 0] + data[0][2 * y + 1] * data[0][2 * y + 1]));
-                    int b = (nb_display_channels == 2 ) ? sqrt(w * hypot(data[1][2 * y + 0], data[1][2 * y + 1]))
-                                                        : a;
-                    a = FFMIN(a, 255);
-                    b = FFMIN(b, 255);
-                    pixels -= pitch;
-                    *pixels = (a << 16) + (b << 8) + ((a+b) >> 1);
-                }
-                SDL_UnlockTexture(s->vis_texture);
-            }
-            SDL_RenderCopy(renderer, s->vis_texture, NULL, NULL);
-        }
-        if (!s->paused)
-            s->xpos++;
-        if (s->xpos >= s->width)
-            s->xpos= s->xleft;
+    if (s->xpos >= s->width)
+        s->xpos = s->xleft;
+    SDL_MemoryBarrierAcquire();
+    for (; read != write; read++) {
+        int slot = read % SPECTRUM_NB_COLUMNS;
+        int rows = FFMIN(sp->height[slot], s->height);
+        SDL_Rect rect = {.x = s->xpos, .y = s->height - rows, .w = 1, .h = rows};
+
+        if (sp->column_serial[slot] != s->audioq.serial)
+            continue;
+        if (!isnan(clock) && s->audclk.serial == sp->column_serial[slot] && sp->pts[slot] > clock)
+            break;
+        SDL_UpdateTexture(s->vis_texture, &rect,
+                          sp->pixels + slot * SPECTRUM_MAX_HEIGHT + sp->height[slot] - rows,
+                          sizeof(*sp->pixels));
+        if (++s->xpos >= s->width)
+            s->xpos = s->xleft;
     }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&sp->read, read);
+
+    SDL_RenderCopy(renderer, s->vis_texture, NULL, NULL);
 }
 
-static void stream_component_close(VideoState *is, int stream_index)
+/* keep the samples of a decoded frame for the waves and RDFT displays, only
+   while one of them is shown. Called by the audio decoder thread. */
+static void sample_capture_add(VideoState *is, const AVFrame *frame, double pts, int serial)
 {
-    AVFormatContext *ic = is->ic;
-    AVCodecParameters *codecpar;
+    SampleCapture *sc = &is->capture;
+    enum AVSampleFormat fmt = av_get_packed_sample_fmt(frame->format);
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int channels = frame->channels;
+    int i, len, total, done = 0;
 
-    if (stream_index < 0 || stream_index >= ic->nb_streams)
+    if (display_disable || (is->show_mode != SHOW_MODE_WAVES && is->show_mode != SHOW_MODE_RDFT))
         return;
-    codecpar = ic->streams[stream_index]->codecpar;
-
-    switch (codecpar->codec_type) {
-        case AVMEDIA_TYPE_AUDIO:
-            decoder_abort(&is->auddec, &is->sampq);
+    if (isnan(pts) || channels <= 0 || (fmt != AV_SAMPLE_FMT_S16 && fmt != AV_SAMPLE_FMT_FLT))
+        return;
+    if (!sc->samples) {
+        if (!(sc->samples = av_mallocz(SAMPLE_ARRAY_SIZE * sizeof(*sc->samples))))
+            return;
+        alloc_stats_add(ALLOC_SITE_SAMPLES, SAMPLE_ARRAY_SIZE * sizeof(*sc->samples));
+    }
+
+    /* interleaved, wrapping around the ring at any sample like the display does */
+    total = frame->nb_samples * channels;
+    while (done < total) {
+        int16_t *dst = sc->samples + sc->index;
+
+        len = FFMIN(total - done, SAMPLE_ARRAY_SIZE - sc->index);
+        if (!planar && fmt == AV_SAMPLE_FMT_S16) {
+            memcpy(dst, (const int16_t *)frame->data[0] + done, len * sizeof(*dst));
+        } else if (!planar) {
+            const float *src = (const float *)frame->data[0] + done;
+            for (i = 0; i < len; i++)
+                dst[i] = av_clip_int16(lrintf(src[i] * 32767.0f));
+        } else if (fmt == AV_SAMPLE_FMT_S16) {
+            for (i = 0; i < len; i++)
+                dst[i] = ((const int16_t *)frame->extended_data[(done + i) % channels])[(done + i) / channels];
+        } else {
+            for (i = 0; i < len; i++)
+                dst[i] = av_clip_int16(lrintf(((const float *)frame->extended_data[(done + i) % channels])[(done + i) / channels] * 32767.0f));
+        }
+        done += len;
+        sc->index += len;
+        if (sc->index >= SAMPLE_ARRAY_SIZE)
+            sc->index = 0;
+    }
+
+    SDL_AtomicIncRef(&sc->seq);
+    SDL_MemoryBarrierRelease();
+    sc->pos.end_index = sc->index;
+    sc->pos.end_pts   = pts + (double)frame->nb_samples / frame->sample_rate;
+    sc->pos.serial    = serial;
+    sc->pos.channels  = channels;
+    sc->pos.freq      = frame->sample_rate;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicIncRef(&sc->seq);
+
+    if (is->show_mode == SHOW_MODE_RDFT)
+        spectrum_update(is, pts, serial);
+}
+
+/* copy of the position of the last captured frame, returns 0 if none could be read */
+static int sample_capture_read(SampleCapture *sc, SampleCapturePos *pos)
+{
+    int i, seq;
+
+    for (i = 0; i < 4; i++) {
+        seq = SDL_AtomicGet(&sc->seq);
+        if (seq & 1)
+            continue;
+        SDL_MemoryBarrierAcquire();
+        *pos = sc->pos;
+        SDL_MemoryBarrierAcquire();
+        if (SDL_AtomicGet(&sc->seq) == seq)
+            return seq > 0 && sc->samples;
+    }
+    return 0;
+}
+
+static void video_audio_display(VideoState *s)
+{
+    int i, i_start, x, y1, y, ys, delay, nb_display_channels;
+    int ch, channels, h, h2;
+    const int16_t *samples;
+    SampleCapturePos pos;
+
+    if (s->show_mode == SHOW_MODE_RDFT) {
+        spectrum_display(s);
+        return;
+    }
+
+    if (!sample_capture_read(&s->capture, &pos))
+        return;
+    samples = s->capture.samples;
+
+    /* compute display index : center on currently output samples */
+    channels = pos.channels;
+    nb_display_channels = channels;
+    if (!s->paused) {
+        int data_used= s->width;
+        double clock = get_clock(&s->audclk);
+
+        /* the captured samples run ahead of the device by what is queued,
+           the audio clock tells how far */
+        delay = 0;
+        if (!isnan(clock) && s->audclk.serial == pos.serial)
+            delay = av_clip(lrint((pos.end_pts - clock) * pos.freq), 0, SAMPLE_ARRAY_SIZE / channels / 2);
+
+        delay += 2 * data_used;
+        if (delay < data_used)
+            delay = data_used;
+
+        i_start= x = compute_mod(pos.end_index - delay * channels, SAMPLE_ARRAY_SIZE);
+        h = INT_MIN;
+        for (i = 0; i < 1000; i += channels) {
+            int idx = (SAMPLE_ARRAY_SIZE + x - i) % SAMPLE_ARRAY_SIZE;
+            int a = samples[idx];
+            int b = samples[(idx + 4 * channels) % SAMPLE_ARRAY_SIZE];
+            int c = samples[(idx + 5 * channels) % SAMPLE_ARRAY_SIZE];
+            int d = samples[(idx + 9 * channels) % SAMPLE_ARRAY_SIZE];
+            int score = a - d;
+            if (h < score && (b ^ c) < 0) {
+                h = score;
+                i_start = idx;
+            }
+        }
+
+        s->last_i_start = i_start;
+    } else {
+        i_start = s->last_i_start;
+    }
+
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+
+    /* total height for one channel */
+    h = s->height / nb_display_channels;
+    /* graph height / 2 */
+    h2 = (h * 9) / 20;
+    for (ch = 0; ch < nb_display_channels; ch++) {
+        i = i_start + ch;
+        y1 = s->ytop + ch * h + (h / 2); /* position of center line */
+        for (x = 0; x < s->width; x++) {
+            y = (samples[i] * h2) >> 15;
+            if (y < 0) {
+                y = -y;
+                ys = y1 - y;
+            } else {
+                ys = y1;
+            }
+            fill_rectangle(s->xleft + x, ys, 1, y);
+            i += channels;
+            if (i >= SAMPLE_ARRAY_SIZE)
+                i -= SAMPLE_ARRAY_SIZE;
+        }
+    }
+
+    SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+
+    for (ch = 1; ch < nb_display_channels; ch++) {
+        y = s->ytop + ch * h;
+        fill_rectangle(s->xleft, y, s->width, 1);
+    }
+}
+
+/**
+ * WSOLA time stretcher. Works on interleaved float samples, the input is kept
+ * from the nominal start of the next segment minus the search distance on.
+ */
+typedef struct Stretch {
+    int channels;
+    int rate;
+    int hop;                        // output frames per segment, half a segment
+    int search;                     // frames a segment may start away from its nominal position
+    float *window;                  // 2 * hop, Hann, window[i] + window[i + hop] == 1
+    float *in;                      // input not consumed yet
+    int in_frames;
+    int in_alloc;
+    double pos;                     // nominal start of the next segment in in
+    int cont;                       // where the previous segment continues naturally, -1 before the first
+    float *overlap;                 // second half of the previous windowed segment
+    float *target;                  // downmix of the natural continuation
+    float *mono;                    // downmix of the search area
+    double *energy;                 // running sum of squares of mono
+    float *out;
+    int out_alloc;
+    uint8_t *out_s16;
+    unsigned int out_s16_size;
+} Stretch;
+
+static void stretch_free(Stretch **pst)
+{
+    Stretch *st = *pst;
+
+    if (!st)
+        return;
+    av_freep(&st->window);
+    av_freep(&st->in);
+    av_freep(&st->overlap);
+    av_freep(&st->target);
+    av_freep(&st->mono);
+    av_freep(&st->energy);
+    av_freep(&st->out);
+    av_freep(&st->out_s16);
+    av_freep(pst);
+}
+
+static void stretch_reset(Stretch *st)
+{
+    st->in_frames = 0;
+    st->pos = 0;
+    st->cont = -1;
+    memset(st->overlap, 0, st->hop * st->channels * sizeof(*st->overlap));
+}
+
+static Stretch *stretch_alloc(int channels, int rate)
+{
+    Stretch *st = av_mallocz(sizeof(*st));
+    int i, area;
+
+    if (!st)
+        return NULL;
+    st->channels = channels;
+    st->rate     = rate;
+    st->hop      = FFMAX(rate * STRETCH_HOP_MS / 1000, 16);
+    st->search   = FFMAX(rate * STRETCH_SEARCH_MS / 1000, 4);
+    area = 2 * st->search + st->hop + 1;
+    st->window  = av_malloc_array(2 * st->hop, sizeof(*st->window));
+    st->overlap = av_malloc_array(st->hop * channels, sizeof(*st->overlap));
+    st->target  = av_malloc_array(st->hop, sizeof(*st->target));
+    st->mono    = av_malloc_array(area, sizeof(*st->mono));
+    st->energy  = av_malloc_array(area + 1, sizeof(*st->energy));
+    if (!st->window || !st->overlap || !st->target || !st->mono || !st->energy) {
+        stretch_free(&st);
+        return NULL;
+    }
+    for (i = 0; i < 2 * st->hop; i++)
+        st->window[i] = 0.5f - 0.5f * cosf(M_PI * i / st->hop);
+    stretch_reset(st);
+    return st;
+}
+
+/* correlation of a candidate segment with the natural continuation */
+static float stretch_dot(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    int i = 0;
+
+#if HAVE_SSE2
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    float lanes[4];
+
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+/* start of the segment around nominal that best continues the previous one,
+   a coarse pass on every 4th position then a fine one around the best */
+static int stretch_search(Stretch *st, int nominal)
+{
+    int lo = FFMAX(nominal - st->search, 0), hi = nominal + st->search;
+    int n = hi - lo + st->hop, c = st->channels;
+    int i, ch, pos, best = nominal, step, from, to;
+    float best_score = -INFINITY;
+
+    for (i = 0; i < st->hop; i++) {
+        float v = 0;
+        for (ch = 0; ch < c; ch++)
+            v += st->in[(st->cont + i) * c + ch];
+        st->target[i] = v;
+    }
+    st->energy[0] = 0;
+    for (i = 0; i < n; i++) {
+        float v = 0;
+        for (ch = 0; ch < c; ch++)
+            v += st->in[(lo + i) * c + ch];
+        st->mono[i] = v;
+        st->energy[i + 1] = st->energy[i] + v * v;
+    }
+
+    for (step = 4, from = lo, to = hi; step; step = step == 4 ? 1 : 0) {
+        for (pos = from; pos <= to; pos += step) {
+            double energy = st->energy[pos - lo + st->hop] - st->energy[pos - lo];
+            float score = stretch_dot(st->target, st->mono + pos - lo, st->hop) / sqrtf(energy + 1e-9);
+            if (score > best_score) {
+                best_score = score;
+                best = pos;
+            }
+        }
+        from = FFMAX(best - 3, lo);
+        to   = FFMIN(best + 3, hi);
+    }
+    return best;
+}
+
+/* add nb_frames samples of fmt (s16 or flt) to the input */
+static int stretch_append(Stretch *st, const uint8_t *samples, int nb_frames, enum AVSampleFormat fmt)
+{
+    int c = st->channels;
+    int i;
+
+    if (st->in_frames + nb_frames > st->in_alloc) {
+        int alloc = FFMAX(st->in_frames + nb_frames, 2 * st->in_alloc);
+        if (av_reallocp_array(&st->in, alloc * c, sizeof(*st->in)) < 0)
+            return AVERROR(ENOMEM);
+        st->in_alloc = alloc;
+    }
+    if (fmt == AV_SAMPLE_FMT_FLT) {
+        memcpy(st->in + st->in_frames * c, samples, nb_frames * c * sizeof(float));
+    } else {
+        const int16_t *s16 = (const int16_t *)samples;
+        for (i = 0; i < nb_frames * c; i++)
+            st->in[st->in_frames * c + i] = s16[i] * (1.0f / 32768);
+    }
+    st->in_frames += nb_frames;
+    return 0;
+}
+
+/* out_frames of out in fmt, *out points to them, their size in bytes is returned */
+static int stretch_output(Stretch *st, int out_frames, enum AVSampleFormat fmt, uint8_t **out)
+{
+    int c = st->channels;
+    int i;
+
+    if (fmt == AV_SAMPLE_FMT_FLT) {
+        *out = (uint8_t *)st->out;
+        return out_frames * c * sizeof(float);
+    }
+    av_fast_malloc(&st->out_s16, &st->out_s16_size, out_frames * c * sizeof(int16_t));
+    if (!st->out_s16)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < out_frames * c; i++)
+        ((int16_t *)st->out_s16)[i] = av_clip_int16(lrintf(st->out[i] * 32768));
+    *out = st->out_s16;
+    return out_frames * c * sizeof(int16_t);
+}
+
+/* stretch nb_frames samples of fmt (s16 or flt) to 1 / speed of their duration,
+   *out points to the output, its size in bytes is returned */
+static int stretch_process(Stretch *st, const uint8_t *samples, int nb_frames, enum AVSampleFormat fmt,
+                           double speed, uint8_t **out)
+{
+    int c = st->channels, hop = st->hop;
+    int i, out_frames = 0, keep;
+
+    if ((i = stretch_append(st, samples, nb_frames, fmt)) < 0)
+        return i;
+
+    for (;;) {
+        int nominal = lrint(st->pos), start;
+        const float *seg;
+
+        if (nominal + st->search + 2 * hop > st->in_frames ||
+            (st->cont >= 0 && st->cont + hop > st->in_frames))
+            break;
+        if (out_frames + hop > st->out_alloc) {
+            int alloc = FFMAX(out_frames + hop, 2 * st->out_alloc);
+            if (av_reallocp_array(&st->out, alloc * c, sizeof(*st->out)) < 0)
+                return AVERROR(ENOMEM);
+            st->out_alloc = alloc;
+        }
+
+        start = st->cont < 0 ? nominal : stretch_search(st, nominal);
+        seg = st->in + start * c;
+        for (i = 0; i < hop * c; i++) {
+            st->out[out_frames * c + i] = st->overlap[i] + st->window[i / c] * seg[i];
+            st->overlap[i] = st->window[hop + i / c] * seg[hop * c + i];
+        }
+        out_frames += hop;
+        st->cont = start + hop;
+        st->pos += hop * speed;
+    }
+
+    /* drop what no segment can start in any more */
+    keep = FFMAX(0, FFMIN(st->cont, (int)lrint(st->pos) - st->search));
+    if (keep > 0) {
+        memmove(st->in, st->in + keep * c, (st->in_frames - keep) * c * sizeof(*st->in));
+        st->in_frames -= keep;
+        st->pos       -= keep;
+        st->cont      -= keep;
+    }
+
+    return stretch_output(st, out_frames, fmt, out);
+}
+
+/* back to 1x: the input the stretcher holds, the cross-fade with the last
+   segment first, then nb_frames new samples of fmt, and reset */
+static int stretch_flush(Stretch *st, const uint8_t *samples, int nb_frames, enum AVSampleFormat fmt,
+                         uint8_t **out)
+{
+    int c = st->channels;
+    int i, start, fade, out_frames;
+
+    if ((i = stretch_append(st, samples, nb_frames, fmt)) < 0)
+        return i;
+    start = st->cont < 0 ? av_clip(lrint(st->pos), 0, st->in_frames) : FFMIN(st->cont, st->in_frames);
+    out_frames = st->in_frames - start;
+    if (out_frames > st->out_alloc) {
+        if (av_reallocp_array(&st->out, out_frames * c, sizeof(*st->out)) < 0)
+            return AVERROR(ENOMEM);
+        st->out_alloc = out_frames;
+    }
+    /* the overlap is all zero before the first segment */
+    fade = FFMIN(st->hop, out_frames);
+    for (i = 0; i < fade * c; i++)
+        st->out[i] = st->overlap[i] + st->window[i / c] * st->in[start * c + i];
+    memcpy(st->out + fade * c, st->in + (start + fade) * c, (out_frames - fade) * c * sizeof(*st->out));
+    stretch_reset(st);
+    return stretch_output(st, out_frames, fmt, out);
+}
+
+/* input of the stretcher that has not been played, in seconds */
+static double stretch_delay(Stretch *st)
+{
+    return (st->in_frames - st->pos) / st->rate;
+}
+
+/* K-weighting filters and channel weights, the filter design follows libebur128 */
+static void meter_configure(Meter *m, int channels, int freq, int64_t channel_layout)
+{
+    const double shelf_q = 0.7071752369554196, high_pass_q = 0.5003270373238773;
+    double K, Vh, Vb, a0;
+    int ch;
+
+    memset(m->state, 0, sizeof(m->state));
+    memset(m->peak, 0, sizeof(m->peak));
+    memset(m->sum, 0, sizeof(m->sum));
+    memset(m->ksum, 0, sizeof(m->ksum));
+    m->channels       = FFMIN(channels, METER_MAX_CHANNELS);
+    m->freq           = freq;
+    m->channel_layout = channel_layout;
+    m->block_len      = FFMAX(freq * METER_BLOCK_MS / 1000, 1);
+    m->block_pos      = 0;
+    m->block_index    = 0;
+    m->nb_blocks      = 0;
+
+    /* high shelf, +4 dB above ~1.5 kHz */
+    K  = tan(M_PI * 1681.974450955533 / freq);
+    Vh = pow(10.0, 3.999843853973347 / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / shelf_q + K * K;
+    m->coef[0][0] = (Vh + Vb * K / shelf_q + K * K) / a0;
+    m->coef[0][1] = 2.0 * (K * K - Vh) / a0;
+    m->coef[0][2] = (Vh - Vb * K / shelf_q + K * K) / a0;
+    m->coef[0][3] = 2.0 * (K * K - 1.0) / a0;
+    m->coef[0][4] = (1.0 - K / shelf_q + K * K) / a0;
+
+    /* RLB high pass at 38 Hz */
+    K  = tan(M_PI * 38.13547087602444 / freq);
+    a0 = 1.0 + K / high_pass_q + K * K;
+    m->coef[1][0] = 1.0;
+    m->coef[1][1] = -2.0;
+    m->coef[1][2] = 1.0;
+    m->coef[1][3] = 2.0 * (K * K - 1.0) / a0;
+    m->coef[1][4] = (1.0 - K / high_pass_q + K * K) / a0;
+
+    for (ch = 0; ch < METER_MAX_CHANNELS; ch++) {
+        uint64_t c = ch < m->channels && channel_layout ? av_channel_layout_extract_channel(channel_layout, ch) : 0;
+
+        if (ch >= m->channels || c & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))
+            m->weight[ch] = 0.0f;
+        else if (c & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_BACK_CENTER))
+            m->weight[ch] = 1.41f;
+        else
+            m->weight[ch] = 1.0f;
+    }
+}
+
+#if HAVE_SSE2
+/* n <= 4 channels of a frame as floats, the other lanes are zero */
+static inline __m128 meter_load(const uint8_t *p, int n, int s16)
+{
+    if (s16) {
+        const int16_t *q = (const int16_t *)p;
+        __m128i v = n == 4 ? _mm_loadl_epi64((const __m128i *)q)
+                           : _mm_setr_epi16(q[0], n > 1 ? q[1] : 0, n > 2 ? q[2] : 0, 0, 0, 0, 0, 0);
+
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), _mm_set1_ps(1.0f / 32768));
+    } else {
+        const float *q = (const float *)p;
+
+        return n == 4 ? _mm_loadu_ps(q) : _mm_setr_ps(q[0], n > 1 ? q[1] : 0, n > 2 ? q[2] : 0, 0);
+    }
+}
+#endif
+
+/* filter nb_frames interleaved frames of stride bytes into the current block.
+   The filters are recursive in time, so the SIMD lanes are the channels. */
+static void meter_accumulate(Meter *m, const uint8_t *buf, int stride, int s16, int nb_frames)
+{
+    const float *b = m->coef[0], *c = m->coef[1];
+    int bps = s16 ? 2 : 4;
+    int g, i;
+
+#if HAVE_SSE2
+    for (g = 0; g < m->channels; g += 4) {
+        int n = FFMIN(m->channels - g, 4);
+        const uint8_t *p = buf + g * bps;
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 b0 = _mm_set1_ps(b[0]), b1 = _mm_set1_ps(b[1]), b2 = _mm_set1_ps(b[2]);
+        const __m128 b3 = _mm_set1_ps(b[3]), b4 = _mm_set1_ps(b[4]);
+        const __m128 c0 = _mm_set1_ps(c[0]), c1 = _mm_set1_ps(c[1]), c2 = _mm_set1_ps(c[2]);
+        const __m128 c3 = _mm_set1_ps(c[3]), c4 = _mm_set1_ps(c[4]);
+        __m128 s0 = _mm_loadu_ps(&m->state[0][0][g]), s1 = _mm_loadu_ps(&m->state[0][1][g]);
+        __m128 t0 = _mm_loadu_ps(&m->state[1][0][g]), t1 = _mm_loadu_ps(&m->state[1][1][g]);
+        __m128 peak = _mm_loadu_ps(&m->peak[g]);
+        __m128 sum  = _mm_loadu_ps(&m->sum[g]);
+        __m128 ksum = _mm_loadu_ps(&m->ksum[g]);
+
+        for (i = 0; i < nb_frames; i++, p += stride) {
+            __m128 x = meter_load(p, n, s16), y, z;
+
+            peak = _mm_max_ps(peak, _mm_and_ps(x, abs_mask));
+            sum  = _mm_add_ps(sum, _mm_mul_ps(x, x));
+            y  = _mm_add_ps(_mm_mul_ps(b0, x), s0);
+            s0 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(b3, y)), s1);
+            s1 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(b4, y));
+            z  = _mm_add_ps(_mm_mul_ps(c0, y), t0);
+            t0 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(c1, y), _mm_mul_ps(c3, z)), t1);
+            t1 = _mm_sub_ps(_mm_mul_ps(c2, y), _mm_mul_ps(c4, z));
+            ksum = _mm_add_ps(ksum, _mm_mul_ps(z, z));
+        }
+        _mm_storeu_ps(&m->state[0][0][g], s0);
+        _mm_storeu_ps(&m->state[0][1][g], s1);
+        _mm_storeu_ps(&m->state[1][0][g], t0);
+        _mm_storeu_ps(&m->state[1][1][g], t1);
+        _mm_storeu_ps(&m->peak[g], peak);
+        _mm_storeu_ps(&m->sum[g],  sum);
+        _mm_storeu_ps(&m->ksum[g], ksum);
+    }
+#else
+    for (g = 0; g < m->channels; g++) {
+        const uint8_t *p = buf + g * bps;
+        float s0 = m->state[0][0][g], s1 = m->state[0][1][g];
+        float t0 = m->state[1][0][g], t1 = m->state[1][1][g];
+
+        for (i = 0; i < nb_frames; i++, p += stride) {
+            float x = s16 ? *(const int16_t *)p / 32768.0f : *(const float *)p, y, z;
+
+            m->peak[g] = FFMAX(m->peak[g], fabsf(x));
+            m->sum[g] += x * x;
+            y  = b[0] * x + s0;
+            s0 = b[1] * x - b[3] * y + s1;
+            s1 = b[2] * x - b[4] * y;
+            z  = c[0] * y + t0;
+            t0 = c[1] * y - c[3] * z + t1;
+            t1 = c[2] * y - c[4] * z;
+            m->ksum[g] += z * z;
+        }
+        m->state[0][0][g] = s0;
+        m->state[0][1][g] = s1;
+        m->state[1][0][g] = t0;
+        m->state[1][1][g] = t1;
+    }
+#endif
+}
+
+static inline float meter_db(float energy)
+{
+    return energy > 1e-10f ? 10.0f * log10f(energy) : -100.0f;
+}
+
+/* close the current block and publish the levels */
+static void meter_publish(Meter *m)
+{
+    float total = 0.0f;
+    int ch, i;
+
+    for (ch = 0; ch < m->channels; ch++) {
+        m->energy [m->block_index][ch] = m->sum [ch] / m->block_len;
+        m->kenergy[m->block_index][ch] = m->ksum[ch] / m->block_len;
+        m->sum[ch] = m->ksum[ch] = 0.0f;
+    }
+    m->block_index = (m->block_index + 1) % METER_WINDOW_BLOCKS;
+    m->nb_blocks   = FFMIN(m->nb_blocks + 1, METER_WINDOW_BLOCKS);
+
+    SDL_AtomicIncRef(&m->seq);
+    SDL_MemoryBarrierRelease();
+    m->levels.channels = m->channels;
+    for (ch = 0; ch < m->channels; ch++) {
+        float e = 0.0f, k = 0.0f;
+
+        for (i = 0; i < m->nb_blocks; i++) {
+            e += m->energy [i][ch];
+            k += m->kenergy[i][ch];
+        }
+        e /= m->nb_blocks;
+        k /= m->nb_blocks;
+        m->levels.peak[ch]     = meter_db(m->peak[ch] * m->peak[ch]);
+        m->levels.rms[ch]      = meter_db(e);
+        m->levels.loudness[ch] = -0.691f + meter_db(k);
+        total += m->weight[ch] * k;
+        m->peak[ch] = 0.0f;
+    }
+    m->levels.momentary = -0.691f + meter_db(total);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicIncRef(&m->seq);
+
+    /* the filters decay to denormals in silence, which are slow to compute */
+    for (i = 0; i < 2 * 2 * METER_MAX_CHANNELS; i++)
+        if (fabsf((&m->state[0][0][0])[i]) < 1e-15f)
+            (&m->state[0][0][0])[i] = 0.0f;
+}
+
+/* meter nb_frames of interleaved device samples, called by the audio thread */
+static void meter_process(Meter *m, const uint8_t *buf, int nb_frames, const struct AudioParams *ap)
+{
+    int s16 = ap->fmt == AV_SAMPLE_FMT_S16;
+
+    if (!s16 && ap->fmt != AV_SAMPLE_FMT_FLT)
+        return;
+    if (m->channels != FFMIN(ap->channels, METER_MAX_CHANNELS) || m->freq != ap->freq || m->channel_layout != ap->channel_layout)
+        meter_configure(m, ap->channels, ap->freq, ap->channel_layout);
+
+    while (nb_frames > 0) {
+        int n = FFMIN(nb_frames, m->block_len - m->block_pos);
+
+        meter_accumulate(m, buf, ap->frame_size, s16, n);
+        buf       += n * ap->frame_size;
+        nb_frames -= n;
+        if ((m->block_pos += n) == m->block_len) {
+            meter_publish(m);
+            m->block_pos = 0;
+        }
+    }
+}
+
+/* copy of the last published levels, returns their seq or -1 if none could be read */
+static int meter_read(Meter *m, MeterLevels *levels)
+{
+    int i, seq;
+
+    for (i = 0; i < 4; i++) {
+        seq = SDL_AtomicGet(&m->seq);
+        if (!seq)
+            return -1;
+        if (seq & 1)
+            continue;
+        SDL_MemoryBarrierAcquire();
+        *levels = m->levels;
+        SDL_MemoryBarrierAcquire();
+        if (SDL_AtomicGet(&m->seq) == seq)
+            return seq;
+    }
+    return -1;
+}
+
+/* bar height of a level in dB */
+static inline int meter_height(float db, int h)
+{
+    return lrintf(av_clipf((db - METER_FLOOR_DB) / -METER_FLOOR_DB, 0.0f, 1.0f) * h);
+}
+
+/* bottom right corner of the window: one bar per channel with the RMS level,
+   a white tick at the peak and a cyan one at the loudness, then a bar with
+   the momentary loudness of all channels and the -23 LUFS reference */
+static void meter_display(VideoState *is)
+{
+    const int bar_w = 6, gap = 2;
+    MeterLevels lv;
+    int seq = meter_read(&is->meter, &lv);
+    int x, y, w, h, ch;
+
+    if (seq < 0 || !lv.channels)
+        return;
+    is->meter_seq_shown = seq;
+
+    h = FFMIN(is->height / 3, 200);
+    w = (lv.channels + 1) * (bar_w + gap) + 2 * gap;
+    x = is->xleft + is->width - w - 8;
+    y = is->ytop + is->height - peaks_bar_height(is) - h - 8;
+    if (x < is->xleft || h < 8)
+        return;
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    fill_rectangle(x, y, w, h);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    x += 2 * gap;
+
+    for (ch = 0; ch < lv.channels; ch++, x += bar_w + gap) {
+        int rms = meter_height(lv.rms[ch], h);
+
+        if (lv.rms[ch] >= -6.0f)
+            SDL_SetRenderDrawColor(renderer, 230, 40, 40, 255);
+        else if (lv.rms[ch] >= -18.0f)
+            SDL_SetRenderDrawColor(renderer, 230, 200, 40, 255);
+        else
+            SDL_SetRenderDrawColor(renderer, 40, 200, 70, 255);
+        fill_rectangle(x, y + h - rms, bar_w, rms);
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        fill_rectangle(x, y + h - FFMAX(meter_height(lv.peak[ch], h), 1), bar_w, 1);
+        SDL_SetRenderDrawColor(renderer, 60, 220, 255, 255);
+        fill_rectangle(x, y + h - FFMAX(meter_height(lv.loudness[ch], h), 1), bar_w, 1);
+    }
+
+    SDL_SetRenderDrawColor(renderer, 60, 220, 255, 255);
+    fill_rectangle(x, y + h - meter_height(lv.momentary, h), bar_w, meter_height(lv.momentary, h));
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    fill_rectangle(x - 1, y + h - meter_height(-23.0f, h), bar_w + 2, 1);
+}
+
+static void stream_component_close(VideoState *is, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecParameters *codecpar;
+
+    if (stream_index < 0 || stream_index >= ic->nb_streams)
+        return;
+    codecpar = ic->streams[stream_index]->codecpar;
+
+    switch (codecpar->codec_type) {
+        case AVMEDIA_TYPE_AUDIO:
+            decoder_abort(&is->auddec, &is->sampq);
+            if (is->audio_push_tid) {
+                SDL_WaitThread(is->audio_push_tid, NULL);
+                is->audio_push_tid = NULL;
+            }
+            av_freep(&is->audio_push_buf);
+            stretch_free(&is->stretch);
+            is->stretch_serial = -1;
+            is->stretch_delay  = 0;
+            is->audio_push_buf_size = 0;
             SDL_CloseAudioDevice(audio_dev);
             decoder_destroy(&is->auddec);
             swr_free(&is->swr_ctx);
+            alloc_stats_free(ALLOC_SITE_AUDIO_BUF, is->audio_buf1_size);
             av_freep(&is->audio_buf1);
             is->audio_buf1_size = 0;
             is->audio_buf = NULL;
+            if (is->capture.samples)
+                alloc_stats_free(ALLOC_SITE_SAMPLES, SAMPLE_ARRAY_SIZE * sizeof(*is->capture.samples));
+            av_freep(&is->capture.samples);
+            is->capture.index = 0;
 
-            if (is->rdft) {
-                av_rdft_end(is->rdft);
-                av_freep(&is->rdft_data);
-                is->rdft = NULL;
-                is->rdft_bits = 0;
-            }
+            spectrum_free(&is->spectrum);
             break;
         case AVMEDIA_TYPE_VIDEO:
             decoder_abort(&is->viddec, &is->pictq);
@@ -1962,11 +4743,21 @@ static void stream_component_close(VideoState *is, int stream_index)
     }
 }
 
+static void prefetch_stop(VideoState *is);
+static void proxy_stop(VideoState *is);
+static void peaks_stop(VideoState *is);
+static void reverse_stop(VideoState *is);
+static void metrics_close(VideoState *is);
+
 static void stream_close(VideoState *is)
 {
     /* XXX: use a special url_shutdown call to abort parse cleanly */
     is->abort_request = 1;
     SDL_WaitThread(is->read_tid, NULL);
+    prefetch_stop(is);
+    proxy_stop(is);
+    peaks_stop(is);
+    reverse_stop(is);
 
     /* close each stream */
     if (is->audio_stream >= 0)
@@ -1987,6 +4778,10 @@ static void stream_close(VideoState *is)
     frame_queue_destory(&is->sampq);
     frame_queue_destory(&is->subpq);
     SDL_DestroyCond(is->continue_read_thread);
+    SDL_DestroyMutex(is->seek_mutex);
+    SDL_DestroyMutex(is->preview_mutex);
+    av_frame_free(&is->preview_frame);
+    scrub_cache_free(&is->scrub_cache);
     sws_freeContext(is->img_convert_ctx);
     sws_freeContext(is->sub_convert_ctx);
     av_free(is->filename);
@@ -1996,6 +4791,11 @@ static void stream_close(VideoState *is)
         SDL_DestroyTexture(is->vid_texture);
     if (is->sub_texture)
         SDL_DestroyTexture(is->sub_texture);
+    if (benchmark)
+        print_benchmark_stats(is);
+    if (is->metrics.fd >= 0)
+        metrics_close(is);
+    av_freep(&is->virtual_sink.buf);
     av_free(is);
 }
 
@@ -2013,11 +4813,76 @@ void uninit_opts(void)
     av_dict_free(&resample_opts);
 }
 
+static void print_seek_stats(VideoState *is)
+{
+    int i;
+
+    if (!is->seek_nb_requests)
+        return;
+
+    av_log(NULL, AV_LOG_INFO, "seeks: requested=%d coalesced=%d cancelled=%d prefetch_hits=%d prefetch_misses=%d scrub_hits=%d scrub_misses=%d proxy_hits=%d reverse_stalls=%d\n",
+           is->seek_nb_requests, is->seek_nb_coalesced, is->seek_nb_cancelled,
+           is->prefetch.nb_hits, is->prefetch.nb_misses,
+           is->scrub_cache.nb_hits, is->scrub_cache.nb_misses, is->proxy.nb_hits,
+           is->reverse.nb_stalls);
+    histogram_print(&is->seek_latency, AV_LOG_INFO);
+    for (i = 0; i < SEEK_NB_STAGES; i++)
+        histogram_print(&is->seek_stages[i], AV_LOG_INFO);
+}
+
+static void print_sync_report(VideoState *is)
+{
+    static const char *const sync_names[AV_SYNC_NB_TYPES] = { "audio", "video", "ext" };
+    int i;
+
+    for (i = 0; i < AV_SYNC_NB_TYPES; i++) {
+        SyncStats *stats = &is->sync_stats[i];
+
+        if (!stats->lateness.count && !stats->callback_jitter.count)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "sync %s: video_ahead=%d video_behind=%d delay_shortened=%d delay_lengthened=%d frame_timer_resets=%d audio_corrections=%d audio_resets=%d\n",
+               sync_names[i], stats->nb_video_ahead, stats->nb_video_behind,
+               stats->nb_delay_shortened, stats->nb_delay_lengthened, stats->nb_frame_timer_resets,
+               stats->nb_audio_corrections, stats->nb_audio_resets);
+        histogram_print(&stats->av_diff, AV_LOG_INFO);
+        histogram_print(&stats->lateness, AV_LOG_INFO);
+        histogram_print(&stats->callback_jitter, AV_LOG_INFO);
+    }
+    if (is->audio_st) {
+        const char *backend = audio_backend_queue ? "queue" : "callback";
+        SyncStats *stats = &is->sync_stats[get_master_sync_type(is)];
+        char name[64];
+
+        av_log(NULL, AV_LOG_INFO, "audio output: backend=%s cpu=%0.3fs underruns=%d\n",
+               backend, is->audio_output_cpu / 1000000.0, is->audio_underruns);
+        if (bench_results) {
+            snprintf(name, sizeof(name), "audio_output_cpu_%s", backend);
+            bench_report(name, is->filename, is->audio_output_cpu / 1000000.0, "s", 1);
+            snprintf(name, sizeof(name), "audio_underruns_%s", backend);
+            bench_report(name, is->filename, is->audio_underruns, "", 1);
+            snprintf(name, sizeof(name), "av_diff_p50_%s", backend);
+            bench_report(name, is->filename, histogram_percentile(&stats->av_diff, 50), "us", stats->av_diff.count);
+            snprintf(name, sizeof(name), "av_diff_p95_%s", backend);
+            bench_report(name, is->filename, histogram_percentile(&stats->av_diff, 95), "us", stats->av_diff.count);
+            /* the queue backend has no callback to time */
+            if (!audio_backend_queue) {
+                snprintf(name, sizeof(name), "callback_jitter_p95_%s", backend);
+                bench_report(name, is->filename, histogram_percentile(&stats->callback_jitter, 95), "us", stats->callback_jitter.count);
+            }
+        }
+    }
+}
+
 static void do_exit(VideoState *is)
 {
     if (is) {
+        print_seek_stats(is);
+        if (sync_report)
+            print_sync_report(is);
         stream_close(is);
     }
+    trace_flush();
+    log_ring_uninit();
     if (renderer)
         SDL_DestroyRenderer(renderer);
     if (window)
@@ -2032,6 +4897,17 @@ static void do_exit(VideoState *is)
     SDL_Quit();
     av_log(NULL, AV_LOG_QUIET, "%s", "");
 
+    if (bench_failures) {
+        av_log(NULL, AV_LOG_ERROR, "bench: %d checks failed\n", bench_failures);
+        exit(1);
+    }
+
+    if (alloc_check) {
+        av_log(NULL, alloc_check_failures ? AV_LOG_ERROR : AV_LOG_INFO, "alloc check: %s, %d steady state allocations\n",
+               alloc_check_failures ? "failed" : "passed", alloc_check_failures);
+        exit(alloc_check_failures ? 1 : 0);
+    }
+
     // terminate program execution with 0
     exit(0);
 }
@@ -2086,11 +4962,19 @@ static void video_display(VideoState *is)
 
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
+    is->presented_serial = -1;
     if (is->audio_st && is->show_mode != SHOW_MODE_VIDEO)
         video_audio_display(is);
     else if (is->video_st)
         video_image_display(is);
+    if (show_meter && is->audio_st)
+        meter_display(is);
+    peaks_display(is);
+    TRACE_BEGIN("present", NAN, -1);
     SDL_RenderPresent(renderer);
+    TRACE_END("present", NAN, -1);
+    if (is->presented_serial >= 0)
+        PLAYER_PROBE(frame_presented, PROBE_US(is->presented_pts), is->presented_serial);
 }
 
 static double get_clock(Clock *c)
@@ -2100,7 +4984,7 @@ static double get_clock(Clock *c)
     if (c->paused) {
         return c->pts;
     } else {
-        double time = av_gettime_relative() / 1000000.0;
+        double time = player_time() / 1000000.0;
         return c->pts_drift + time - (time - c->last_updated) * (1.0 - c->speed);
     }
 }
@@ -2115,7 +4999,7 @@ static void set_clock_at(Clock *c, double pts, int serial, double time)
 
 static void set_clock(Clock *c, double pts, int serial)
 {
-    double time = av_gettime_relative() / 1000000.0;
+    double time = player_time() / 1000000.0;
     set_clock_at(c, pts, serial, time);
 }
 
@@ -2190,25 +5074,87 @@ static void check_external_clock_speed(VideoState *is) {
     }
 }
 
+/**
+ * Requests a seek to read_thread, a request still pending is replaced by the
+ * new target. An exact seek does not show the frames decoded before pos.
+ */
+static void request_seek(VideoState *is, int64_t pos, int64_t rel, int seek_by_bytes, int exact)
+{
+    SDL_LockMutex(is->seek_mutex);
+    if (is->seek_req)
+        is->seek_nb_coalesced++;
+    is->seek_nb_requests++;
+    is->seek_pos = pos;
+    is->seek_rel = rel;
+    is->seek_flags &= ~AVSEEK_FLAG_BYTE;
+    if (seek_by_bytes)
+        is->seek_flags |= AVSEEK_FLAG_BYTE;
+    is->seek_req_time = av_gettime_relative();
+    is->seek_input_time = is->input_time != AV_NOPTS_VALUE ? is->input_time : is->seek_req_time;
+    is->seek_exact = exact;
+    is->seek_req = 1;
+    SDL_UnlockMutex(is->seek_mutex);
+    SDL_CondSignal(is->continue_read_thread);
+}
+
 /* seek in the stream */
 static void stream_seek(VideoState *is, int64_t pos, int64_t rel, int seek_by_bytes)
 {
-    if (!is->seek_req) {
-        is->seek_pos = pos;
-        is->seek_rel = rel;
-        is->seek_flags &= ~AVSEEK_FLAG_BYTE;
-        if (seek_by_bytes)
-            is->seek_flags |= AVSEEK_FLAG_BYTE;
-        is->seek_req = 1;
-        SDL_CondSignal(is->continue_read_thread);
-    }
+    request_seek(is, pos, rel, seek_by_bytes, 0);
+}
+
+/* seek to the frame at pos, decoding from the previous keyframe without showing it */
+static void stream_seek_exact(VideoState *is, int64_t pos)
+{
+    request_seek(is, pos, 0, 0, 1);
+}
+
+/* note the first frame decoded after the executed seek */
+static void seek_mark_decoded(VideoState *is, int serial)
+{
+    if (is->seek_latency_start == AV_NOPTS_VALUE || is->seek_timing.decoded != AV_NOPTS_VALUE)
+        return;
+
+    SDL_LockMutex(is->seek_mutex);
+    if (is->seek_latency_start != AV_NOPTS_VALUE && serial == is->seek_serial && is->seek_timing.decoded == AV_NOPTS_VALUE)
+        is->seek_timing.decoded = av_gettime_relative();
+    SDL_UnlockMutex(is->seek_mutex);
+}
+
+/* account the latency of the executed seek once the first frame of its serial is presented */
+static void update_seek_latency(VideoState *is, int serial)
+{
+    if (is->seek_latency_start == AV_NOPTS_VALUE)
+        return;
+
+    SDL_LockMutex(is->seek_mutex);
+    if (is->seek_latency_start != AV_NOPTS_VALUE && serial == is->seek_serial) {
+        SeekTiming *t = &is->seek_timing;
+        int64_t now = av_gettime_relative();
+
+        is->seek_latency_last = now - is->seek_latency_start;
+        histogram_add(&is->seek_latency, is->seek_latency_last);
+        /* a frame shown from the prefetcher or a cache was never decoded for this serial */
+        if (t->decoded == AV_NOPTS_VALUE)
+            t->decoded = now;
+        histogram_add(&is->seek_stages[SEEK_STAGE_INPUT],   t->request - t->input);
+        histogram_add(&is->seek_stages[SEEK_STAGE_QUEUED],  t->start   - t->request);
+        histogram_add(&is->seek_stages[SEEK_STAGE_SEEK],    t->seeked  - t->start);
+        histogram_add(&is->seek_stages[SEEK_STAGE_FLUSH],   t->flushed - t->seeked);
+        histogram_add(&is->seek_stages[SEEK_STAGE_DECODE],  t->decoded - t->flushed);
+        histogram_add(&is->seek_stages[SEEK_STAGE_PRESENT], now        - t->decoded);
+        histogram_add(&is->seek_stages[SEEK_STAGE_TOTAL],   now        - t->input);
+        PLAYER_PROBE(seek_end, is->seek_latency_last, serial);
+        is->seek_latency_start = AV_NOPTS_VALUE;
+    }
+    SDL_UnlockMutex(is->seek_mutex);
 }
 
 /* pause or resume the video */
 static void stream_toggle_pause(VideoState *is)
 {
     if (is->paused) {
-        is->frame_timer += av_gettime_relative() / 1000000.0 - is->vidclk.last_updated;
+        is->frame_timer += player_time() / 1000000.0 - is->vidclk.last_updated;
         if (is->read_pause_return != AVERROR(ENOSYS)) {
             is->vidclk.paused = 0;
         }
@@ -2216,6 +5162,9 @@ static void stream_toggle_pause(VideoState *is)
     }
     set_clock(&is->extclk, get_clock(&is->extclk), is->extclk.serial);
     is->paused = is->audclk.paused = is->vidclk.paused = is->extclk.paused = !is->paused;
+    /* keep what is queued for when playback resumes */
+    if (audio_backend_queue && audio_dev)
+        SDL_PauseAudioDevice(audio_dev, is->paused);
 }
 
 static void toggle_pause(VideoState *is)
@@ -2229,6 +5178,18 @@ static void toggle_mute(VideoState *is)
     is->muted = !is->muted;
 }
 
+/* the clocks advance at the playback speed, the audio is stretched to it */
+static void set_playback_speed(VideoState *is, double speed)
+{
+    if (is->realtime && speed != 1.0)
+        return;
+    playback_speed = av_clipd(speed, PLAYBACK_SPEED_MIN, PLAYBACK_SPEED_MAX);
+    set_clock_speed(&is->audclk, playback_speed);
+    set_clock_speed(&is->vidclk, playback_speed);
+    set_clock_speed(&is->extclk, playback_speed);
+    av_log(NULL, AV_LOG_INFO, "Playback speed %0.2fx\n", playback_speed);
+}
+
 static void update_volume(VideoState *is, int sign, double step)
 {
     double volume_level = is->audio_volume ? (20 * log(is->audio_volume / (double)SDL_MIX_MAXVOLUME) / log(10)) : -1000.0;
@@ -2251,25 +5212,30 @@ static double compute_target_delay(double delay, VideoState *is)
     /* update delay to follow master synchronisation source */
     if (get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER) {
         /* if video is slave, we try to correct big delays by
-           duplicating or deleting a frame */
-        diff = get_clock(&is->vidclk) - get_master_clock(is);
+           duplicating or deleting a frame, diff is in presentation time */
+        diff = (get_clock(&is->vidclk) - get_master_clock(is)) / playback_speed;
 
         /* skip or repeat frame. We take into account the
            delay to compute the threshold. I still don't know
            if it is the best guess */
         sync_threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX, delay));
         if (!isnan(diff) && fabs(diff) < is->max_frame_duration) {
-            if (diff <= -sync_threshold)
+            SyncStats *stats = &is->sync_stats[get_master_sync_type(is)];
+            if (diff <= -sync_threshold) {
                 delay = FFMAX(0, delay + diff);
-            else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD)
+                stats->nb_delay_shortened++;
+            } else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD) {
                 delay = delay + diff;
-            else if (diff >= sync_threshold)
+                stats->nb_delay_lengthened++;
+            } else if (diff >= sync_threshold) {
                 delay = 2 * delay;
+                stats->nb_delay_lengthened++;
+            }
         }
     }
 
-    av_log(NULL, AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n",
-           delay, -diff);
+    HOT_LOG(AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n",
+            delay, -diff);
 
     return delay;
 }
@@ -2294,6 +5260,30 @@ static void update_video_pts(VideoState *is, double pts, int64_t pos, int serial
     sync_clock_to_slave(&is->extclk, &is->vidclk);
 }
 
+/* account how late a frame is presented, in seconds past its scheduled time */
+static void sync_stats_add_lateness(VideoState *is, double lateness)
+{
+    histogram_add(&is->sync_stats[get_master_sync_type(is)].lateness, (int64_t)(FFMAX(lateness, 0) * 1000000));
+}
+
+/* account the lip-sync error of the frame being presented */
+static void sync_stats_add_av_diff(VideoState *is)
+{
+    SyncStats *stats = &is->sync_stats[get_master_sync_type(is)];
+    double diff;
+
+    if (!is->audio_st)
+        return;
+    diff = get_clock(&is->vidclk) - get_clock(&is->audclk);
+    if (isnan(diff) || fabs(diff) >= AV_NOSYNC_THRESHOLD)
+        return;
+    histogram_add(&stats->av_diff, (int64_t)(fabs(diff) * 1000000));
+    if (diff > 0)
+        stats->nb_video_ahead++;
+    else if (diff < 0)
+        stats->nb_video_behind++;
+}
+
 /* called to display each frame */
 static void video_refresh(void *opaque, double *remaining_time)
 {
@@ -2305,8 +5295,11 @@ static void video_refresh(void *opaque, double *remaining_time)
     if (!is->paused && get_master_sync_type(is) == AV_SYNC_EXTERNAL_CLOCK && is->realtime)
         check_external_clock_speed(is);
 
+    if (!is->video_st && is->audio_st)
+        update_seek_latency(is, is->audclk.serial);
+
     if (!display_disable && is->show_mode != SHOW_MODE_VIDEO && is->audio_st) {
-        time = av_gettime_relative() / 1000000.0;
+        time = player_time() / 1000000.0;
         if (is->force_refresh || is->last_vis_time + rdftspeed < time) {
             video_display(is);
             is->last_vis_time = time;
@@ -2314,6 +5307,10 @@ static void video_refresh(void *opaque, double *remaining_time)
         *remaining_time = FFMIN(*remaining_time, is->last_vis_time + rdftspeed - time);
     }
 
+    /* redraw the last picture when the meter has new levels */
+    if (show_meter && is->audio_st && SDL_AtomicGet(&is->meter.seq) != is->meter_seq_shown)
+        is->force_refresh = 1;
+
     if (is->video_st) {
         retry:
         if (frame_queue_nb_remaining(&is->pictq) == 0) {
@@ -2332,35 +5329,40 @@ static void video_refresh(void *opaque, double *remaining_time)
             }
 
             if (lastvp->serial != vp->serial)
-                is->frame_timer = av_gettime_relative() / 1000000.0;
+                is->frame_timer = player_time() / 1000000.0;
 
             if (is->paused)
                 goto display;
 
             /* compute nominal last_duration */
-            last_duration = vp_duration(is, lastvp, vp);
+            last_duration = vp_duration(is, lastvp, vp) / playback_speed;
             delay = compute_target_delay(last_duration, is);
 
-            time= av_gettime_relative()/1000000.0;
+            time= player_time() / 1000000.0;
             if (time < is->frame_timer + delay) {
                 *remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
                 goto display;
             }
 
             is->frame_timer += delay;
-            if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX)
+            sync_stats_add_lateness(is, time - is->frame_timer);
+            if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX) {
+                is->sync_stats[get_master_sync_type(is)].nb_frame_timer_resets++;
                 is->frame_timer = time;
+            }
 
             SDL_LockMutex(is->pictq.mutex);
             if (!isnan(vp->pts))
                 update_video_pts(is, vp->pts, vp->pos, vp->serial);
             SDL_UnlockMutex(is->pictq.mutex);
+            sync_stats_add_av_diff(is);
 
             if (frame_queue_nb_remaining(&is->pictq) > 1) {
                 Frame *nextvp = frame_queue_peek_next(&is->pictq);
-                duration = vp_duration(is, vp, nextvp);
+                duration = vp_duration(is, vp, nextvp) / playback_speed;
                 if(!is->step && (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) && time > is->frame_timer + duration){
                     is->frame_drops_late++;
+                    PLAYER_PROBE(frame_dropped, 1, PROBE_US(vp->pts), vp->serial);
                     frame_queue_next(&is->pictq);
                     goto retry;
                 }
@@ -2400,6 +5402,8 @@ static void video_refresh(void *opaque, double *remaining_time)
                 }
             }
 
+            update_seek_latency(is, vp->serial);
+            clear_preview_frame(is, vp->serial);
             frame_queue_next(&is->pictq);
             is->force_refresh = 1;
 
@@ -2408,11 +5412,12 @@ static void video_refresh(void *opaque, double *remaining_time)
         }
         display:
         /* display picture */
-        if (!display_disable && is->force_refresh && is->show_mode == SHOW_MODE_VIDEO && is->pictq.rindex_shown)
+        if (!display_disable && is->force_refresh && is->show_mode == SHOW_MODE_VIDEO && (is->pictq.rindex_shown || is->preview_frame->buf[0]))
             video_display(is);
     }
     is->force_refresh = 0;
-    if (show_status) {
+    /* -metrics replaces the status line */
+    if (show_status && !metrics_filename) {
         static int64_t last_time;
         int64_t cur_time;
         int aqsize, vqsize, sqsize;
@@ -2453,15 +5458,165 @@ static void video_refresh(void *opaque, double *remaining_time)
     }
 }
 
-static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double duration, int64_t pos, int serial)
+/* open the -metrics output; a FIFO without a reader is retried on the next interval */
+static int metrics_open(VideoState *is)
 {
-    Frame *vp;
-
-    printf("frame_type=%c pts=%0.3f\n",
-           av_get_picture_type_char(src_frame->pict_type), pts);
+    Metrics *m = &is->metrics;
 
-    if (!(vp = frame_queue_peek_writable(&is->pictq)))
+    if (!strcmp(metrics_filename, "-"))
+        m->fd = 1;
+    else
+        m->fd = open(metrics_filename, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+    if (m->fd < 0) {
+        if (errno != ENXIO) {
+            av_log(NULL, AV_LOG_ERROR, "Could not open metrics output '%s': %s\n", metrics_filename, strerror(errno));
+            m->failed = 1;
+        }
         return -1;
+    }
+    m->header_written = 0;
+    return 0;
+}
+
+static void metrics_close(VideoState *is)
+{
+    Metrics *m = &is->metrics;
+
+    if (m->fd > 2)
+        close(m->fd);
+    m->fd = -1;
+    if (m->nb_lost)
+        av_log(NULL, AV_LOG_WARNING, "metrics: %"PRId64" lines lost to a slow or missing reader\n", m->nb_lost);
+    m->nb_lost = 0;
+}
+
+/* write one whole line, never blocking the caller: a full pipe loses the line */
+static void metrics_write(VideoState *is, const AVBPrint *buf)
+{
+    Metrics *m = &is->metrics;
+    ssize_t ret = write(m->fd, buf->str, buf->len);
+
+    if (ret == buf->len)
+        return;
+    m->nb_lost++;
+    if (ret < 0 && errno == EPIPE) {
+        /* the reader went away, reopen once another one shows up */
+        metrics_close(is);
+    }
+}
+
+/* append the counters of the elapsed interval to the -metrics output */
+/* value with 3 decimals, or missing when it is not a finite number (clocks not set yet) */
+static const char *metrics_value(char *buf, size_t size, double value, const char *missing)
+{
+    if (!isfinite(value))
+        return missing;
+    snprintf(buf, size, "%0.3f", value);
+    return buf;
+}
+
+static void metrics_update(VideoState *is)
+{
+    Metrics *m = &is->metrics;
+    int64_t cur_time = av_gettime_relative();
+    double elapsed, clock, av_diff = 0, aq_duration = 0, vq_duration = 0, sq_duration = 0;
+    char clock_buf[32], av_diff_buf[32];
+    int64_t seek_latency_last, seek_latency_p95;
+    double audio_latency = 0;
+    int nb_decoded_frames = is->nb_decoded_frames;
+    const char *sync = "   ";
+    AVBPrint buf;
+
+    if (m->failed || (m->last_time && cur_time - m->last_time < metrics_interval * 1000LL))
+        return;
+    if (m->fd < 0 && metrics_open(is) < 0)
+        return;
+
+    elapsed = m->last_time ? (cur_time - m->last_time) / 1000000.0 : 0;
+    if (is->audio_st && is->video_st) {
+        sync = "A-V";
+        av_diff = get_clock(&is->audclk) - get_clock(&is->vidclk);
+    } else if (is->video_st) {
+        sync = "M-V";
+        av_diff = get_master_clock(is) - get_clock(&is->vidclk);
+    } else if (is->audio_st) {
+        sync = "M-A";
+        av_diff = get_master_clock(is) - get_clock(&is->audclk);
+    }
+    clock = get_master_clock(is);
+    if (is->audio_st) {
+        aq_duration = is->audioq.duration * av_q2d(is->audio_st->time_base);
+        /* the two device periods the audio clock assumes */
+        if (is->audio_tgt.bytes_per_sec > 0)
+            audio_latency = 1000.0 * 2 * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec;
+    }
+    if (is->video_st)
+        vq_duration = is->videoq.duration * av_q2d(is->video_st->time_base);
+    if (is->subtitle_st)
+        sq_duration = is->subtitleq.duration * av_q2d(is->subtitle_st->time_base);
+
+    SDL_LockMutex(is->seek_mutex);
+    seek_latency_last = is->seek_latency_last;
+    seek_latency_p95  = histogram_percentile(&is->seek_latency, 95);
+    SDL_UnlockMutex(is->seek_mutex);
+
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
+    if (!strcmp(metrics_format, "csv")) {
+        if (!m->header_written)
+            av_bprintf(&buf, "time,clock,sync,av_diff,paused,decode_fps,"
+                             "drops_early,drops_late,drops_preroll,audio_underruns,audio_latency,"
+                             "aq_bytes,vq_bytes,sq_bytes,aq_duration,vq_duration,sq_duration,"
+                             "faulty_dts,faulty_pts,seek_latency_last,seek_latency_p95\n");
+        av_bprintf(&buf, "%0.3f,%s,%s,%s,%d,%0.2f,%d,%d,%d,%d,%0.1f,%d,%d,%d,%0.3f,%0.3f,%0.3f,%"PRId64",%"PRId64",%"PRId64",%"PRId64"\n",
+                   av_gettime() / 1000000.0, metrics_value(clock_buf, sizeof(clock_buf), clock, ""), sync,
+                   metrics_value(av_diff_buf, sizeof(av_diff_buf), av_diff, ""), is->paused,
+                   elapsed > 0 ? (nb_decoded_frames - m->last_decoded_frames) / elapsed : 0,
+                   is->frame_drops_early, is->frame_drops_late, is->frame_drops_preroll, is->audio_underruns, audio_latency,
+                   is->audioq.size, is->videoq.size, is->subtitleq.size, aq_duration, vq_duration, sq_duration,
+                   is->video_st ? is->viddec.avctx->pts_correction_num_faulty_dts : 0,
+                   is->video_st ? is->viddec.avctx->pts_correction_num_faulty_pts : 0,
+                   seek_latency_last, seek_latency_p95);
+    } else {
+        av_bprintf(&buf, "{\"time\": %0.3f, \"input\": \"", av_gettime() / 1000000.0);
+        av_bprint_escape(&buf, is->filename, "\"\\", AV_ESCAPE_MODE_BACKSLASH, 0);
+        av_bprintf(&buf, "\", \"clock\": %s, \"sync\": \"%s\", \"av_diff\": %s, \"paused\": %d, \"decode_fps\": %0.2f, "
+                         "\"drops\": {\"early\": %d, \"late\": %d, \"preroll\": %d}, \"audio_underruns\": %d, \"audio_latency_ms\": %0.1f, "
+                         "\"queues\": {\"audio\": {\"bytes\": %d, \"duration\": %0.3f}, \"video\": {\"bytes\": %d, \"duration\": %0.3f}, "
+                         "\"subtitle\": {\"bytes\": %d, \"duration\": %0.3f}}, "
+                         "\"faulty_dts\": %"PRId64", \"faulty_pts\": %"PRId64", \"seek_latency_us\": {\"last\": %"PRId64", \"p95\": %"PRId64"}}\n",
+                   metrics_value(clock_buf, sizeof(clock_buf), clock, "null"), sync,
+                   metrics_value(av_diff_buf, sizeof(av_diff_buf), av_diff, "null"), is->paused,
+                   elapsed > 0 ? (nb_decoded_frames - m->last_decoded_frames) / elapsed : 0,
+                   is->frame_drops_early, is->frame_drops_late, is->frame_drops_preroll, is->audio_underruns, audio_latency,
+                   is->audioq.size, aq_duration, is->videoq.size, vq_duration, is->subtitleq.size, sq_duration,
+                   is->video_st ? is->viddec.avctx->pts_correction_num_faulty_dts : 0,
+                   is->video_st ? is->viddec.avctx->pts_correction_num_faulty_pts : 0,
+                   seek_latency_last, seek_latency_p95);
+    }
+    if (av_bprint_is_complete(&buf)) {
+        metrics_write(is, &buf);
+        m->header_written = m->fd >= 0;
+    }
+    av_bprint_finalize(&buf, NULL);
+
+    m->last_time = cur_time;
+    m->last_decoded_frames = nb_decoded_frames;
+}
+
+static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double duration, int64_t pos, int serial)
+{
+    Frame *vp;
+
+    HOT_LOG(AV_LOG_DEBUG, "frame_type=%c pts=%0.3f\n",
+            av_get_picture_type_char(src_frame->pict_type), pts);
+
+    PLAYER_PROBE(frame_queued, PROBE_US(pts), serial);
+    TRACE_BEGIN("queue_picture", pts, serial);
+    vp = frame_queue_peek_writable(&is->pictq);
+    if (!vp) {
+        TRACE_END("queue_picture", pts, serial);
+        return -1;
+    }
 
     vp->sar = src_frame->sample_aspect_ratio;
     vp->uploaded = 0;
@@ -2479,25 +5634,36 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double
 
     av_frame_move_ref(vp->frame, src_frame);
     frame_queue_push(&is->pictq);
+    TRACE_END("queue_picture", pts, serial);
     return 0;
 }
 
 static int get_video_frame(VideoState *is, AVFrame *frame)
 {
+    enum AVDiscard skip_frame = is->skip_frame;
     int got_picture;
 
+    /* fast playback does not need the frames nothing refers to */
+    if (playback_speed >= SPEED_SKIP_NONREF)
+        skip_frame = FFMAX(skip_frame, AVDISCARD_NONREF);
+    if (is->viddec.avctx->skip_frame != skip_frame)
+        is->viddec.avctx->skip_frame = skip_frame;
+
     if ((got_picture = decoder_decode_frame(&is->viddec, frame, NULL)) < 0)
         return -1;
 
     if (got_picture) {
         double dpts = NAN;
 
+        is->nb_decoded_frames++;
+
         if (frame->pts != AV_NOPTS_VALUE)
             dpts = av_q2d(is->video_st->time_base) * frame->pts;
 
         frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st, frame);
 
-        if (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) {
+        /* the virtual clock waits for the decoders, they are never late */
+        if (!virtual_clock && (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER))) {
             if (frame->pts != AV_NOPTS_VALUE) {
                 double diff = dpts - get_master_clock(is);
                 if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
@@ -2505,11 +5671,27 @@ static int get_video_frame(VideoState *is, AVFrame *frame)
                     is->viddec.pkt_serial == is->vidclk.serial &&
                     is->videoq.nb_packets) {
                     is->frame_drops_early++;
+                    PLAYER_PROBE(frame_dropped, 0, PROBE_US(dpts), is->viddec.pkt_serial);
                     av_frame_unref(frame);
                     got_picture = 0;
                 }
             }
         }
+
+        /* above 1x, keep no more frames than can be presented: one per
+           SPEED_PRESENT_FPS period of presentation time */
+        if (got_picture && playback_speed > 1.0 && !isnan(dpts) && !virtual_clock) {
+            if (!isnan(is->speed_last_kept) && dpts > is->speed_last_kept &&
+                dpts - is->speed_last_kept < playback_speed / SPEED_PRESENT_FPS &&
+                is->viddec.pkt_serial == is->vidclk.serial) {
+                is->frame_drops_early++;
+                PLAYER_PROBE(frame_dropped, 0, PROBE_US(dpts), is->viddec.pkt_serial);
+                av_frame_unref(frame);
+                got_picture = 0;
+            } else {
+                is->speed_last_kept = dpts;
+            }
+        }
     }
 
     return got_picture;
@@ -2683,9 +5865,15 @@ static int configure_video_filters(AVFilterGraph *graph, VideoState *is, const c
     return ret;
 }
 
+/* sample format to open the device with, float decoders keep float */
+static enum AVSampleFormat audio_device_fmt(enum AVSampleFormat fmt)
+{
+    return av_get_packed_sample_fmt(fmt) == AV_SAMPLE_FMT_FLT ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+}
+
 static int configure_audio_filters(VideoState *is, const char *afilters, int force_output_format)
 {
-    static const enum AVSampleFormat sample_fmts[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE };
+    enum AVSampleFormat sample_fmts[3];
     int sample_rates[2] = { 0, -1 };
     int64_t channel_layouts[2] = { 0, -1 };
     int channels[2] = { 0, -1 };
@@ -2726,6 +5914,11 @@ static int configure_audio_filters(VideoState *is, const char *afilters, int for
     if (ret < 0)
         goto end;
 
+    /* the planar variant is accepted too, audio_decode_frame() interleaves it
+       itself so no resampler is inserted when nothing else differs */
+    sample_fmts[0] = force_output_format ? is->audio_tgt.fmt : audio_device_fmt(is->audio_filter_src.fmt);
+    sample_fmts[1] = av_get_planar_sample_fmt(sample_fmts[0]);
+    sample_fmts[2] = AV_SAMPLE_FMT_NONE;
     if ((ret = av_opt_set_int_list(filt_asink, "sample_fmts", sample_fmts,  AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
         goto end;
 
@@ -2774,9 +5967,39 @@ static int audio_thread(void *arg)
     if (!frame)
         return AVERROR(ENOMEM);
 
+    benchmark_thread_begin(is, BENCHMARK_THREAD_AUDIO);
+    trace_thread_name("audio decoder");
     do {
         if ((got_frame = decoder_decode_frame(&is->auddec, frame, NULL)) < 0)
             goto the_end;
+        if (got_frame && !is->video_st)
+            seek_mark_decoded(is, is->auddec.pkt_serial);
+
+        /* do not filter frames of a position we already seeked away from */
+        if (got_frame && is->auddec.pkt_serial != is->audioq.serial) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        /* exact seek: skip what ends before the target */
+        if (got_frame && is->auddec.pkt_serial == is->preroll_audio_serial && frame->pts != AV_NOPTS_VALUE &&
+            (frame->pts + frame->nb_samples) / (double)frame->sample_rate <= is->preroll_target) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        /* benchmark without filters: queue the decoded samples as they are */
+        if (got_frame && benchmark && !benchmark_filters) {
+            if (!(af = frame_queue_peek_writable(&is->sampq)))
+                goto the_end;
+            af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts / (double)frame->sample_rate;
+            af->pos = frame->pkt_pos;
+            af->serial = is->auddec.pkt_serial;
+            af->duration = av_q2d((AVRational){frame->nb_samples, frame->sample_rate});
+            av_frame_move_ref(af->frame, frame);
+            frame_queue_push(&is->sampq);
+            continue;
+        }
 
         if (got_frame) {
             tb = (AVRational){1, frame->sample_rate};
@@ -2808,10 +6031,18 @@ static int audio_thread(void *arg)
                     goto the_end;
             }
 
-            if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
+            TRACE_BEGIN("buffersrc_add_frame", NAN, is->auddec.pkt_serial);
+            ret = av_buffersrc_add_frame(is->in_audio_filter, frame);
+            TRACE_END("buffersrc_add_frame", NAN, is->auddec.pkt_serial);
+            if (ret < 0)
                 goto the_end;
 
-            while ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame, 0)) >= 0) {
+            for (;;) {
+                TRACE_BEGIN("buffersink_get_frame", NAN, is->auddec.pkt_serial);
+                ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame, 0);
+                TRACE_END("buffersink_get_frame", NAN, is->auddec.pkt_serial);
+                if (ret < 0)
+                    break;
                 tb = av_buffersink_get_time_base(is->out_audio_filter);
                 if (!(af = frame_queue_peek_writable(&is->sampq)))
                     goto the_end;
@@ -2821,6 +6052,7 @@ static int audio_thread(void *arg)
                 af->serial = is->auddec.pkt_serial;
                 af->duration = av_q2d((AVRational){frame->nb_samples, frame->sample_rate});
 
+                sample_capture_add(is, frame, af->pts, af->serial);
                 av_frame_move_ref(af->frame, frame);
                 frame_queue_push(&is->sampq);
                 if (is->audioq.serial != is->auddec.pkt_serial)
@@ -2831,6 +6063,7 @@ static int audio_thread(void *arg)
         }
     } while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
     the_end:
+    benchmark_thread_end(is, BENCHMARK_THREAD_AUDIO);
     avfilter_graph_free(&is->agraph);
     av_frame_free(&frame);
     return ret;
@@ -2873,12 +6106,47 @@ static int video_thread(void *arg)
         return AVERROR(ENOMEM);
     }
 
+    benchmark_thread_begin(is, BENCHMARK_THREAD_VIDEO);
+    trace_thread_name("video decoder");
     for (;;) {
         ret = get_video_frame(is, frame);
         if (ret < 0)
             goto the_end;
         if (!ret)
             continue;
+        seek_mark_decoded(is, is->viddec.pkt_serial);
+
+        if (frame->key_frame)
+            scrub_cache_add(is, frame, is->video_st->time_base);
+
+        /* do not filter frames of a position we already seeked away from */
+        if (is->viddec.pkt_serial != is->videoq.serial) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        /* exact seek: decode but do not show the frames before the target */
+        if (is->viddec.pkt_serial == is->preroll_video_serial && frame->pts != AV_NOPTS_VALUE) {
+            double frame_duration = frame_rate.num && frame_rate.den ? av_q2d((AVRational){frame_rate.den, frame_rate.num}) : 0;
+            if (frame->pts * av_q2d(is->video_st->time_base) + frame_duration <= is->preroll_target) {
+                is->frame_drops_preroll++;
+                PLAYER_PROBE(frame_dropped, 2, av_rescale_q(frame->pts, is->video_st->time_base, AV_TIME_BASE_Q),
+                             is->viddec.pkt_serial);
+                av_frame_unref(frame);
+                continue;
+            }
+        }
+
+        /* benchmark without filters: queue the decoded picture as it is */
+        if (benchmark && !benchmark_filters) {
+            duration = (frame_rate.num && frame_rate.den ? av_q2d((AVRational){frame_rate.den, frame_rate.num}) : 0);
+            pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+            ret = queue_picture(is, frame, pts, duration, frame->pkt_pos, is->viddec.pkt_serial);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto the_end;
+            continue;
+        }
 
         if (   last_w != frame->width
                || last_h != frame->height
@@ -2910,14 +6178,18 @@ static int video_thread(void *arg)
             frame_rate = av_buffersink_get_frame_rate(filt_out);
         }
 
+        TRACE_BEGIN("buffersrc_add_frame", NAN, is->viddec.pkt_serial);
         ret = av_buffersrc_add_frame(filt_in, frame);
+        TRACE_END("buffersrc_add_frame", NAN, is->viddec.pkt_serial);
         if (ret < 0)
             goto the_end;
 
         while (ret >= 0) {
-            is->frame_last_returned_time = av_gettime_relative() / 1000000.0;
+            is->frame_last_returned_time = player_time() / 1000000.0;
 
+            TRACE_BEGIN("buffersink_get_frame", NAN, is->viddec.pkt_serial);
             ret = av_buffersink_get_frame_flags(filt_out, frame, 0);
+            TRACE_END("buffersink_get_frame", NAN, is->viddec.pkt_serial);
             if (ret < 0) {
                 if (ret == AVERROR_EOF)
                     is->viddec.finished = is->viddec.pkt_serial;
@@ -2925,7 +6197,7 @@ static int video_thread(void *arg)
                 break;
             }
 
-            is->frame_last_filter_delay = av_gettime_relative() / 1000000.0 - is->frame_last_returned_time;
+            is->frame_last_filter_delay = player_time() / 1000000.0 - is->frame_last_returned_time;
             if (fabs(is->frame_last_filter_delay) > AV_NOSYNC_THRESHOLD / 10.0)
                 is->frame_last_filter_delay = 0;
             tb = av_buffersink_get_time_base(filt_out);
@@ -2941,6 +6213,7 @@ static int video_thread(void *arg)
             goto the_end;
     }
     the_end:
+    benchmark_thread_end(is, BENCHMARK_THREAD_VIDEO);
     avfilter_graph_free(&graph);
     av_frame_free(&frame);
     return 0;
@@ -2953,9 +6226,11 @@ static int subtitle_thread(void *arg)
     int got_subtitle;
     double pts;
 
+    benchmark_thread_begin(is, BENCHMARK_THREAD_SUBTITLE);
+    trace_thread_name("subtitle decoder");
     for (;;) {
         if (!(sp = frame_queue_peek_writable(&is->subpq)))
-            return 0;
+            break;
 
         if ((got_subtitle = decoder_decode_frame(&is->subdec, NULL, &sp->sub)) < 0)
             break;
@@ -2977,28 +6252,10 @@ static int subtitle_thread(void *arg)
             avsubtitle_free(&sp->sub);
         }
     }
+    benchmark_thread_end(is, BENCHMARK_THREAD_SUBTITLE);
     return 0;
 }
 
-/* copy samples for viewing in editor window */
-static void update_sample_display(VideoState *is, short *samples, int samples_size)
-{
-    int size, len;
-
-    size = samples_size / sizeof(short);
-    while (size > 0) {
-        len = SAMPLE_ARRAY_SIZE - is->sample_array_index;
-        if (len > size)
-            len = size;
-        memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(short));
-        samples += len;
-        is->sample_array_index += len;
-        if (is->sample_array_index >= SAMPLE_ARRAY_SIZE)
-            is->sample_array_index = 0;
-        size -= len;
-    }
-}
-
 /* return the wanted number of samples to get better sync if sync_type is video
  * or external master clock */
 static int synchronize_audio(VideoState *is, int nb_samples)
@@ -3007,6 +6264,7 @@ static int synchronize_audio(VideoState *is, int nb_samples)
 
     /* if not master, then we try to remove or add samples to correct the clock */
     if (get_master_sync_type(is) != AV_SYNC_AUDIO_MASTER) {
+        SyncStats *stats = &is->sync_stats[get_master_sync_type(is)];
         double diff, avg_diff;
         int min_nb_samples, max_nb_samples;
 
@@ -3026,14 +6284,17 @@ static int synchronize_audio(VideoState *is, int nb_samples)
                     min_nb_samples = ((nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100));
                     max_nb_samples = ((nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100));
                     wanted_nb_samples = av_clip(wanted_nb_samples, min_nb_samples, max_nb_samples);
+                    stats->nb_audio_corrections++;
                 }
-                av_log(NULL, AV_LOG_TRACE, "diff=%f adiff=%f sample_diff=%d apts=%0.3f %f\n",
-                       diff, avg_diff, wanted_nb_samples - nb_samples,
-                       is->audio_clock, is->audio_diff_threshold);
+                HOT_LOG(AV_LOG_TRACE, "diff=%f adiff=%f sample_diff=%d apts=%0.3f %f\n",
+                        diff, avg_diff, wanted_nb_samples - nb_samples,
+                        is->audio_clock, is->audio_diff_threshold);
             }
         } else {
             /* too big difference : may be initial PTS errors, so
                reset A-V filter */
+            if (is->audio_diff_avg_count)
+                stats->nb_audio_resets++;
             is->audio_diff_avg_count = 0;
             is->audio_diff_cum       = 0;
         }
@@ -3049,25 +6310,61 @@ static int synchronize_audio(VideoState *is, int nb_samples)
  * stored in is->audio_buf, with size in bytes given by the return
  * value.
  */
+/* planar to packed copy, the stereo float and s16 cases take a SIMD path */
+static void interleave_samples(uint8_t *dst, uint8_t * const *src, int channels, int nb_samples, int bytes_per_sample)
+{
+    int i = 0, ch;
+
+#if HAVE_SSE2
+    if (channels == 2 && bytes_per_sample == 4) {
+        const float *l = (const float *)src[0], *r = (const float *)src[1];
+        float *out = (float *)dst;
+        for (; i + 4 <= nb_samples; i += 4) {
+            __m128 a = _mm_loadu_ps(l + i), b = _mm_loadu_ps(r + i);
+            _mm_storeu_ps(out + 2 * i,     _mm_unpacklo_ps(a, b));
+            _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(a, b));
+        }
+    } else if (channels == 2 && bytes_per_sample == 2) {
+        const int16_t *l = (const int16_t *)src[0], *r = (const int16_t *)src[1];
+        int16_t *out = (int16_t *)dst;
+        for (; i + 8 <= nb_samples; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(l + i)), b = _mm_loadu_si128((const __m128i *)(r + i));
+            _mm_storeu_si128((__m128i *)(out + 2 * i),     _mm_unpacklo_epi16(a, b));
+            _mm_storeu_si128((__m128i *)(out + 2 * i + 8), _mm_unpackhi_epi16(a, b));
+        }
+    }
+#endif
+    if (bytes_per_sample == 4) {
+        for (; i < nb_samples; i++)
+            for (ch = 0; ch < channels; ch++)
+                ((uint32_t *)dst)[i * channels + ch] = ((const uint32_t *)src[ch])[i];
+    } else {
+        for (; i < nb_samples; i++)
+            for (ch = 0; ch < channels; ch++)
+                ((uint16_t *)dst)[i * channels + ch] = ((const uint16_t *)src[ch])[i];
+    }
+}
+
 static int audio_decode_frame(VideoState *is)
 {
     int data_size, resampled_data_size;
     int64_t dec_channel_layout;
     av_unused double audio_clock0;
     int wanted_nb_samples;
+    int interleave;
     Frame *af;
 
     if (is->paused)
         return -1;
 
     do {
-        #if defined(_WIN32)
-            while (frame_queue_nb_remaining(&is->sampq) == 0) {
-                if ((av_gettime_relative() - audio_callback_time) > 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / 2)
-                    return -1;
-                av_usleep (1000);
-            }
-        #endif
+        /* the adaptive buffer has to see underruns, so the callback does not
+           block for longer than half the device buffer there */
+        while ((AUDIO_BOUNDED_WAIT || audio_adaptive) && !audio_backend_queue && frame_queue_nb_remaining(&is->sampq) == 0) {
+            if ((player_time() - audio_callback_time) > 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / 2)
+                return -1;
+            av_usleep (1000);
+        }
         if (!(af = frame_queue_peek_readable(&is->sampq)))
             return -1;
         frame_queue_next(&is->sampq);
@@ -3082,10 +6379,20 @@ static int audio_decode_frame(VideoState *is)
             af->frame->channel_layout : av_get_default_channel_layout(af->frame->channels);
     wanted_nb_samples = synchronize_audio(is, af->frame->nb_samples);
 
-    if (af->frame->format        != is->audio_src.fmt            ||
-        dec_channel_layout       != is->audio_src.channel_layout ||
-        af->frame->sample_rate   != is->audio_src.freq           ||
-        (wanted_nb_samples       != af->frame->nb_samples && !is->swr_ctx)) {
+    /* the filters hand over the planar variant of the device format when
+       nothing else differs, no resampler is needed to interleave it */
+    interleave = !is->swr_ctx                                                 &&
+                 af->frame->format      == av_get_planar_sample_fmt(is->audio_tgt.fmt) &&
+                 af->frame->format      != is->audio_tgt.fmt                  &&
+                 dec_channel_layout     == is->audio_tgt.channel_layout       &&
+                 af->frame->sample_rate == is->audio_tgt.freq                 &&
+                 wanted_nb_samples      == af->frame->nb_samples;
+
+    if (!interleave &&
+        (af->frame->format        != is->audio_src.fmt            ||
+         dec_channel_layout       != is->audio_src.channel_layout ||
+         af->frame->sample_rate   != is->audio_src.freq           ||
+         (wanted_nb_samples       != af->frame->nb_samples && !is->swr_ctx))) {
         swr_free(&is->swr_ctx);
         is->swr_ctx = swr_alloc_set_opts(NULL,
                                          is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
@@ -3105,7 +6412,19 @@ static int audio_decode_frame(VideoState *is)
         is->audio_src.fmt = af->frame->format;
     }
 
-    if (is->swr_ctx) {
+    if (interleave) {
+        if (data_size > is->audio_buf1_size) {
+            alloc_stats_free(ALLOC_SITE_AUDIO_BUF, is->audio_buf1_size);
+            av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, data_size);
+            alloc_stats_add(ALLOC_SITE_AUDIO_BUF, is->audio_buf1_size);
+        }
+        if (!is->audio_buf1)
+            return AVERROR(ENOMEM);
+        interleave_samples(is->audio_buf1, af->frame->extended_data, af->frame->channels,
+                           af->frame->nb_samples, av_get_bytes_per_sample(is->audio_tgt.fmt));
+        is->audio_buf = is->audio_buf1;
+        resampled_data_size = data_size;
+    } else if (is->swr_ctx) {
         const uint8_t **in = (const uint8_t **)af->frame->extended_data;
         uint8_t **out = &is->audio_buf1;
         int out_count = (int64_t)wanted_nb_samples * is->audio_tgt.freq / af->frame->sample_rate + 256;
@@ -3122,7 +6441,11 @@ static int audio_decode_frame(VideoState *is)
                 return -1;
             }
         }
-        av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
+        if (out_size > is->audio_buf1_size) {
+            alloc_stats_free(ALLOC_SITE_AUDIO_BUF, is->audio_buf1_size);
+            av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
+            alloc_stats_add(ALLOC_SITE_AUDIO_BUF, is->audio_buf1_size);
+        }
         if (!is->audio_buf1)
             return AVERROR(ENOMEM);
         len2 = swr_convert(is->swr_ctx, out, out_count, in, af->frame->nb_samples);
@@ -3142,6 +6465,35 @@ static int audio_decode_frame(VideoState *is)
         resampled_data_size = data_size;
     }
 
+    /* -speed: time stretch what goes to the device, the audio clock stays in
+       stream time and the callback accounts for the stretcher delay */
+    if (playback_speed != 1.0) {
+        if (!is->stretch && !(is->stretch = stretch_alloc(is->audio_tgt.channels, is->audio_tgt.freq)))
+            return AVERROR(ENOMEM);
+        if (is->stretch_serial != af->serial) {
+            stretch_reset(is->stretch);
+            is->stretch_serial = af->serial;
+        }
+        resampled_data_size = stretch_process(is->stretch, is->audio_buf, resampled_data_size / is->audio_tgt.frame_size,
+                                              is->audio_tgt.fmt, playback_speed, &is->audio_buf);
+        if (resampled_data_size < 0)
+            return resampled_data_size;
+        is->stretch_delay = stretch_delay(is->stretch);
+    } else {
+        /* play out what the stretcher still holds of this serial */
+        if (is->stretch && is->stretch_serial == af->serial) {
+            resampled_data_size = stretch_flush(is->stretch, is->audio_buf, resampled_data_size / is->audio_tgt.frame_size,
+                                                is->audio_tgt.fmt, &is->audio_buf);
+            if (resampled_data_size < 0)
+                return resampled_data_size;
+        }
+        is->stretch_serial = -1;
+        is->stretch_delay  = 0;
+    }
+
+    if (show_meter)
+        meter_process(&is->meter, is->audio_buf, resampled_data_size / is->audio_tgt.frame_size, &is->audio_tgt);
+
     audio_clock0 = is->audio_clock;
     /* update the audio clock with the pts */
     if (!isnan(af->pts))
@@ -3150,58 +6502,213 @@ static int audio_decode_frame(VideoState *is)
         is->audio_clock = NAN;
     is->audio_clock_serial = af->serial;
     static double last_clock;
-    printf("audio: delay=%0.3f clock=%0.3f clock0=%0.3f\n",
-           is->audio_clock - last_clock,
-           is->audio_clock, audio_clock0);
+    HOT_LOG(AV_LOG_DEBUG, "audio: delay=%0.3f clock=%0.3f clock0=%0.3f\n",
+            is->audio_clock - last_clock,
+            is->audio_clock, audio_clock0);
     last_clock = is->audio_clock;
     return resampled_data_size;
 }
 
+/* account how far the callback period strays from the duration of the requested buffer */
+static void sync_stats_add_callback(VideoState *is, int len)
+{
+    SyncStats *stats = &is->sync_stats[get_master_sync_type(is)];
+
+    if (stats->last_callback_time)
+        histogram_add(&stats->callback_jitter,
+                      FFABS(audio_callback_time - stats->last_callback_time - 1000000LL * len / is->audio_tgt.bytes_per_sec));
+    stats->last_callback_time = audio_callback_time;
+}
+
+/**
+ * Volume kernels of the audio output. They write src * volume / SDL_MIX_MAXVOLUME
+ * to dst. SDL_MIX_MAXVOLUME is 128, so s16 is scaled with an arithmetic shift
+ * by 7, which rounds negative samples down where SDL_MixAudioFormat() divides
+ * and rounds them toward zero: they may differ from SDL's by one LSB.
+ */
+typedef void (*GainFunc)(uint8_t *dst, const uint8_t *src, int nb_samples, int volume);
+
+typedef struct GainKernels {
+    const char *name;
+    int cpu_flag;                   // 0 if always available
+    GainFunc s16;
+    GainFunc flt;
+} GainKernels;
+
+static void gain_s16_c(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const int16_t *in = (const int16_t *)src;
+    int16_t *out = (int16_t *)dst;
+    int i;
+
+    for (i = 0; i < nb_samples; i++)
+        out[i] = in[i] * volume >> 7;
+}
+
+static void gain_flt_c(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const float *in = (const float *)src;
+    float *out = (float *)dst;
+    float g = volume / (float)SDL_MIX_MAXVOLUME;
+    int i;
+
+    for (i = 0; i < nb_samples; i++)
+        out[i] = av_clipf(in[i] * g, -1.0f, 1.0f);
+}
+
+#if HAVE_SSE2
+static void gain_s16_sse2(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const int16_t *in = (const int16_t *)src;
+    int16_t *out = (int16_t *)dst;
+    __m128i vol = _mm_set1_epi32(volume), zero = _mm_setzero_si128();
+    int i;
+
+    /* (sample, 0) pairs times (volume, 0) pairs give 32 bit products */
+    for (i = 0; i + 8 <= nb_samples; i += 8) {
+        __m128i x  = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(x, zero), vol);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(x, zero), vol);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_srai_epi32(lo, 7), _mm_srai_epi32(hi, 7)));
+    }
+    gain_s16_c((uint8_t *)(out + i), (const uint8_t *)(in + i), nb_samples - i, volume);
+}
+
+static void gain_flt_sse2(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const float *in = (const float *)src;
+    float *out = (float *)dst;
+    __m128 g = _mm_set1_ps(volume / (float)SDL_MIX_MAXVOLUME);
+    __m128 max = _mm_set1_ps(1.0f), min = _mm_set1_ps(-1.0f);
+    int i;
+
+    for (i = 0; i + 4 <= nb_samples; i += 4)
+        _mm_storeu_ps(out + i, _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), g), max), min));
+    gain_flt_c((uint8_t *)(out + i), (const uint8_t *)(in + i), nb_samples - i, volume);
+}
+#endif
+
+#if HAVE_AVX2_KERNELS
+/* unpack and pack work per 128 bit lane, so the sample order is kept */
+TARGET_AVX2 static void gain_s16_avx2(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const int16_t *in = (const int16_t *)src;
+    int16_t *out = (int16_t *)dst;
+    __m256i vol = _mm256_set1_epi32(volume), zero = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 16 <= nb_samples; i += 16) {
+        __m256i x  = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(x, zero), vol);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(x, zero), vol);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packs_epi32(_mm256_srai_epi32(lo, 7), _mm256_srai_epi32(hi, 7)));
+    }
+    gain_s16_sse2((uint8_t *)(out + i), (const uint8_t *)(in + i), nb_samples - i, volume);
+}
+
+TARGET_AVX2 static void gain_flt_avx2(uint8_t *dst, const uint8_t *src, int nb_samples, int volume)
+{
+    const float *in = (const float *)src;
+    float *out = (float *)dst;
+    __m256 g = _mm256_set1_ps(volume / (float)SDL_MIX_MAXVOLUME);
+    __m256 max = _mm256_set1_ps(1.0f), min = _mm256_set1_ps(-1.0f);
+    int i;
+
+    for (i = 0; i + 8 <= nb_samples; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), g), max), min));
+    gain_flt_sse2((uint8_t *)(out + i), (const uint8_t *)(in + i), nb_samples - i, volume);
+}
+#endif
+
+static const GainKernels gain_kernels[] = {
+    { "c",    0,                gain_s16_c,    gain_flt_c    },
+#if HAVE_SSE2
+    { "sse2", 0,                gain_s16_sse2, gain_flt_sse2 },
+#endif
+#if HAVE_AVX2_KERNELS
+    { "avx2", AV_CPU_FLAG_AVX2, gain_s16_avx2, gain_flt_avx2 },
+#endif
+};
+
+//
+static const GainKernels *gain = &gain_kernels[0];
+
+/* pick the widest kernels the cpu (and -cpuflags) allows */
+static void audio_gain_init(void)
+{
+    int cpu_flags = av_get_cpu_flags();
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(gain_kernels); i++)
+        if ((cpu_flags & gain_kernels[i].cpu_flag) == gain_kernels[i].cpu_flag)
+            gain = &gain_kernels[i];
+    av_log(NULL, AV_LOG_VERBOSE, "Audio gain kernels: %s\n", gain->name);
+}
+
+/* write len bytes of src at volume to dst, a NULL src is silence */
+static void audio_gain(uint8_t *dst, const uint8_t *src, int len, enum AVSampleFormat fmt, int volume)
+{
+    if (!src || volume <= 0)
+        memset(dst, 0, len);
+    else if (volume >= SDL_MIX_MAXVOLUME)
+        memcpy(dst, src, len);
+    else if (fmt == AV_SAMPLE_FMT_FLT)
+        gain->flt(dst, src, len / sizeof(float), volume);
+    else
+        gain->s16(dst, src, len / sizeof(int16_t), volume);
+}
+
 /* prepare a new audio buffer */
 static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
 {
     VideoState *is = opaque;
-    int audio_size, len1;
+    int64_t cpu_time = sync_report ? thread_cpu_time() : 0;
+    int audio_size, len1, left = len;
 
-    audio_callback_time = av_gettime_relative();
+    audio_callback_time = player_time();
+    sync_stats_add_callback(is, len);
+    PLAYER_PROBE(audio_callback_start, len, PROBE_US(is->audio_clock), is->audio_clock_serial);
+    TRACE_BEGIN("audio_callback", is->audio_clock, is->audio_clock_serial);
 
-    while (len > 0) {
+    while (left > 0) {
         if (is->audio_buf_index >= is->audio_buf_size) {
             audio_size = audio_decode_frame(is);
             if (audio_size < 0) {
-                /* if error, just output silence */
+                /* if error, just output silence, it only is an underrun while
+                   playing the current serial (not at startup or after a seek) */
+                if (!is->paused && is->auddec.finished != is->audioq.serial &&
+                    is->audio_clock_serial == is->audioq.serial)
+                    is->audio_underruns++;
                 is->audio_buf = NULL;
                 is->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / is->audio_tgt.frame_size * is->audio_tgt.frame_size;
             } else {
-                if (is->show_mode != SHOW_MODE_VIDEO)
-                    update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
                 is->audio_buf_size = audio_size;
             }
             is->audio_buf_index = 0;
         }
         len1 = is->audio_buf_size - is->audio_buf_index;
-        if (len1 > len)
-            len1 = len;
-        if (!is->muted && is->audio_buf && is->audio_volume == SDL_MIX_MAXVOLUME)
-            memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-        else {
-            memset(stream, 0, len1);
-            if (!is->muted && is->audio_buf)
-                SDL_MixAudioFormat(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, AUDIO_S16SYS, len1, is->audio_volume);
-        }
-        len -= len1;
+        if (len1 > left)
+            len1 = left;
+        audio_gain(stream, is->audio_buf ? is->audio_buf + is->audio_buf_index : NULL, len1,
+                   is->audio_tgt.fmt, is->muted ? 0 : is->audio_volume);
+        left -= len1;
         stream += len1;
         is->audio_buf_index += len1;
     }
     is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
     /* Let's assume the audio driver that is used by SDL has two periods. */
     if (!isnan(is->audio_clock)) {
-        set_clock_at(&is->audclk, is->audio_clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial, audio_callback_time / 1000000.0);
+        set_clock_at(&is->audclk, is->audio_clock - is->stretch_delay - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec * playback_speed, is->audio_clock_serial, audio_callback_time / 1000000.0);
         sync_clock_to_slave(&is->extclk, &is->audclk);
     }
+    TRACE_END("audio_callback", is->audio_clock, is->audio_clock_serial);
+    PLAYER_PROBE(audio_callback_end, len, PROBE_US(is->audio_clock), is->audio_clock_serial);
+    if (sync_report)
+        is->audio_output_cpu += thread_cpu_time() - cpu_time;
 }
 
-static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb_channels, int wanted_sample_rate, struct AudioParams *audio_hw_params)
+static int audio_open(void *opaque, enum AVSampleFormat wanted_fmt, int64_t wanted_channel_layout, int wanted_nb_channels, int wanted_sample_rate,
+                      int wanted_samples, struct AudioParams *audio_hw_params)
 {
     SDL_AudioSpec wanted_spec, spec;
     const char *env;
@@ -3227,10 +6734,11 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
     }
     while (next_sample_rate_idx && next_sample_rates[next_sample_rate_idx] >= wanted_spec.freq)
         next_sample_rate_idx--;
-    wanted_spec.format = AUDIO_S16SYS;
+    wanted_spec.format = wanted_fmt == AV_SAMPLE_FMT_FLT ? AUDIO_F32SYS : AUDIO_S16SYS;
     wanted_spec.silence = 0;
-    wanted_spec.samples = FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE, 2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
-    wanted_spec.callback = sdl_audio_callback;
+    wanted_spec.samples = wanted_samples ? wanted_samples :
+                          FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE, 2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
+    wanted_spec.callback = audio_backend_queue ? NULL : sdl_audio_callback;
     wanted_spec.userdata = opaque;
     while (!(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE))) {
         av_log(NULL, AV_LOG_WARNING, "SDL_OpenAudio (%d channels, %d Hz): %s\n",
@@ -3247,7 +6755,7 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
         }
         wanted_channel_layout = av_get_default_channel_layout(wanted_spec.channels);
     }
-    if (spec.format != AUDIO_S16SYS) {
+    if (spec.format != wanted_spec.format) {
         av_log(NULL, AV_LOG_ERROR,
                "SDL advised audio format %d is not supported!\n", spec.format);
         return -1;
@@ -3261,7 +6769,7 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
         }
     }
 
-    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+    audio_hw_params->fmt = wanted_fmt == AV_SAMPLE_FMT_FLT ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
     audio_hw_params->freq = spec.freq;
     audio_hw_params->channel_layout = wanted_channel_layout;
     audio_hw_params->channels =  spec.channels;
@@ -3274,6 +6782,119 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
     return spec.size;
 }
 
+/* reopen the device with another buffer size, the format must not change
+   since the filters and the resampler already convert to it */
+static int audio_reopen(VideoState *is, int samples)
+{
+    SDL_AudioSpec wanted_spec, spec;
+
+    wanted_spec.freq     = is->audio_tgt.freq;
+    wanted_spec.format   = is->audio_tgt.fmt == AV_SAMPLE_FMT_FLT ? AUDIO_F32SYS : AUDIO_S16SYS;
+    wanted_spec.channels = is->audio_tgt.channels;
+    wanted_spec.silence  = 0;
+    wanted_spec.samples  = samples;
+    wanted_spec.callback = audio_backend_queue ? NULL : sdl_audio_callback;
+    wanted_spec.userdata = is;
+
+    SDL_CloseAudioDevice(audio_dev);
+    if (!(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, 0))) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_OpenAudioDevice (%d samples): %s\n", samples, SDL_GetError());
+        wanted_spec.samples = is->audio_buf_samples;
+        if (!(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, 0)))
+            return -1;
+    }
+    is->audio_buf_samples    = spec.samples;
+    is->audio_hw_buf_size    = spec.size;
+    is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
+    SDL_PauseAudioDevice(audio_dev, 0);
+    return 0;
+}
+
+/* -audio_backend queue: the audio clock from what the device has not played yet,
+   with the same two driver periods the callback assumes */
+static void audio_push_update_clock(VideoState *is)
+{
+    is->audio_write_buf_size = SDL_GetQueuedAudioSize(audio_dev);
+    audio_callback_time = player_time();
+    if (!isnan(is->audio_clock)) {
+        set_clock_at(&is->audclk, is->audio_clock - is->stretch_delay - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec * playback_speed, is->audio_clock_serial, audio_callback_time / 1000000.0);
+        sync_clock_to_slave(&is->extclk, &is->audclk);
+    }
+}
+
+/* -audio_backend queue: resample off the real-time thread and push the samples
+   with SDL_QueueAudio(), keeping two device buffers queued */
+static int audio_push_thread(void *arg)
+{
+    VideoState *is = arg;
+    int64_t cpu_time = thread_cpu_time();
+    int last_serial = -1;
+
+    while (!is->audioq.abort_request) {
+        int64_t period = 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec;
+        int64_t now = thread_cpu_time();
+        int audio_size;
+        uint8_t *buf;
+
+        /* accounted as it goes, the report is printed before this thread is joined */
+        is->audio_output_cpu += now - cpu_time;
+        cpu_time = now;
+        audio_push_update_clock(is);
+        if (is->paused || is->audio_write_buf_size >= 2 * is->audio_hw_buf_size) {
+            av_usleep(FFMAX(period / 4, 1000));
+            continue;
+        }
+        if (!is->audio_write_buf_size && !is->paused && is->auddec.finished != is->audioq.serial &&
+            is->audio_clock_serial == is->audioq.serial)
+            is->audio_underruns++;
+
+        TRACE_BEGIN("audio_push", is->audio_clock, is->audio_clock_serial);
+        audio_size = audio_decode_frame(is);
+        if (audio_size < 0) {
+            TRACE_END("audio_push", is->audio_clock, is->audio_clock_serial);
+            continue;
+        }
+        /* whatever is still queued belongs to the serial before a seek */
+        if (is->audio_clock_serial != last_serial) {
+            SDL_ClearQueuedAudio(audio_dev);
+            last_serial = is->audio_clock_serial;
+        }
+        buf = is->audio_buf;
+        if (is->muted || is->audio_volume < SDL_MIX_MAXVOLUME) {
+            av_fast_malloc(&is->audio_push_buf, &is->audio_push_buf_size, audio_size);
+            if (!is->audio_push_buf)
+                break;
+            audio_gain(is->audio_push_buf, is->audio_buf, audio_size, is->audio_tgt.fmt, is->muted ? 0 : is->audio_volume);
+            buf = is->audio_push_buf;
+        }
+        if (SDL_QueueAudio(audio_dev, buf, audio_size) < 0)
+            av_log(NULL, AV_LOG_ERROR, "SDL_QueueAudio: %s\n", SDL_GetError());
+        TRACE_END("audio_push", is->audio_clock, is->audio_clock_serial);
+    }
+    is->audio_output_cpu += thread_cpu_time() - cpu_time;
+    return 0;
+}
+
+/* -audio_adaptive: double the device buffer after underruns */
+static void audio_adapt(VideoState *is)
+{
+    int64_t now = av_gettime_relative();
+
+    if (!audio_dev || is->audio_underruns == is->audio_underruns_handled ||
+        now - is->audio_adapt_time < AUDIO_ADAPTIVE_INTERVAL)
+        return;
+    is->audio_underruns_handled = is->audio_underruns;
+    if (is->audio_buf_samples >= AUDIO_ADAPTIVE_MAX_SAMPLES)
+        return;
+    if (audio_reopen(is, is->audio_buf_samples * 2) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not reopen the audio device, audio output stopped\n");
+        return;
+    }
+    is->audio_adapt_time = av_gettime_relative();
+    av_log(NULL, AV_LOG_INFO, "Audio buffer grown to %d samples (%0.1f ms) after %d underruns\n",
+           is->audio_buf_samples, 1000.0 * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec, is->audio_underruns);
+}
+
 
 /**
  * Check if the given stream matches a stream specifier.
@@ -3378,6 +6999,7 @@ static int stream_component_open(VideoState *is, int stream_index)
     AVDictionary *opts = NULL;
     AVDictionaryEntry *t = NULL;
     int sample_rate, nb_channels;
+    enum AVSampleFormat sample_fmt;
     int64_t channel_layout;
     int ret = 0;
     int stream_lowres = lowres;
@@ -3412,196 +7034,1620 @@ static int stream_component_open(VideoState *is, int stream_index)
         goto fail;
     }
 
-    avctx->codec_id = codec->id;
-    if (stream_lowres > codec->max_lowres) {
-        av_log(avctx, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n",
-               codec->max_lowres);
-        stream_lowres = codec->max_lowres;
-    }
-    avctx->lowres = stream_lowres;
+    avctx->codec_id = codec->id;
+    if (stream_lowres > codec->max_lowres) {
+        av_log(avctx, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n",
+               codec->max_lowres);
+        stream_lowres = codec->max_lowres;
+    }
+    avctx->lowres = stream_lowres;
+
+    if (fast)
+        avctx->flags2 |= AV_CODEC_FLAG2_FAST;
+
+    opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
+    if (!av_dict_get(opts, "threads", NULL, 0))
+        av_dict_set(&opts, "threads", "auto", 0);
+    if (stream_lowres)
+        av_dict_set_int(&opts, "lowres", stream_lowres, 0);
+    if (avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO)
+        av_dict_set(&opts, "refcounted_frames", "1", 0);
+    if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
+        goto fail;
+    }
+    if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
+        ret =  AVERROR_OPTION_NOT_FOUND;
+        goto fail;
+    }
+
+    is->eof = 0;
+    ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+    switch (avctx->codec_type) {
+        case AVMEDIA_TYPE_AUDIO:
+        {
+            AVFilterContext *sink;
+
+            is->audio_filter_src.freq           = avctx->sample_rate;
+            is->audio_filter_src.channels       = avctx->channels;
+            is->audio_filter_src.channel_layout = get_valid_channel_layout(avctx->channel_layout, avctx->channels);
+            is->audio_filter_src.fmt            = avctx->sample_fmt;
+            if ((ret = configure_audio_filters(is, afilters, 0)) < 0)
+                goto fail;
+            sink = is->out_audio_filter;
+            sample_rate    = av_buffersink_get_sample_rate(sink);
+            nb_channels    = av_buffersink_get_channels(sink);
+            channel_layout = av_buffersink_get_channel_layout(sink);
+            sample_fmt     = audio_device_fmt(av_buffersink_get_format(sink));
+        }
+
+            /* prepare audio output, benchmark mode only needs the format the filters convert to,
+               the null sink of the virtual clock uses the buffer size SDL would pick */
+            if (benchmark || virtual_clock) {
+                is->audio_tgt.fmt            = sample_fmt;
+                is->audio_tgt.freq           = sample_rate;
+                is->audio_tgt.channels       = nb_channels;
+                is->audio_tgt.channel_layout = channel_layout;
+                is->audio_tgt.frame_size     = av_samples_get_buffer_size(NULL, nb_channels, 1, sample_fmt, 1);
+                is->audio_tgt.bytes_per_sec  = av_samples_get_buffer_size(NULL, nb_channels, sample_rate, sample_fmt, 1);
+                ret = is->audio_tgt.frame_size;
+                if (virtual_clock)
+                    ret *= FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE, 2 << av_log2(sample_rate / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
+            } else if ((ret = audio_open(is, sample_fmt, channel_layout, nb_channels, sample_rate,
+                                         audio_adaptive ? AUDIO_ADAPTIVE_MIN_SAMPLES : 0, &is->audio_tgt)) < 0)
+                goto fail;
+            is->audio_hw_buf_size = ret;
+            is->audio_buf_samples = ret / is->audio_tgt.frame_size;
+            is->audio_adapt_time  = av_gettime_relative();
+            is->audio_src = is->audio_tgt;
+            is->audio_buf_size  = 0;
+            is->audio_buf_index = 0;
+
+            /* init averaging filter */
+            is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+            is->audio_diff_avg_count = 0;
+            /* since we do not have a precise anough audio FIFO fullness,
+               we correct audio sync only if larger than this threshold */
+            is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
+
+            is->audio_stream = stream_index;
+            is->audio_st = ic->streams[stream_index];
+
+            decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread);
+            if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
+                is->auddec.start_pts = is->audio_st->start_time;
+                is->auddec.start_pts_tb = is->audio_st->time_base;
+            }
+            if ((ret = decoder_start(&is->auddec, audio_thread, is)) < 0)
+                goto out;
+            if (audio_backend_queue && audio_dev &&
+                !(is->audio_push_tid = SDL_CreateThread(audio_push_thread, "audio_push", is))) {
+                av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+                ret = AVERROR(ENOMEM);
+                goto out;
+            }
+            SDL_PauseAudioDevice(audio_dev, 0);
+            break;
+        case AVMEDIA_TYPE_VIDEO:
+            is->video_stream = stream_index;
+            is->video_st = ic->streams[stream_index];
+            is->skip_frame      = avctx->skip_frame;
+            is->speed_last_kept = NAN;
+
+            decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread);
+            if ((ret = decoder_start(&is->viddec, video_thread, is)) < 0)
+                goto out;
+            is->queue_attachments_req = 1;
+            break;
+        case AVMEDIA_TYPE_SUBTITLE:
+            is->subtitle_stream = stream_index;
+            is->subtitle_st = ic->streams[stream_index];
+
+            decoder_init(&is->subdec, avctx, &is->subtitleq, is->continue_read_thread);
+            if ((ret = decoder_start(&is->subdec, subtitle_thread, is)) < 0)
+                goto out;
+            break;
+        default:
+            break;
+    }
+    goto out;
+
+    fail:
+        avcodec_free_context(&avctx);
+
+    out:
+        av_dict_free(&opts);
+
+    return ret;
+}
+
+static int decode_interrupt_cb(void *ctx)
+{
+    VideoState *is = ctx;
+    return is->abort_request;
+}
+
+static int stream_has_enough_packets(AVStream *st, int stream_id, PacketQueue *queue) {
+    return stream_id < 0 ||
+           queue->abort_request ||
+           (st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
+           queue->nb_packets > MIN_FRAMES && (!queue->duration || av_q2d(st->time_base) * queue->duration > 1.0);
+}
+
+static int is_realtime(AVFormatContext *s)
+{
+    if(   !strcmp(s->iformat->name, "rtp")
+          || !strcmp(s->iformat->name, "rtsp")
+          || !strcmp(s->iformat->name, "sdp")
+            )
+        return 1;
+
+    if(s->pb && (   !strncmp(s->url, "rtp:", 4)
+                    || !strncmp(s->url, "udp:", 4)
+    )
+            )
+        return 1;
+    return 0;
+}
+
+/**
+ * Setup AVCodecContext options for avformat_find_stream_info().
+ *
+ * Create an array of dictionaries, one dictionary for each stream
+ * contained in s.
+ * Each dictionary will contain the options from codec_opts which can
+ * be applied to the corresponding stream codec context.
+ *
+ * @return pointer to the created array of dictionaries, NULL if it
+ * cannot be created
+ */
+AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
+                                           AVDictionary *codec_opts);
+
+AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
+                                           AVDictionary *codec_opts)
+{
+    int i;
+    AVDictionary **opts;
+
+    if (!s->nb_streams)
+        return NULL;
+    opts = av_mallocz_array(s->nb_streams, sizeof(*opts));
+    if (!opts) {
+        av_log(NULL, AV_LOG_ERROR,
+               "Could not alloc memory for stream options.\n");
+        return NULL;
+    }
+    for (i = 0; i < s->nb_streams; i++)
+        opts[i] = filter_codec_opts(codec_opts, s->streams[i]->codecpar->codec_id,
+                                    s, s->streams[i], NULL);
+    return opts;
+}
+
+
+/**
+ * Print an error message to stderr, indicating filename and a human
+ * readable description of the error code err.
+ *
+ * If strerror_r() is not available the use of this function in a
+ * multithreaded application may be unsafe.
+ *
+ * @see av_strerror()
+ */
+void print_error(const char *filename, int err);
+
+void print_error(const char *filename, int err)
+{
+    char errbuf[128];
+    const char *errbuf_ptr = errbuf;
+
+    if (av_strerror(err, errbuf, sizeof(errbuf)) < 0)
+        errbuf_ptr = strerror(AVUNERROR(err));
+    av_log(NULL, AV_LOG_ERROR, "%s: %s\n", filename, errbuf_ptr);
+}
+
+
+static void prefetch_slot_free(PrefetchSlot *slot)
+{
+    MyAVPacketList *pkt, *pkt1;
+
+    for (pkt = slot->first_pkt; pkt; pkt = pkt1) {
+        pkt1 = pkt->next;
+        av_packet_unref(&pkt->pkt);
+        av_freep(&pkt);
+    }
+    av_frame_free(&slot->keyframe);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/* return 1 if a seek to target bounded by seek_min would land in the GOP of the slot */
+static int prefetch_slot_covers(Prefetcher *pf, PrefetchSlot *slot, int64_t target, int64_t seek_min)
+{
+    int64_t key, end;
+
+    if (!slot->valid)
+        return 0;
+    key = av_rescale_q(slot->key_pts, pf->time_base, AV_TIME_BASE_Q);
+    end = slot->end_pts == INT64_MAX ? INT64_MAX : av_rescale_q(slot->end_pts, pf->time_base, AV_TIME_BASE_Q);
+    return key >= seek_min && key <= target && target < end;
+}
+
+/* return 1 if every target has moved past the GOP of the slot */
+static int prefetch_slot_passed(Prefetcher *pf, PrefetchSlot *slot, const int64_t *targets, int nb_targets)
+{
+    int64_t end;
+    int j;
+
+    if (!slot->valid || slot->end_pts == INT64_MAX || !nb_targets)
+        return 0;
+    end = av_rescale_q(slot->end_pts, pf->time_base, AV_TIME_BASE_Q);
+    for (j = 0; j < nb_targets; j++)
+        if (targets[j] < end)
+            return 0;
+    return 1;
+}
+
+/* publish the position the arrow keys seek from, the prefetcher does not read the clocks itself */
+static void prefetch_update_position(VideoState *is)
+{
+    Prefetcher *pf = &is->prefetch;
+    double pos;
+    int seek_req;
+
+    SDL_LockMutex(is->seek_mutex);
+    seek_req = is->seek_req;
+    SDL_UnlockMutex(is->seek_mutex);
+    pos = seek_req ? NAN : get_master_clock(is);
+
+    SDL_LockMutex(pf->mutex);
+    pf->position = pos;
+    SDL_UnlockMutex(pf->mutex);
+}
+
+/* compute the targets the arrow keys would seek to from the published position, called with pf->mutex held */
+static int prefetch_targets(VideoState *is, int64_t *targets, int64_t *rels)
+{
+    double incrs[PREFETCH_NB_TARGETS] = { seek_interval ? -seek_interval : -10.0, seek_interval ? seek_interval : 10.0, -60.0, 60.0 };
+    double pos = is->prefetch.position;
+    int64_t start = is->ic->start_time != AV_NOPTS_VALUE ? is->ic->start_time : 0;
+    int i, nb = 0;
+
+    if (isnan(pos))
+        return 0;
+
+    for (i = 0; i < PREFETCH_NB_TARGETS; i++) {
+        int64_t target = (pos + incrs[i]) * AV_TIME_BASE;
+        if (target < start)
+            target = start;
+        if (is->ic->duration > 0 && target >= start + is->ic->duration)
+            continue;
+        targets[nb] = target;
+        rels[nb]    = incrs[i] * AV_TIME_BASE;
+        nb++;
+    }
+    return nb;
+}
+
+static int prefetch_interrupt_cb(void *ctx)
+{
+    Prefetcher *pf = ctx;
+    return pf->abort_request;
+}
+
+/* read the GOP a seek to target lands in, decoding its keyframe, using at most avail bytes */
+static int prefetch_fetch(Prefetcher *pf, AVFormatContext *ic, AVCodecContext *avctx, PrefetchSlot *slot,
+                          int64_t target, int64_t rel, int generation, size_t avail)
+{
+    int64_t seek_min = rel > 0 ? target - rel + 2 : INT64_MIN;
+    int64_t seek_max = rel < 0 ? target - rel - 2 : INT64_MAX;
+    AVPacket pkt1, *pkt = &pkt1;
+    int nb_packets = 0, got_keyframe = !prefetch_keyframe, ret;
+
+    if ((ret = avformat_seek_file(ic, -1, seek_min, target, seek_max, 0)) < 0)
+        return ret;
+    avcodec_flush_buffers(avctx);
+
+    if (!(slot->keyframe = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    slot->key_pts = AV_NOPTS_VALUE;
+    slot->end_pts = AV_NOPTS_VALUE;
+
+    while (nb_packets++ < PREFETCH_MAX_PACKETS) {
+        MyAVPacketList *node;
+        int64_t ts;
+
+        if (pf->abort_request || pf->generation != generation)
+            return AVERROR_EXIT;
+
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF) {
+            slot->end_pts = INT64_MAX;
+            break;
+        }
+        if (ret < 0)
+            return ret;
+
+        ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        if (pkt->stream_index != pf->stream_index ||
+            (slot->key_pts == AV_NOPTS_VALUE && (!(pkt->flags & AV_PKT_FLAG_KEY) || ts == AV_NOPTS_VALUE))) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (slot->key_pts == AV_NOPTS_VALUE) {
+            slot->key_pts = ts;
+        } else if (pkt->flags & AV_PKT_FLAG_KEY) {
+            slot->end_pts = ts;
+            av_packet_unref(pkt);
+            break;
+        }
+
+        /* the decoded keyframe counts against the budget too, skip it when it cannot fit */
+        if (!got_keyframe) {
+            int size = av_image_get_buffer_size(avctx->pix_fmt, avctx->width, avctx->height, 1);
+            if (size <= 0 || slot->mem + size > avail) {
+                got_keyframe = 1;
+            } else if (avcodec_send_packet(avctx, pkt) >= 0 &&
+                       avcodec_receive_frame(avctx, slot->keyframe) >= 0) {
+                size = av_image_get_buffer_size(slot->keyframe->format, slot->keyframe->width, slot->keyframe->height, 1);
+                slot->keyframe->pts = slot->keyframe->best_effort_timestamp;
+                slot->mem += FFMAX(size, 0);
+                got_keyframe = 1;
+            }
+        }
+
+        /* past the budget we only look for the end of the GOP, the queued prefix
+           must stay contiguous: the decoder reads everything after it from the file */
+        if (slot->truncated || slot->mem + pkt->size + sizeof(*node) > avail ||
+            !(node = av_malloc(sizeof(*node)))) {
+            slot->truncated = 1;
+            av_packet_unref(pkt);
+            continue;
+        }
+        node->pkt    = *pkt;
+        node->next   = NULL;
+        node->serial = 0;
+        if (slot->last_pkt)
+            slot->last_pkt->next = node;
+        else
+            slot->first_pkt = node;
+        slot->last_pkt = node;
+        slot->mem += pkt->size + sizeof(*node);
+    }
+
+    if (slot->key_pts == AV_NOPTS_VALUE || slot->end_pts == AV_NOPTS_VALUE || !slot->first_pkt)
+        return AVERROR(EAGAIN);
+    if (!got_keyframe)
+        av_frame_unref(slot->keyframe);
+    return 0;
+}
+
+/* this thread reads ahead the likely next seek targets with its own demuxer */
+static int prefetch_thread(void *arg)
+{
+    VideoState *is = arg;
+    Prefetcher *pf = &is->prefetch;
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    size_t budget = (size_t)prefetch_mem * 1024 * 1024, avail;
+    int i, ret;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    if (!(ic = avformat_alloc_context()))
+        goto fail;
+    ic->interrupt_callback.callback = prefetch_interrupt_cb;
+    ic->interrupt_callback.opaque = pf;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= pf->stream_index && avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= pf->stream_index)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == pf->stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    if (!(avctx = avcodec_alloc_context3(NULL)))
+        goto fail;
+    if (avcodec_parameters_to_context(avctx, pf->codecpar) < 0)
+        goto fail;
+    avctx->pkt_timebase = pf->time_base;
+    if (avcodec_open2(avctx, pf->codec, NULL) < 0)
+        goto fail;
+
+    SDL_LockMutex(pf->mutex);
+    while (!pf->abort_request) {
+        int64_t targets[PREFETCH_NB_TARGETS], rels[PREFETCH_NB_TARGETS];
+        int nb_targets = prefetch_targets(is, targets, rels);
+        int wanted = -1, free_slot = -1, spare = -1, generation, j;
+        PrefetchSlot fetched = { 0 };
+
+        /* drop the GOPs playback has passed, keep the others: a target may move
+           back into them. Then pick the first missing target. */
+        for (i = 0; i < PREFETCH_NB_SLOTS; i++) {
+            int used = 0;
+            for (j = 0; j < nb_targets; j++)
+                used |= prefetch_slot_covers(pf, &pf->slots[i], targets[j], rels[j] > 0 ? targets[j] - rels[j] + 2 : INT64_MIN);
+            if (prefetch_slot_passed(pf, &pf->slots[i], targets, nb_targets)) {
+                pf->mem -= pf->slots[i].mem;
+                prefetch_slot_free(&pf->slots[i]);
+            }
+            if (!pf->slots[i].valid && free_slot < 0)
+                free_slot = i;
+            else if (pf->slots[i].valid && !used && (spare < 0 || pf->slots[i].key_pts < pf->slots[spare].key_pts))
+                spare = i;
+        }
+        for (j = 0; j < nb_targets && wanted < 0; j++) {
+            int covered = 0;
+            for (i = 0; i < PREFETCH_NB_SLOTS; i++)
+                covered |= prefetch_slot_covers(pf, &pf->slots[i], targets[j], rels[j] > 0 ? targets[j] - rels[j] + 2 : INT64_MIN);
+            if (!covered)
+                wanted = j;
+        }
+        /* a missing target takes precedence over a GOP no target is in */
+        if (wanted >= 0 && spare >= 0 && (free_slot < 0 || pf->mem >= budget)) {
+            pf->mem -= pf->slots[spare].mem;
+            prefetch_slot_free(&pf->slots[spare]);
+            if (free_slot < 0)
+                free_slot = spare;
+        }
+        if (wanted < 0 || free_slot < 0 || pf->mem >= budget) {
+            SDL_CondWaitTimeout(pf->cond, pf->mutex, PREFETCH_POLL_INTERVAL);
+            continue;
+        }
+
+        generation = pf->generation;
+        avail      = budget - pf->mem;
+        SDL_UnlockMutex(pf->mutex);
+        ret = prefetch_fetch(pf, ic, avctx, &fetched, targets[wanted], rels[wanted], generation, avail);
+        SDL_LockMutex(pf->mutex);
+
+        if (ret >= 0 && generation == pf->generation) {
+            fetched.valid = 1;
+            pf->slots[free_slot] = fetched;
+            pf->mem += fetched.mem;
+        } else {
+            prefetch_slot_free(&fetched);
+            if (ret < 0 && ret != AVERROR_EXIT) {
+                av_log(NULL, AV_LOG_DEBUG, "prefetch of %0.3f failed: %s\n", targets[wanted] / (double)AV_TIME_BASE, av_err2str(ret));
+                SDL_CondWaitTimeout(pf->cond, pf->mutex, PREFETCH_RETRY_DELAY);
+            }
+        }
+    }
+    SDL_UnlockMutex(pf->mutex);
+
+    fail:
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    return 0;
+}
+
+/* start prefetching the arrow key seek targets of the current video stream */
+static void prefetch_start(VideoState *is)
+{
+    Prefetcher *pf = &is->prefetch;
+    const char *protocol = avio_find_protocol_name(is->filename);
+
+    /* a second connection to a network server costs more than it saves */
+    if (!protocol || strcmp(protocol, "file"))
+        return;
+    if (!(pf->mutex = SDL_CreateMutex()) || !(pf->cond = SDL_CreateCond()) ||
+        !(pf->codecpar = avcodec_parameters_alloc()) ||
+        avcodec_parameters_copy(pf->codecpar, is->video_st->codecpar) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not set up the seek prefetcher.\n");
+        return;
+    }
+    pf->stream_index = is->video_stream;
+    pf->time_base    = is->video_st->time_base;
+    pf->codec        = is->viddec.avctx->codec;
+    pf->position     = NAN;
+
+    pf->tid = SDL_CreateThread(prefetch_thread, "prefetch_thread", is);
+    if (!pf->tid)
+        av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s\n", SDL_GetError());
+}
+
+static void prefetch_stop(VideoState *is)
+{
+    Prefetcher *pf = &is->prefetch;
+    int i;
+
+    if (pf->tid) {
+        SDL_LockMutex(pf->mutex);
+        pf->abort_request = 1;
+        SDL_CondSignal(pf->cond);
+        SDL_UnlockMutex(pf->mutex);
+        SDL_WaitThread(pf->tid, NULL);
+        pf->tid = NULL;
+    }
+    for (i = 0; i < PREFETCH_NB_SLOTS; i++)
+        prefetch_slot_free(&pf->slots[i]);
+    pf->mem = 0;
+    avcodec_parameters_free(&pf->codecpar);
+    SDL_DestroyCond(pf->cond);
+    SDL_DestroyMutex(pf->mutex);
+    pf->cond  = NULL;
+    pf->mutex = NULL;
+}
+
+/**
+ * Called by read_thread after a seek flushed the queues. On a prefetch hit,
+ * queues the prefetched GOP and previews its keyframe, so the first picture
+ * does not wait for the demuxer. Returns 1 on hit.
+ */
+static int prefetch_on_seek(VideoState *is, int64_t target, int64_t seek_min)
+{
+    Prefetcher *pf = &is->prefetch;
+    MyAVPacketList *node;
+    int i, hit = 0;
+
+    if (!pf->tid)
+        return 0;
+
+    SDL_LockMutex(pf->mutex);
+    for (i = 0; i < PREFETCH_NB_SLOTS && !hit && pf->stream_index == is->video_stream; i++) {
+        PrefetchSlot *slot = &pf->slots[i];
+
+        if (!prefetch_slot_covers(pf, slot, target, seek_min))
+            continue;
+        for (node = slot->first_pkt; node; node = node->next) {
+            AVPacket copy = { 0 };
+            if (av_packet_ref(&copy, &node->pkt) < 0)
+                break;
+            if (copy.dts != AV_NOPTS_VALUE)
+                is->prefetch_skip_dts = copy.dts;
+            is->prefetch_skip_count++;
+            packet_queue_put(&is->videoq, &copy);
+        }
+        if (slot->keyframe->buf[0])
+            set_preview_frame(is, slot->keyframe, is->videoq.serial);
+        hit = 1;
+    }
+    if (hit)
+        pf->nb_hits++;
+    else
+        pf->nb_misses++;
+    /* the position moved: cancel what is in flight and recompute the targets */
+    pf->generation++;
+    SDL_CondSignal(pf->cond);
+    SDL_UnlockMutex(pf->mutex);
+    return hit;
+}
+
+#if HAVE_PROXY
+static int proxy_interrupt_cb(void *ctx)
+{
+    Proxy *px = ctx;
+    return px->abort_request;
+}
+
+/* append the decoded keyframes to the proxy file, return <0 on write error */
+static int proxy_write_frames(Proxy *px, AVCodecContext *avctx, AVFrame *frame, struct SwsContext **sws_ctx,
+                              int fd, uint8_t *record, int64_t *last_pts)
+{
+    uint8_t *data[4];
+    int linesize[4];
+    ssize_t written;
+
+    while (avcodec_receive_frame(avctx, frame) >= 0) {
+        int64_t pts = frame->best_effort_timestamp;
+
+        if (pts != AV_NOPTS_VALUE)
+            pts = av_rescale_q(pts, px->time_base, AV_TIME_BASE_Q);
+        /* when resuming, the demuxer lands before what is already there */
+        if (pts == AV_NOPTS_VALUE || (*last_pts != AV_NOPTS_VALUE && pts <= *last_pts)) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        *sws_ctx = sws_getCachedContext(*sws_ctx, frame->width, frame->height, frame->format,
+                                        px->width, px->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+        if (!*sws_ctx) {
+            av_frame_unref(frame);
+            return AVERROR(EINVAL);
+        }
+        memcpy(record, &pts, sizeof(pts));
+        av_image_fill_arrays(data, linesize, record + sizeof(pts), AV_PIX_FMT_YUV420P, px->width, px->height, 1);
+        sws_scale(*sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, data, linesize);
+        av_frame_unref(frame);
+
+        written = pwrite(fd, record, px->record_size, sizeof(ProxyHeader) + px->nb_records * px->record_size);
+        if (written != px->record_size)
+            return written < 0 ? AVERROR(errno) : AVERROR(EIO);   // a short write leaves errno alone
+        *last_pts = pts;
+        SDL_LockMutex(px->mutex);
+        px->nb_records++;
+        SDL_UnlockMutex(px->mutex);
+    }
+    return 0;
+}
+
+/**
+ * This thread converts the video stream to the proxy file: keyframes only,
+ * decoded at the lowest sufficient lowres level and scaled down. It resumes
+ * after the last complete record of an existing proxy of the same source.
+ */
+static int proxy_thread(void *arg)
+{
+    VideoState *is = arg;
+    Proxy *px = &is->proxy;
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    struct SwsContext *sws_ctx = NULL;
+    AVFrame *frame = NULL;
+    AVPacket pkt1, *pkt = &pkt1;
+    ProxyHeader hdr = { 0 }, old = { 0 };
+    uint8_t *record = NULL;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int64_t nb_records = 0;
+    struct stat st;
+    int fd = -1, i, ret, err;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    if (!(ic = avformat_alloc_context()))
+        goto fail;
+    ic->interrupt_callback.callback = proxy_interrupt_cb;
+    ic->interrupt_callback.opaque = px;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= px->stream_index && avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= px->stream_index)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == px->stream_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+
+    if (!(avctx = avcodec_alloc_context3(NULL)))
+        goto fail;
+    if (avcodec_parameters_to_context(avctx, px->codecpar) < 0)
+        goto fail;
+    avctx->pkt_timebase = px->time_base;
+    avctx->skip_frame   = AVDISCARD_NONKEY;
+    /* let the decoder do most of the downscaling when it can */
+    while (avctx->lowres < px->codec->max_lowres && (px->codecpar->height >> (avctx->lowres + 1)) >= px->height)
+        avctx->lowres++;
+    if (avcodec_open2(avctx, px->codec, NULL) < 0)
+        goto fail;
+
+    hdr.magic           = PROXY_MAGIC;
+    hdr.version         = PROXY_VERSION;
+    hdr.width           = px->width;
+    hdr.height          = px->height;
+    hdr.source_size     = avio_size(ic->pb);
+    hdr.source_duration = ic->duration;
+
+    if ((fd = open(px->path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &st) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not open the proxy file '%s': %s\n", px->path, strerror(errno));
+        goto fail;
+    }
+    if (pread(fd, &old, sizeof(old), 0) == sizeof(old) && old.magic == hdr.magic && old.version == hdr.version &&
+        old.width == hdr.width && old.height == hdr.height &&
+        old.source_size == hdr.source_size && old.source_duration == hdr.source_duration) {
+        nb_records = (st.st_size - (int64_t)sizeof(old)) / (int64_t)px->record_size;
+        if (nb_records > 0 && pread(fd, &last_pts, sizeof(last_pts), sizeof(old) + (nb_records - 1) * px->record_size) != sizeof(last_pts))
+            nb_records = 0;
+        if (nb_records <= 0)
+            last_pts = AV_NOPTS_VALUE;
+    }
+    /* drop a torn last record, or everything of a stale proxy */
+    if (ftruncate(fd, sizeof(hdr) + FFMAX(nb_records, 0) * px->record_size) < 0 ||
+        (nb_records <= 0 && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)))
+        goto fail;
+
+    SDL_LockMutex(px->mutex);
+    px->nb_records = FFMAX(nb_records, 0);
+    SDL_UnlockMutex(px->mutex);
+    if (nb_records > 0 && old.complete) {
+        av_log(NULL, AV_LOG_VERBOSE, "Using the complete proxy '%s'\n", px->path);
+        goto fail;
+    }
+    if (last_pts != AV_NOPTS_VALUE) {
+        av_log(NULL, AV_LOG_VERBOSE, "Resuming the proxy '%s' at %0.3f\n", px->path, last_pts / (double)AV_TIME_BASE);
+        avformat_seek_file(ic, -1, INT64_MIN, last_pts, last_pts, 0);
+    }
+
+    if (!(frame = av_frame_alloc()) || !(record = av_mallocz(px->record_size)))
+        goto fail;
+
+    while (!px->abort_request) {
+        /* leave the disk to playback while it is short of data */
+        if (!is->eof && !is->paused && is->videoq.nb_packets < MIN_FRAMES) {
+            SDL_Delay(PROXY_YIELD_DELAY);
+            continue;
+        }
+
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF) {
+            avcodec_send_packet(avctx, NULL);
+            if (proxy_write_frames(px, avctx, frame, &sws_ctx, fd, record, &last_pts) < 0)
+                break;
+            hdr.complete = 1;
+            if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+                av_log(NULL, AV_LOG_VERBOSE, "Proxy '%s' complete, %d pictures\n", px->path, px->nb_records);
+            break;
+        }
+        if (ret < 0)
+            break;
+        if (pkt->stream_index != px->stream_index || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        /* the decoder is full: drain it, then send the same packet again */
+        err = 0;
+        ret = avcodec_send_packet(avctx, pkt);
+        while (ret == AVERROR(EAGAIN) && (err = proxy_write_frames(px, avctx, frame, &sws_ctx, fd, record, &last_pts)) >= 0)
+            ret = avcodec_send_packet(avctx, pkt);
+        av_packet_unref(pkt);
+        if (err >= 0)
+            err = proxy_write_frames(px, avctx, frame, &sws_ctx, fd, record, &last_pts);
+        if (err < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Could not write the proxy '%s': %s\n", px->path, av_err2str(err));
+            break;
+        }
+    }
+
+    fail:
+    if (fd >= 0)
+        close(fd);
+    av_free(record);
+    av_frame_free(&frame);
+    sws_freeContext(sws_ctx);
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    return 0;
+}
+#endif
+
+/* start generating or resuming the proxy of a local file */
+static void proxy_start(VideoState *is)
+{
+#if HAVE_PROXY
+    Proxy *px = &is->proxy;
+    AVRational sar = av_guess_sample_aspect_ratio(is->ic, is->video_st, NULL);
+    AVCodecParameters *par = is->video_st->codecpar;
+    const char *protocol = avio_find_protocol_name(is->filename);
+
+    if (!protocol || strcmp(protocol, "file") || proxy_height <= 0 || par->height <= proxy_height)
+        return;
+    if (!sar.num || !sar.den)
+        sar = (AVRational){ 1, 1 };
+
+    px->height      = FFMAX(proxy_height & ~1, 2);
+    px->width       = FFMAX(av_rescale(px->height, (int64_t)par->width * sar.num, (int64_t)par->height * sar.den) & ~1, 2);
+    px->record_size = FFALIGN(sizeof(int64_t) + av_image_get_buffer_size(AV_PIX_FMT_YUV420P, px->width, px->height, 1), 64);
+    px->in_fd       = -1;
+    px->stream_index = is->video_stream;
+    px->time_base    = is->video_st->time_base;
+    px->codec        = is->viddec.avctx->codec;
+
+    if (!(px->path = av_asprintf("%s.proxy", is->filename)) ||
+        !(px->mutex = SDL_CreateMutex()) || !(px->codecpar = avcodec_parameters_alloc()) ||
+        avcodec_parameters_copy(px->codecpar, par) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not set up the proxy generator.\n");
+        return;
+    }
+
+    px->tid = SDL_CreateThread(proxy_thread, "proxy_thread", is);
+    if (!px->tid)
+        av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s\n", SDL_GetError());
+#endif
+}
+
+static void proxy_stop(VideoState *is)
+{
+#if HAVE_PROXY
+    Proxy *px = &is->proxy;
+
+    if (px->tid) {
+        px->abort_request = 1;
+        SDL_WaitThread(px->tid, NULL);
+        px->tid = NULL;
+    }
+    if (px->map)
+        munmap(px->map, px->map_size);
+    px->map      = NULL;
+    px->map_size = 0;
+    if (px->in_fd >= 0)
+        close(px->in_fd);
+    px->in_fd = -1;
+    av_freep(&px->path);
+    avcodec_parameters_free(&px->codecpar);
+    SDL_DestroyMutex(px->mutex);
+    px->mutex = NULL;
+#endif
+}
+
+#if HAVE_PEAKS
+/**
+ * Extremes and sum of squares of the samples of one level 0 bin.
+ */
+typedef struct PeakAccum
+{
+    float min;
+    float max;
+    double sum;
+    int count;
+} PeakAccum;
+
+static int peaks_interrupt_cb(void *ctx)
+{
+    Peaks *pk = ctx;
+    return pk->abort_request;
+}
+
+/* add the samples of a frame to the bins of the chunk it overlaps, samples
+   outside of the chunk belong to another one and are left out */
+static void peaks_add_frame(Peaks *pk, PeakAccum *acc, int chunk, const AVFrame *frame, float **data)
+{
+    int64_t first_bin = (int64_t)chunk * PEAKS_CHUNK_BINS;
+    int64_t pts = frame->best_effort_timestamp, s0;
+    int rate = frame->sample_rate, i = 0, ch, j;
+
+    if (pts == AV_NOPTS_VALUE || rate <= 0)
+        return;
+    pts = av_rescale_q(pts, pk->time_base, AV_TIME_BASE_Q);
+    if (pk->start_time != AV_NOPTS_VALUE)
+        pts -= pk->start_time;
+    s0 = av_rescale(pts, rate, AV_TIME_BASE);
+    if (s0 < 0)
+        i = FFMIN(-s0, frame->nb_samples);
+
+    while (i < frame->nb_samples) {
+        int64_t bin  = (s0 + i) * PEAKS_RATE / rate;
+        int64_t next = ((bin + 1) * rate + PEAKS_RATE - 1) / PEAKS_RATE;
+        int n = FFMIN(frame->nb_samples - i, next - (s0 + i));
+
+        if (bin >= first_bin && bin < first_bin + PEAKS_CHUNK_BINS) {
+            PeakAccum *a = &acc[bin - first_bin];
+            float lo = a->min, hi = a->max, sum = 0.0f;
+
+            for (ch = 0; ch < frame->channels; ch++) {
+                const float *p = data[ch] + i;
+                for (j = 0; j < n; j++) {
+                    lo   = FFMIN(lo, p[j]);
+                    hi   = FFMAX(hi, p[j]);
+                    sum += p[j] * p[j];
+                }
+            }
+            a->min    = lo;
+            a->max    = hi;
+            a->sum   += sum;
+            a->count += n * frame->channels;
+        }
+        i += n;
+    }
+}
+
+/* store the bins of a chunk at every level and mark it built */
+static void peaks_write_chunk(Peaks *pk, PeakAccum *acc, int chunk)
+{
+    PeakBin *bins = pk->levels[0] + (size_t)chunk * PEAKS_CHUNK_BINS;
+    int level, i, j;
+
+    for (i = 0; i < PEAKS_CHUNK_BINS; i++) {
+        PeakAccum *a = &acc[i];
+
+        bins[i].min = a->count ? av_clip_int16(lrintf(a->min * 32767)) : 0;
+        bins[i].max = a->count ? av_clip_int16(lrintf(a->max * 32767)) : 0;
+        bins[i].rms = a->count ? av_clip_uint16(lrint(sqrt(a->sum / a->count) * 32767)) : 0;
+    }
+    for (level = 1; level < PEAKS_NB_LEVELS; level++) {
+        int nb = PEAKS_CHUNK_BINS >> (2 * level);
+        const PeakBin *src = pk->levels[level - 1] + (size_t)chunk * nb * PEAKS_LEVEL_FACTOR;
+        PeakBin *dst = pk->levels[level] + (size_t)chunk * nb;
+
+        for (i = 0; i < nb; i++) {
+            int lo = 0, hi = 0;
+            double sum = 0;
+
+            for (j = 0; j < PEAKS_LEVEL_FACTOR; j++, src++) {
+                lo   = FFMIN(lo, src->min);
+                hi   = FFMAX(hi, src->max);
+                sum += (double)src->rms * src->rms;
+            }
+            dst[i].min = lo;
+            dst[i].max = hi;
+            dst[i].rms = lrint(sqrt(sum / PEAKS_LEVEL_FACTOR));
+        }
+    }
+    SDL_MemoryBarrierRelease();
+    pk->done[chunk] = 1;
+
+    if (SDL_AtomicAdd(&pk->nb_done, 1) + 1 == pk->nb_chunks) {
+        ((PeaksHeader *)pk->map)->complete = 1;
+        msync(pk->map, pk->map_size, MS_ASYNC);
+        av_log(NULL, AV_LOG_VERBOSE, "Waveform overview '%s' complete\n", pk->path);
+    }
+}
+
+/**
+ * A waveform overview worker: claims the chunks not built yet one after the
+ * other, seeks its own demuxer to each and decodes the audio packets up to
+ * the first one of the next chunk.
+ */
+static int peaks_thread(void *arg)
+{
+    VideoState *is = arg;
+    Peaks *pk = &is->peaks;
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    SwrContext *swr_ctx = NULL;
+    AVFrame *frame = NULL;
+    AVPacket pkt1, *pkt = &pkt1;
+    PeakAccum *acc = NULL;
+    uint8_t **planes = NULL;
+    int planes_samples = 0;
+    int swr_fmt = AV_SAMPLE_FMT_NONE, swr_rate = 0;
+    int64_t swr_layout = 0;
+    int chunk, i, ret;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    if (!(ic = avformat_alloc_context()))
+        goto fail;
+    ic->interrupt_callback.callback = peaks_interrupt_cb;
+    ic->interrupt_callback.opaque = pk;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= pk->stream_index && avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= pk->stream_index)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == pk->stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    if (!(avctx = avcodec_alloc_context3(NULL)))
+        goto fail;
+    if (avcodec_parameters_to_context(avctx, pk->codecpar) < 0)
+        goto fail;
+    avctx->pkt_timebase = pk->time_base;
+    avctx->thread_count = 1;
+    if (avcodec_open2(avctx, pk->codec, NULL) < 0)
+        goto fail;
+
+    if (!(frame = av_frame_alloc()) || !(acc = av_malloc_array(PEAKS_CHUNK_BINS, sizeof(*acc))))
+        goto fail;
+
+    while (!pk->abort_request && (chunk = SDL_AtomicAdd(&pk->next_chunk, 1)) < pk->nb_chunks) {
+        int64_t start = av_rescale((int64_t)chunk * PEAKS_CHUNK_BINS, AV_TIME_BASE, PEAKS_RATE);
+        int64_t end   = av_rescale((int64_t)(chunk + 1) * PEAKS_CHUNK_BINS, AV_TIME_BASE, PEAKS_RATE);
+        int eof = 0, pending = 0;   // pending: pkt is read but not taken by the decoder yet
+
+        if (pk->done[chunk])
+            continue;
+        for (i = 0; i < PEAKS_CHUNK_BINS; i++)
+            acc[i] = (PeakAccum){ 0.0f, 0.0f, 0.0, 0 };
+        if (pk->start_time != AV_NOPTS_VALUE) {
+            start += pk->start_time;
+            end   += pk->start_time;
+        }
+        end = av_rescale_q(end, AV_TIME_BASE_Q, pk->time_base);
+        if (chunk && avformat_seek_file(ic, -1, INT64_MIN, start, start, 0) < 0)
+            continue;
+        avcodec_flush_buffers(avctx);
+
+        while (!pk->abort_request) {
+            /* leave the disk to playback while it is short of data */
+            if (!is->eof && !is->paused && is->audioq.nb_packets < MIN_FRAMES) {
+                SDL_Delay(PROXY_YIELD_DELAY);
+                continue;
+            }
+            if (!eof && !pending) {
+                ret = av_read_frame(ic, pkt);
+                if (ret < 0) {
+                    eof = 1;
+                } else if (pkt->stream_index != pk->stream_index) {
+                    av_packet_unref(pkt);
+                    continue;
+                } else if (pkt->pts != AV_NOPTS_VALUE && pkt->pts >= end) {
+                    /* the chunk ends at the first packet of the next one */
+                    av_packet_unref(pkt);
+                    eof = 1;
+                } else {
+                    pending = 1;
+                }
+            }
+            ret = avcodec_send_packet(avctx, eof ? NULL : pkt);
+            /* on EAGAIN keep the packet, drain the decoder and send it again */
+            if (ret != AVERROR(EAGAIN) && pending) {
+                av_packet_unref(pkt);
+                pending = 0;
+            }
+            if (ret < 0 && ret != AVERROR(EAGAIN) && !eof)
+                continue;
+
+            while (avcodec_receive_frame(avctx, frame) >= 0) {
+                float **data = (float **)frame->extended_data;
+
+                if (frame->format != AV_SAMPLE_FMT_FLTP) {
+                    int64_t layout = frame->channel_layout && frame->channels == av_get_channel_layout_nb_channels(frame->channel_layout) ?
+                                     frame->channel_layout : av_get_default_channel_layout(frame->channels);
+
+                    if (frame->format != swr_fmt || frame->sample_rate != swr_rate || layout != swr_layout) {
+                        swr_fmt = AV_SAMPLE_FMT_NONE;
+                        swr_ctx = swr_alloc_set_opts(swr_ctx, layout, AV_SAMPLE_FMT_FLTP, frame->sample_rate,
+                                                     layout, frame->format, frame->sample_rate, 0, NULL);
+                        if (!swr_ctx || swr_init(swr_ctx) < 0) {
+                            av_frame_unref(frame);
+                            continue;
+                        }
+                        swr_fmt    = frame->format;
+                        swr_rate   = frame->sample_rate;
+                        swr_layout = layout;
+                    }
+                    if (frame->nb_samples > planes_samples) {
+                        if (planes)
+                            av_freep(&planes[0]);
+                        av_freep(&planes);
+                        planes_samples = 0;
+                        if (av_samples_alloc_array_and_samples(&planes, NULL, frame->channels, frame->nb_samples, AV_SAMPLE_FMT_FLTP, 0) < 0) {
+                            av_frame_unref(frame);
+                            continue;
+                        }
+                        planes_samples = frame->nb_samples;
+                    }
+                    if (swr_convert(swr_ctx, planes, frame->nb_samples, (const uint8_t **)frame->extended_data, frame->nb_samples) < 0) {
+                        av_frame_unref(frame);
+                        continue;
+                    }
+                    data = (float **)planes;
+                }
+                peaks_add_frame(pk, acc, chunk, frame, data);
+                av_frame_unref(frame);
+            }
+            if (eof)
+                break;
+        }
+        if (pending)
+            av_packet_unref(pkt);
+        if (!pk->abort_request)
+            peaks_write_chunk(pk, acc, chunk);
+    }
+
+    fail:
+    if (planes)
+        av_freep(&planes[0]);
+    av_freep(&planes);
+    av_free(acc);
+    av_frame_free(&frame);
+    swr_free(&swr_ctx);
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    return 0;
+}
+#endif
+
+/* map the waveform overview of a local file, and build what it still lacks */
+static void peaks_start(VideoState *is)
+{
+#if HAVE_PEAKS
+    Peaks *pk = &is->peaks;
+    const char *protocol = avio_find_protocol_name(is->filename);
+    PeaksHeader hdr = { 0 }, old = { 0 };
+    size_t offset;
+    int64_t nb_bins;
+    int fd = -1, level, i, nb_done = 0;
+
+    if (!protocol || strcmp(protocol, "file") || is->ic->duration <= 0)
+        return;
+
+    pk->stream_index = is->audio_stream;
+    pk->time_base    = is->audio_st->time_base;
+    pk->start_time   = is->ic->start_time;
+    pk->duration     = is->ic->duration;
+    pk->codec        = is->auddec.avctx->codec;
+    nb_bins          = av_rescale_rnd(pk->duration, PEAKS_RATE, AV_TIME_BASE, AV_ROUND_UP);
+    if (nb_bins > INT_MAX / 2)
+        return;
+    pk->nb_chunks    = (nb_bins + PEAKS_CHUNK_BINS - 1) / PEAKS_CHUNK_BINS;
+
+    hdr.magic           = PEAKS_MAGIC;
+    hdr.version         = PEAKS_VERSION;
+    hdr.stream_index    = pk->stream_index;
+    hdr.nb_chunks       = pk->nb_chunks;
+    hdr.source_size     = avio_size(is->ic->pb);
+    hdr.source_duration = pk->duration;
+
+    offset = sizeof(hdr);
+    for (level = 0; level < PEAKS_NB_LEVELS; level++) {
+        pk->nb_bins[level] = (nb_bins + (1 << (2 * level)) - 1) >> (2 * level);
+        offset += (size_t)pk->nb_chunks * (PEAKS_CHUNK_BINS >> (2 * level)) * sizeof(PeakBin);
+    }
+    pk->map_size = offset + pk->nb_chunks;
+
+    if (!(pk->path = av_asprintf("%s.peaks", is->filename)) ||
+        !(pk->codecpar = avcodec_parameters_alloc()) ||
+        avcodec_parameters_copy(pk->codecpar, is->audio_st->codecpar) < 0)
+        goto fail;
+    if ((fd = open(pk->path, O_RDWR | O_CREAT, 0644)) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not open the waveform overview '%s': %s\n", pk->path, strerror(errno));
+        goto fail;
+    }
+    /* start over when the file does not belong to this source */
+    if (pread(fd, &old, sizeof(old), 0) != sizeof(old) || old.magic != hdr.magic || old.version != hdr.version ||
+        old.stream_index != hdr.stream_index || old.nb_chunks != hdr.nb_chunks ||
+        old.source_size != hdr.source_size || old.source_duration != hdr.source_duration) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, pk->map_size) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto fail;
+    } else if (ftruncate(fd, pk->map_size) < 0) {
+        goto fail;
+    }
+    pk->map = mmap(NULL, pk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    fd = -1;
+    if (pk->map == MAP_FAILED) {
+        pk->map = NULL;
+        goto fail;
+    }
+
+    offset = sizeof(hdr);
+    for (level = 0; level < PEAKS_NB_LEVELS; level++) {
+        pk->levels[level] = (PeakBin *)(pk->map + offset);
+        offset += (size_t)pk->nb_chunks * (PEAKS_CHUNK_BINS >> (2 * level)) * sizeof(PeakBin);
+    }
+    for (i = 0; i < pk->nb_chunks; i++)
+        nb_done += pk->map[offset + i];
+    SDL_AtomicSet(&pk->nb_done, nb_done);
+    SDL_AtomicSet(&pk->next_chunk, 0);
+    /* the display only looks at the overview once done is set */
+    SDL_MemoryBarrierRelease();
+    pk->done = pk->map + offset;
+    if (nb_done == pk->nb_chunks) {
+        av_log(NULL, AV_LOG_VERBOSE, "Using the complete waveform overview '%s'\n", pk->path);
+        return;
+    }
+
+    /* keep cores for playback */
+    pk->nb_workers = av_clip(av_cpu_count() / 2, 1, FFMIN(PEAKS_MAX_WORKERS, pk->nb_chunks - nb_done));
+    for (i = 0; i < pk->nb_workers; i++)
+        if (!(pk->tids[i] = SDL_CreateThread(peaks_thread, "peaks_thread", is)))
+            av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s\n", SDL_GetError());
+    av_log(NULL, AV_LOG_VERBOSE, "Building the waveform overview '%s', %d of %d chunks with %d threads\n",
+           pk->path, pk->nb_chunks - nb_done, pk->nb_chunks, pk->nb_workers);
+    return;
+
+    fail:
+    if (fd >= 0)
+        close(fd);
+    av_log(NULL, AV_LOG_WARNING, "Could not set up the waveform overview.\n");
+#endif
+}
+
+static void peaks_stop(VideoState *is)
+{
+#if HAVE_PEAKS
+    Peaks *pk = &is->peaks;
+    int i;
+
+    pk->abort_request = 1;
+    for (i = 0; i < pk->nb_workers; i++)
+        if (pk->tids[i])
+            SDL_WaitThread(pk->tids[i], NULL);
+    pk->nb_workers = 0;
+    pk->done = NULL;
+    if (pk->map)
+        munmap(pk->map, pk->map_size);
+    pk->map      = NULL;
+    pk->map_size = 0;
+    av_freep(&pk->path);
+    avcodec_parameters_free(&pk->codecpar);
+#endif
+}
+
+static void reverse_chunk_free(ReverseChunk **pchunk)
+{
+    ReverseChunk *c = *pchunk;
+    int i;
+
+    if (!c)
+        return;
+    for (i = 0; i < c->nb_frames; i++)
+        av_frame_free(&c->frames[i]);
+    av_freep(&c->frames);
+    av_freep(pchunk);
+}
+
+/* keep the decoded frame in pts order, dropping the earliest ones past max_mem */
+static int reverse_chunk_add(ReverseChunk *c, AVFrame *frame, AVRational tb, size_t max_mem)
+{
+    int64_t pts = frame->best_effort_timestamp;
+    AVFrame *f, **frames;
+    int i, size;
+
+    if (pts != AV_NOPTS_VALUE)
+        pts = av_rescale_q(pts, tb, AV_TIME_BASE_Q);
+    /* leading pictures of an open GOP reference the previous one */
+    if (pts == AV_NOPTS_VALUE || pts >= c->end_pts || (c->key_pts != AV_NOPTS_VALUE && pts < c->key_pts)) {
+        av_frame_unref(frame);
+        return 0;
+    }
+
+    if (!(frames = av_realloc_array(c->frames, c->nb_frames + 1, sizeof(*frames))))
+        return AVERROR(ENOMEM);
+    c->frames = frames;
+    if (!(f = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(f, frame);
+    f->pts = pts;
+    for (i = c->nb_frames; i > 0 && frames[i - 1]->pts > pts; i--)
+        frames[i] = frames[i - 1];
+    frames[i] = f;
+    c->nb_frames++;
+    size = av_image_get_buffer_size(f->format, f->width, f->height, 1);
+    c->mem += FFMAX(size, 0) + sizeof(*f);
+
+    while (c->mem > max_mem && c->nb_frames > 1) {
+        size = av_image_get_buffer_size(frames[0]->format, frames[0]->width, frames[0]->height, 1);
+        c->mem -= FFMAX(size, 0) + sizeof(*f);
+        av_frame_free(&frames[0]);
+        memmove(frames, frames + 1, --c->nb_frames * sizeof(*frames));
+    }
+    c->start_pts = frames[0]->pts;
+    return 0;
+}
+
+/* the cached chunk holding the pictures at ts, if any */
+static ReverseChunk *reverse_find_chunk(Reverser *rv, int64_t ts)
+{
+    ReverseChunk *c;
+
+    for (c = rv->chunks; c; c = c->next)
+        if (c->start_pts <= ts && ts < c->end_pts)
+            return c;
+    return NULL;
+}
 
-    if (fast)
-        avctx->flags2 |= AV_CODEC_FLAG2_FAST;
+/* bytes of the cached chunks already played backwards, dropped first when room is needed */
+static size_t reverse_played_mem(Reverser *rv)
+{
+    ReverseChunk *c;
+    size_t mem = 0;
 
-    opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
-    if (!av_dict_get(opts, "threads", NULL, 0))
-        av_dict_set(&opts, "threads", "auto", 0);
-    if (stream_lowres)
-        av_dict_set_int(&opts, "lowres", stream_lowres, 0);
-    if (avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO)
-        av_dict_set(&opts, "refcounted_frames", "1", 0);
-    if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
-        goto fail;
-    }
-    if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
-        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
-        ret =  AVERROR_OPTION_NOT_FOUND;
+    for (c = rv->chunks; c; c = c->next)
+        if (c->start_pts >= rv->pos)
+            mem += c->mem;
+    return mem;
+}
+
+static int reverse_interrupt_cb(void *ctx)
+{
+    Reverser *rv = ctx;
+    return rv->abort_request;
+}
+
+/**
+ * Decode the pictures before end: seek to the keyframe preceding it and
+ * decode up to the next keyframe. Sets *pchunk to NULL at the beginning of
+ * the stream.
+ */
+static int reverse_fetch(Reverser *rv, AVFormatContext *ic, AVCodecContext *avctx, int64_t end,
+                         int generation, size_t max_mem, ReverseChunk **pchunk)
+{
+    AVPacket pkt1, *pkt = &pkt1;
+    AVFrame *frame = NULL;
+    ReverseChunk *c = NULL;
+    int got_key = 0, eof = 0, ret;
+
+    *pchunk = NULL;
+    if ((ret = avformat_seek_file(ic, -1, INT64_MIN, end - 1, end - 1, 0)) < 0)
+        return ret;
+    avcodec_flush_buffers(avctx);
+
+    if (!(c = av_mallocz(sizeof(*c))) || !(frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
         goto fail;
     }
+    c->end_pts = end;
+    c->key_pts = AV_NOPTS_VALUE;
 
-    is->eof = 0;
-    ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
-    switch (avctx->codec_type) {
-        case AVMEDIA_TYPE_AUDIO:
-        {
-            AVFilterContext *sink;
+    while (!eof) {
+        if (rv->abort_request || rv->generation != generation) {
+            ret = AVERROR_EXIT;
+            goto fail;
+        }
 
-            is->audio_filter_src.freq           = avctx->sample_rate;
-            is->audio_filter_src.channels       = avctx->channels;
-            is->audio_filter_src.channel_layout = get_valid_channel_layout(avctx->channel_layout, avctx->channels);
-            is->audio_filter_src.fmt            = avctx->sample_fmt;
-            if ((ret = configure_audio_filters(is, afilters, 0)) < 0)
-                goto fail;
-            sink = is->out_audio_filter;
-            sample_rate    = av_buffersink_get_sample_rate(sink);
-            nb_channels    = av_buffersink_get_channels(sink);
-            channel_layout = av_buffersink_get_channel_layout(sink);
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF) {
+            eof = 1;
+        } else if (ret < 0) {
+            goto fail;
+        } else if (pkt->stream_index != rv->stream_index || (!got_key && !(pkt->flags & AV_PKT_FLAG_KEY))) {
+            av_packet_unref(pkt);
+            continue;
+        } else if (got_key && (pkt->flags & AV_PKT_FLAG_KEY)) {
+            /* the next GOP starts: drain the decoder */
+            av_packet_unref(pkt);
+            eof = 1;
+        } else {
+            if (!got_key && pkt->pts != AV_NOPTS_VALUE)
+                c->key_pts = av_rescale_q(pkt->pts, rv->time_base, AV_TIME_BASE_Q);
+            got_key = 1;
+            avcodec_send_packet(avctx, pkt);
+            av_packet_unref(pkt);
         }
+        if (eof)
+            avcodec_send_packet(avctx, NULL);
 
-            /* prepare audio output */
-            if ((ret = audio_open(is, channel_layout, nb_channels, sample_rate, &is->audio_tgt)) < 0)
+        while (avcodec_receive_frame(avctx, frame) >= 0)
+            if ((ret = reverse_chunk_add(c, frame, rv->time_base, max_mem)) < 0)
                 goto fail;
-            is->audio_hw_buf_size = ret;
-            is->audio_src = is->audio_tgt;
-            is->audio_buf_size  = 0;
-            is->audio_buf_index = 0;
+    }
 
-            /* init averaging filter */
-            is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
-            is->audio_diff_avg_count = 0;
-            /* since we do not have a precise anough audio FIFO fullness,
-               we correct audio sync only if larger than this threshold */
-            is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
+    av_frame_free(&frame);
+    if (c->nb_frames)
+        *pchunk = c;
+    else
+        reverse_chunk_free(&c);
+    return 0;
 
-            is->audio_stream = stream_index;
-            is->audio_st = ic->streams[stream_index];
+    fail:
+    av_frame_free(&frame);
+    reverse_chunk_free(&c);
+    return ret;
+}
 
-            decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread);
-            if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
-                is->auddec.start_pts = is->audio_st->start_time;
-                is->auddec.start_pts_tb = is->audio_st->time_base;
+/* this thread decodes the GOPs before the displayed picture, the next one ahead */
+static int reverse_thread(void *arg)
+{
+    VideoState *is = arg;
+    Reverser *rv = &is->reverse;
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    size_t budget = (size_t)reverse_mem * 1024 * 1024;
+    int i;
+
+    if (!(ic = avformat_alloc_context()))
+        goto fail;
+    ic->interrupt_callback.callback = reverse_interrupt_cb;
+    ic->interrupt_callback.opaque = rv;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= rv->stream_index && avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+    if (ic->nb_streams <= rv->stream_index)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == rv->stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    if (!(avctx = avcodec_alloc_context3(NULL)))
+        goto fail;
+    if (avcodec_parameters_to_context(avctx, rv->codecpar) < 0)
+        goto fail;
+    avctx->pkt_timebase = rv->time_base;
+    if (avcodec_open2(avctx, rv->codec, NULL) < 0)
+        goto fail;
+
+    SDL_LockMutex(rv->mutex);
+    while (!rv->abort_request) {
+        int64_t ts = rv->pos, end = AV_NOPTS_VALUE;
+        ReverseChunk *c, **prev, *fetched;
+        int generation, ret;
+
+        /* the GOP before the displayed picture, then the one before that */
+        for (i = 0; i < 2 && rv->active && ts > rv->bof_pts; i++) {
+            if (!(c = reverse_find_chunk(rv, ts - 1))) {
+                end = ts;
+                break;
             }
-            if ((ret = decoder_start(&is->auddec, audio_thread, is)) < 0)
-                goto out;
-            SDL_PauseAudioDevice(audio_dev, 0);
-            break;
-        case AVMEDIA_TYPE_VIDEO:
-            is->video_stream = stream_index;
-            is->video_st = ic->streams[stream_index];
+            ts = c->start_pts;
+        }
+        /* the GOP ahead did not fit last time: wait until playing backwards freed enough */
+        if (end != AV_NOPTS_VALUE && end != rv->pos && end == rv->blocked_end &&
+            rv->mem - reverse_played_mem(rv) + rv->blocked_mem > budget)
+            end = AV_NOPTS_VALUE;
+        if (end == AV_NOPTS_VALUE) {
+            SDL_CondWait(rv->cond, rv->mutex);
+            continue;
+        }
 
-            decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread);
-            if ((ret = decoder_start(&is->viddec, video_thread, is)) < 0)
-                goto out;
-            is->queue_attachments_req = 1;
-            break;
-        case AVMEDIA_TYPE_SUBTITLE:
-            is->subtitle_stream = stream_index;
-            is->subtitle_st = ic->streams[stream_index];
+        generation = rv->generation;
+        SDL_UnlockMutex(rv->mutex);
+        ret = reverse_fetch(rv, ic, avctx, end, generation, budget / 2, &fetched);
+        SDL_LockMutex(rv->mutex);
 
-            decoder_init(&is->subdec, avctx, &is->subtitleq, is->continue_read_thread);
-            if ((ret = decoder_start(&is->subdec, subtitle_thread, is)) < 0)
-                goto out;
-            break;
-        default:
-            break;
+        if (ret < 0 || generation != rv->generation) {
+            reverse_chunk_free(&fetched);
+            if (ret < 0 && ret != AVERROR_EXIT) {
+                av_log(NULL, AV_LOG_WARNING, "Could not decode the GOP before %0.3f: %s\n", end / (double)AV_TIME_BASE, av_err2str(ret));
+                SDL_CondWaitTimeout(rv->cond, rv->mutex, PREFETCH_RETRY_DELAY);
+            }
+            continue;
+        }
+        if (!fetched) {
+            rv->bof_pts = end;
+            continue;
+        }
+
+        /* make room by dropping what was already played backwards */
+        while (rv->mem + fetched->mem > budget) {
+            ReverseChunk **victim = NULL;
+            for (prev = &rv->chunks; *prev; prev = &(*prev)->next)
+                if ((*prev)->start_pts >= rv->pos && (!victim || (*prev)->start_pts > (*victim)->start_pts))
+                    victim = prev;
+            if (!victim)
+                break;
+            c = *victim;
+            *victim = c->next;
+            rv->mem -= c->mem;
+            reverse_chunk_free(&c);
+        }
+        /* only the GOP needed right now may exceed the budget */
+        if (rv->mem + fetched->mem > budget && end != rv->pos) {
+            rv->blocked_end = end;
+            rv->blocked_mem = fetched->mem;
+            reverse_chunk_free(&fetched);
+            continue;
+        }
+        rv->blocked_end = AV_NOPTS_VALUE;
+        fetched->next = rv->chunks;
+        rv->chunks = fetched;
+        rv->mem += fetched->mem;
     }
-    goto out;
+    SDL_UnlockMutex(rv->mutex);
 
     fail:
-        avcodec_free_context(&avctx);
-
-    out:
-        av_dict_free(&opts);
-
-    return ret;
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    return 0;
 }
 
-static int decode_interrupt_cb(void *ctx)
+static void reverse_stop(VideoState *is)
 {
-    VideoState *is = ctx;
-    return is->abort_request;
-}
+    Reverser *rv = &is->reverse;
+    ReverseChunk *c;
 
-static int stream_has_enough_packets(AVStream *st, int stream_id, PacketQueue *queue) {
-    return stream_id < 0 ||
-           queue->abort_request ||
-           (st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
-           queue->nb_packets > MIN_FRAMES && (!queue->duration || av_q2d(st->time_base) * queue->duration > 1.0);
+    if (rv->tid) {
+        SDL_LockMutex(rv->mutex);
+        rv->abort_request = 1;
+        SDL_CondSignal(rv->cond);
+        SDL_UnlockMutex(rv->mutex);
+        SDL_WaitThread(rv->tid, NULL);
+        rv->tid = NULL;
+    }
+    while ((c = rv->chunks)) {
+        rv->chunks = c->next;
+        reverse_chunk_free(&c);
+    }
+    rv->mem = 0;
+    rv->active = rv->playing = rv->step = 0;
+    rv->abort_request = 0;
+    avcodec_parameters_free(&rv->codecpar);
+    SDL_DestroyCond(rv->cond);
+    SDL_DestroyMutex(rv->mutex);
+    rv->cond  = NULL;
+    rv->mutex = NULL;
 }
 
-static int is_realtime(AVFormatContext *s)
+static int reverse_start(VideoState *is)
 {
-    if(   !strcmp(s->iformat->name, "rtp")
-          || !strcmp(s->iformat->name, "rtsp")
-          || !strcmp(s->iformat->name, "sdp")
-            )
-        return 1;
+    Reverser *rv = &is->reverse;
 
-    if(s->pb && (   !strncmp(s->url, "rtp:", 4)
-                    || !strncmp(s->url, "udp:", 4)
-    )
-            )
-        return 1;
+    if (!(rv->mutex = SDL_CreateMutex()) || !(rv->cond = SDL_CreateCond()) ||
+        !(rv->codecpar = avcodec_parameters_alloc()) ||
+        avcodec_parameters_copy(rv->codecpar, is->video_st->codecpar) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not set up reverse playback.\n");
+        reverse_stop(is);
+        return AVERROR(ENOMEM);
+    }
+    rv->stream_index = is->video_stream;
+    rv->time_base    = is->video_st->time_base;
+    rv->codec        = is->viddec.avctx->codec;
+    rv->bof_pts      = INT64_MIN;
+    rv->blocked_end  = AV_NOPTS_VALUE;
+
+    rv->tid = SDL_CreateThread(reverse_thread, "reverse_thread", is);
+    if (!rv->tid) {
+        av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s\n", SDL_GetError());
+        reverse_stop(is);
+        return AVERROR(ENOMEM);
+    }
     return 0;
 }
 
-/**
- * Setup AVCodecContext options for avformat_find_stream_info().
- *
- * Create an array of dictionaries, one dictionary for each stream
- * contained in s.
- * Each dictionary will contain the options from codec_opts which can
- * be applied to the corresponding stream codec context.
- *
- * @return pointer to the created array of dictionaries, NULL if it
- * cannot be created
- */
-AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
-                                           AVDictionary *codec_opts);
-
-AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
-                                           AVDictionary *codec_opts)
+/* pause normal playback and step or play backwards from the displayed picture */
+static void reverse_enter(VideoState *is, int playing)
 {
-    int i;
-    AVDictionary **opts;
+    Reverser *rv = &is->reverse;
 
-    if (!s->nb_streams)
-        return NULL;
-    opts = av_mallocz_array(s->nb_streams, sizeof(*opts));
-    if (!opts) {
-        av_log(NULL, AV_LOG_ERROR,
-               "Could not alloc memory for stream options.\n");
-        return NULL;
+    if (!is->video_st || is->realtime || (is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+        return;
+    if (rv->tid && rv->stream_index != is->video_stream)
+        reverse_stop(is);
+    if (!rv->tid && reverse_start(is) < 0)
+        return;
+
+    SDL_LockMutex(rv->mutex);
+    if (!rv->active) {
+        double pts = get_clock(&is->vidclk);
+        if (!is->paused)
+            toggle_pause(is);
+        if (isnan(pts))
+            pts = frame_queue_peek_last(&is->pictq)->pts;
+        rv->pos    = llrint(pts * AV_TIME_BASE);
+        rv->active = 1;
+        rv->generation++;
     }
-    for (i = 0; i < s->nb_streams; i++)
-        opts[i] = filter_codec_opts(codec_opts, s->streams[i]->codecpar->codec_id,
-                                    s, s->streams[i], NULL);
-    return opts;
+    rv->playing     = playing;
+    rv->step        = !playing;
+    rv->frame_timer = player_time() / 1000000.0;
+    SDL_CondSignal(rv->cond);
+    SDL_UnlockMutex(rv->mutex);
 }
 
+/* stop playing backwards, or start from the displayed picture */
+static void reverse_toggle(VideoState *is)
+{
+    Reverser *rv = &is->reverse;
+    int playing = 0;
 
-/**
- * Print an error message to stderr, indicating filename and a human
- * readable description of the error code err.
- *
- * If strerror_r() is not available the use of this function in a
- * multithreaded application may be unsafe.
- *
- * @see av_strerror()
- */
-void print_error(const char *filename, int err);
+    if (rv->mutex) {
+        SDL_LockMutex(rv->mutex);
+        playing = rv->active && rv->playing;
+        if (playing)
+            rv->playing = 0;
+        SDL_UnlockMutex(rv->mutex);
+    }
+    if (!playing)
+        reverse_enter(is, 1);
+}
 
-void print_error(const char *filename, int err)
+/* back to normal (paused) playback, at the picture reached backwards */
+static void reverse_leave(VideoState *is)
 {
-    char errbuf[128];
-    const char *errbuf_ptr = errbuf;
+    Reverser *rv = &is->reverse;
+    int64_t pos;
 
-    if (av_strerror(err, errbuf, sizeof(errbuf)) < 0)
-        errbuf_ptr = strerror(AVUNERROR(err));
-    av_log(NULL, AV_LOG_ERROR, "%s: %s\n", filename, errbuf_ptr);
+    if (!rv->mutex)
+        return;
+    SDL_LockMutex(rv->mutex);
+    if (!rv->active) {
+        SDL_UnlockMutex(rv->mutex);
+        return;
+    }
+    rv->active = rv->playing = rv->step = 0;
+    rv->generation++;
+    pos = rv->pos;
+    SDL_UnlockMutex(rv->mutex);
+    /* a microsecond past the picture so the pre-roll keeps it */
+    stream_seek_exact(is, pos + 1);
 }
 
+/* show the previous picture when a step was asked or its time came */
+static void reverse_refresh(VideoState *is, double *remaining_time)
+{
+    Reverser *rv = &is->reverse;
+    double time = player_time() / 1000000.0;
+    ReverseChunk *c;
+    int i;
+
+    if (!rv->playing && !rv->step)
+        return;
+    if (!rv->step && time < rv->frame_timer + rv->frame_duration) {
+        *remaining_time = FFMIN(*remaining_time, rv->frame_timer + rv->frame_duration - time);
+        return;
+    }
 
+    SDL_LockMutex(rv->mutex);
+    if ((c = reverse_find_chunk(rv, rv->pos - 1))) {
+        for (i = c->nb_frames - 1; i > 0 && c->frames[i]->pts >= rv->pos; i--)
+            ;
+        rv->frame_duration = (rv->pos - c->frames[i]->pts) / (double)AV_TIME_BASE;
+        if (rv->frame_duration <= 0 || rv->frame_duration > AV_SYNC_THRESHOLD_MAX)
+            rv->frame_duration = REFRESH_RATE;
+        rv->frame_timer = time - rv->frame_timer > AV_SYNC_THRESHOLD_MAX ? time : rv->frame_timer + rv->frame_duration;
+        rv->pos  = c->frames[i]->pts;
+        rv->step = 0;
+        set_preview_frame(is, c->frames[i], is->videoq.serial + 1);
+        SDL_CondSignal(rv->cond);
+    } else if (rv->pos <= rv->bof_pts) {
+        /* reached the first picture */
+        rv->playing = rv->step = 0;
+    } else {
+        rv->nb_stalls++;
+        SDL_CondSignal(rv->cond);
+    }
+    SDL_UnlockMutex(rv->mutex);
+}
 
 /* this thread gets the stream from the disk or the network */
 static int read_thread(void *arg)
@@ -3618,6 +8664,9 @@ static int read_thread(void *arg)
     int scan_all_pmts_set = 0;
     int64_t pkt_ts;
 
+    benchmark_thread_begin(is, BENCHMARK_THREAD_READ);
+    trace_thread_name("read");
+
     if (!wait_mutex) {
         av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
         ret = AVERROR(ENOMEM);
@@ -3708,6 +8757,11 @@ static int read_thread(void *arg)
     }
 
     is->realtime = is_realtime(ic);
+    /* the buffers of a live stream cannot be played faster or slower */
+    if (is->realtime && playback_speed != 1.0) {
+        av_log(NULL, AV_LOG_WARNING, "Playback speed cannot be changed on realtime streams, playing at 1x\n");
+        set_playback_speed(is, 1.0);
+    }
 
     if (show_status)
         av_dump_format(ic, 0, is->filename, 0);
@@ -3781,6 +8835,17 @@ static int read_thread(void *arg)
     if (infinite_buffer < 0 && is->realtime)
         infinite_buffer = 1;
 
+    if (prefetch_mem > 0 && is->video_st && !is->realtime && !seek_by_bytes &&
+        !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+        prefetch_start(is);
+
+    if (proxy_enable && is->video_st && !is->realtime &&
+        !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+        proxy_start(is);
+
+    if (peaks_enable && is->audio_st && !is->realtime && !seek_by_bytes)
+        peaks_start(is);
+
     for (;;) {
         if (is->abort_request)
             break;
@@ -3802,13 +8867,31 @@ static int read_thread(void *arg)
         }
         #endif
         if (is->seek_req) {
-            int64_t seek_target = is->seek_pos;
-            int64_t seek_min    = is->seek_rel > 0 ? seek_target - is->seek_rel + 2: INT64_MIN;
-            int64_t seek_max    = is->seek_rel < 0 ? seek_target - is->seek_rel - 2: INT64_MAX;
+            int64_t seek_target, seek_min, seek_max, seek_rel, seek_req_time, seek_input_time;
+            int64_t seek_start = av_gettime_relative(), seek_done, seek_flushed;
+            int seek_flags, seek_exact;
+
+            /* take the latest target, later requests can be queued while we seek */
+            SDL_LockMutex(is->seek_mutex);
+            seek_target   = is->seek_pos;
+            seek_rel      = is->seek_rel;
+            seek_flags    = is->seek_flags;
+            seek_req_time = is->seek_req_time;
+            seek_input_time = is->seek_input_time;
+            seek_exact    = is->seek_exact;
+            is->seek_req  = 0;
+            SDL_UnlockMutex(is->seek_mutex);
+
+            seek_min = seek_rel > 0 ? seek_target - seek_rel + 2: INT64_MIN;
+            seek_max = seek_rel < 0 ? seek_target - seek_rel - 2: INT64_MAX;
 // FIXME the +-2 is due to rounding being not done in the correct direction in generation
 //      of the seek_pos/seek_rel variables
 
-            ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
+            /* the flush below starts the next serial */
+            PLAYER_PROBE(seek_start, seek_target, seek_flags,
+                         (is->video_stream >= 0 ? is->videoq.serial : is->audioq.serial) + 1);
+            ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, seek_flags);
+            seek_done = av_gettime_relative();
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR,
                        "%s: error while seeking\n", is->ic->url);
@@ -3825,15 +8908,39 @@ static int read_thread(void *arg)
                     packet_queue_flush(&is->videoq);
                     packet_queue_put(&is->videoq, &flush_pkt);
                 }
-                if (is->seek_flags & AVSEEK_FLAG_BYTE) {
+                seek_flushed = av_gettime_relative();
+                if (seek_flags & AVSEEK_FLAG_BYTE) {
                     set_clock(&is->extclk, NAN, 0);
                 } else {
                     set_clock(&is->extclk, seek_target / (double)AV_TIME_BASE, 0);
                 }
+                /* set before the decoders see a packet of the new serial */
+                is->preroll_target = seek_target / (double)AV_TIME_BASE;
+                is->preroll_video_serial = is->preroll_audio_serial = -1;
+                if (seek_exact && !(seek_flags & AVSEEK_FLAG_BYTE)) {
+                    is->preroll_video_serial = is->videoq.serial;
+                    is->preroll_audio_serial = is->audioq.serial;
+                }
+
+                /* before the prefetcher queues packets the decoders could show */
+                SDL_LockMutex(is->seek_mutex);
+                if (is->seek_latency_start != AV_NOPTS_VALUE)
+                    is->seek_nb_cancelled++;
+                is->seek_serial = is->video_stream >= 0 ? is->videoq.serial : is->audioq.serial;
+                is->seek_latency_start = seek_req_time;
+                is->seek_timing = (SeekTiming){ seek_input_time, seek_req_time, seek_start, seek_done, seek_flushed, AV_NOPTS_VALUE };
+                SDL_UnlockMutex(is->seek_mutex);
+
+                is->prefetch_skip_dts   = AV_NOPTS_VALUE;
+                is->prefetch_skip_count = 0;
+                if (is->video_stream >= 0 && !(seek_flags & AVSEEK_FLAG_BYTE))
+                    prefetch_on_seek(is, seek_target, seek_min);
             }
-            is->seek_req = 0;
             is->queue_attachments_req = 1;
             is->eof = 0;
+            /* a newer target arrived meanwhile: issue it right away */
+            if (is->seek_req)
+                continue;
             if (is->paused)
                 step_to_next_frame(is);
         }
@@ -3870,7 +8977,10 @@ static int read_thread(void *arg)
                 goto fail;
             }
         }
+        TRACE_BEGIN("read_frame", NAN, -1);
         ret = av_read_frame(ic, pkt);
+        TRACE_END("read_frame", ret < 0 || pkt->pts == AV_NOPTS_VALUE ? NAN :
+                  pkt->pts * av_q2d(ic->streams[pkt->stream_index]->time_base), -1);
         if (ret < 0) {
             if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !is->eof) {
                 if (is->video_stream >= 0)
@@ -3902,7 +9012,16 @@ static int read_thread(void *arg)
             packet_queue_put(&is->audioq, pkt);
         } else if (pkt->stream_index == is->video_stream && pkt_in_play_range
                    && !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
-            packet_queue_put(&is->videoq, pkt);
+            /* already queued from the prefetched GOP: a packet without dts (or
+               without any to compare with) is one of them while they are not all seen */
+            if (is->prefetch_skip_count > 0 &&
+                (pkt->dts == AV_NOPTS_VALUE || is->prefetch_skip_dts == AV_NOPTS_VALUE || pkt->dts <= is->prefetch_skip_dts)) {
+                is->prefetch_skip_count--;
+                av_packet_unref(pkt);
+            } else {
+                is->prefetch_skip_count = 0;
+                packet_queue_put(&is->videoq, pkt);
+            }
         } else if (pkt->stream_index == is->subtitle_stream && pkt_in_play_range) {
             packet_queue_put(&is->subtitleq, pkt);
         } else {
@@ -3923,12 +9042,14 @@ static int read_thread(void *arg)
         SDL_PushEvent(&event);
     }
     SDL_DestroyMutex(wait_mutex);
+    benchmark_thread_end(is, BENCHMARK_THREAD_READ);
     return 0;
 }
 
 static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 {
     VideoState *is;
+    int i;
 
     is = av_mallocz(sizeof(VideoState));
     if (!is)
@@ -3958,9 +9079,52 @@ static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
         goto fail;
     }
 
+    if (!(is->seek_mutex = SDL_CreateMutex())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+        goto fail;
+    }
+    is->seek_latency_start = AV_NOPTS_VALUE;
+    histogram_init(&is->seek_latency, "seek latency", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_INPUT],   "seek stage input", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_QUEUED],  "seek stage queued", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_SEEK],    "seek stage avformat_seek_file", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_FLUSH],   "seek stage flush", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_DECODE],  "seek stage first decode", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_PRESENT], "seek stage present", "us");
+    histogram_init(&is->seek_stages[SEEK_STAGE_TOTAL],   "seek input to frame", "us");
+    is->input_time = AV_NOPTS_VALUE;
+    av_lfg_init(&is->seek_test.lfg, 0x5eed);
+    for (i = 0; i < AV_SYNC_NB_TYPES; i++) {
+        histogram_init(&is->sync_stats[i].av_diff, "A-V difference", "us");
+        histogram_init(&is->sync_stats[i].lateness, "frame lateness", "us");
+        histogram_init(&is->sync_stats[i].callback_jitter, "audio callback jitter", "us");
+    }
+    is->prefetch_skip_dts = AV_NOPTS_VALUE;
+    is->metrics.fd = -1;
+    is->virtual_sink.next_callback = AV_NOPTS_VALUE;
+    is->proxy.in_fd = -1;
+    is->preroll_video_serial = is->preroll_audio_serial = -1;
+    is->scrub_target = AV_NOPTS_VALUE;
+    is->scrub_cache.max_mem = (size_t)FFMAX(scrub_cache_mem, 0) * 1024 * 1024;
+    is->scrub_cache.last_playback_pts = AV_NOPTS_VALUE;
+    if (!(is->scrub_cache.mutex = SDL_CreateMutex())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+        goto fail;
+    }
+
+    if (!(is->preview_mutex = SDL_CreateMutex())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+        goto fail;
+    }
+    if (!(is->preview_frame = av_frame_alloc()))
+        goto fail;
+
     init_clock(&is->vidclk, &is->videoq.serial);
     init_clock(&is->audclk, &is->audioq.serial);
     init_clock(&is->extclk, &is->extclk.serial);
+    playback_speed = av_clipd(playback_speed, PLAYBACK_SPEED_MIN, PLAYBACK_SPEED_MAX);
+    is->audclk.speed = is->vidclk.speed = is->extclk.speed = playback_speed;
+    is->stretch_serial = -1;
     is->audio_clock_serial = -1;
     if (startup_volume < 0)
         av_log(NULL, AV_LOG_WARNING, "-volume=%d < 0, setting to 0\n", startup_volume);
@@ -4078,19 +9242,136 @@ static void toggle_audio_display(VideoState *is)
     }
 }
 
+/* a queue the decoder cannot add to before the main loop takes a frame, or will not add to anymore */
+static int virtual_queue_ready(VideoState *is, FrameQueue *f, Decoder *d, PacketQueue *q)
+{
+    return f->size >= f->max_size || d->finished == q->serial || is->paused;
+}
+
+/*
+ * Wait in real time until the decoders caught up with the virtual timeline,
+ * so the outcome of a session does not depend on how fast they run.
+ */
+static void virtual_wait_decoders(VideoState *is)
+{
+    while (!is->abort_request &&
+           ((is->video_st && !virtual_queue_ready(is, &is->pictq, &is->viddec, &is->videoq)) ||
+            (is->audio_st && !virtual_queue_ready(is, &is->sampq, &is->auddec, &is->audioq))))
+        SDL_Delay(1);
+}
+
+/*
+ * Replaces the sleep of the refresh loop with -virtual_clock: moves the
+ * virtual timeline by us, feeding the null audio sink every time it has
+ * played a device buffer and issuing the -virtual_seeks that became due.
+ */
+static void virtual_advance(VideoState *is, int64_t us)
+{
+    VirtualSink *sink = &is->virtual_sink;
+    int64_t target = player_time() + FFMAX(us, 0);
+
+    virtual_wait_decoders(is);
+
+    if (is->audio_st && is->audio_hw_buf_size > 0) {
+        /* a drifting device plays its buffer in more or less than the nominal time */
+        int64_t period = (int64_t)(1000000.0 * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / (1.0 + clock_drift / 1000000.0));
+
+        av_fast_malloc(&sink->buf, &sink->buf_size, is->audio_hw_buf_size);
+        if (!sink->buf)
+            return;
+        if (sink->next_callback == AV_NOPTS_VALUE)
+            sink->next_callback = player_time();
+        while (sink->next_callback <= target && !is->abort_request) {
+            player_sleep(sink->next_callback - player_time());
+            virtual_wait_decoders(is);
+            sdl_audio_callback(is, sink->buf, is->audio_hw_buf_size);
+            sink->next_callback += FFMAX(period, 1);
+        }
+    }
+    player_sleep(target - player_time());
+
+    while (sink->next_seek < nb_virtual_seeks && virtual_seeks[sink->next_seek].at <= player_time()) {
+        av_log(NULL, AV_LOG_VERBOSE, "virtual clock %0.3f: seeking to %0.3f\n",
+               player_time() / 1000000.0, virtual_seeks[sink->next_seek].target / (double)AV_TIME_BASE);
+        stream_seek_exact(is, virtual_seeks[sink->next_seek].target);
+        sink->next_seek++;
+    }
+}
+
+/*
+ * -seek_test: issue exact seeks to random positions one after the other, each
+ * once the previous one presented its frame, then report and quit.
+ */
+static void seek_test_update(VideoState *is)
+{
+    SeekTest *st = &is->seek_test;
+    int64_t now = av_gettime_relative();
+    int64_t duration = is->ic->duration, start = is->ic->start_time == AV_NOPTS_VALUE ? 0 : is->ic->start_time;
+    int pending = is->seek_req || is->seek_latency_start != AV_NOPTS_VALUE;
+
+    if (pending && now - st->last_request < SEEK_TEST_TIMEOUT)
+        return;
+    if (pending && st->nb_done) {
+        av_log(NULL, AV_LOG_WARNING, "seek test: seek %d did not show a frame within %d ms\n",
+               st->nb_done, SEEK_TEST_TIMEOUT / 1000);
+        st->nb_timeouts++;
+    }
+    /* start once playback shows something */
+    if (!st->nb_done && isnan(get_master_clock(is)))
+        return;
+
+    if (st->nb_done == seek_test) {
+        const Histogram *h = &is->seek_stages[SEEK_STAGE_TOTAL];
+        bench_report("seek_test_p50", is->filename, histogram_percentile(h, 50), "us", h->count);
+        bench_report("seek_test_p95", is->filename, histogram_percentile(h, 95), "us", h->count);
+        bench_report("seek_test_p99", is->filename, histogram_percentile(h, 99), "us", h->count);
+        if (st->nb_timeouts)
+            av_log(NULL, AV_LOG_WARNING, "seek test: %d of %d seeks timed out\n", st->nb_timeouts, seek_test);
+        do_exit(is);
+    }
+    if (duration <= 0 || duration == AV_NOPTS_VALUE) {
+        av_log(NULL, AV_LOG_ERROR, "seek test: %s has no duration\n", is->filename);
+        do_exit(is);
+    }
+
+    stream_seek_exact(is, start + av_rescale(av_lfg_get(&st->lfg), duration, UINT32_MAX));
+    st->last_request = now;
+    st->nb_done++;
+}
+
 static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
     double remaining_time = 0.0;
+    is->input_time = AV_NOPTS_VALUE;
     SDL_PumpEvents();
     while (!SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) {
         if (!cursor_hidden && av_gettime_relative() - cursor_last_shown > CURSOR_HIDE_DELAY) {
             SDL_ShowCursor(0);
             cursor_hidden = 1;
         }
-        if (remaining_time > 0.0)
-            av_usleep((int64_t)(remaining_time * 1000000.0));
+        /* the drag settled: refine the cached preview to the exact frame */
+        if (is->scrub_target != AV_NOPTS_VALUE && av_gettime_relative() - is->scrub_last_motion >= SCRUB_SETTLE_DELAY) {
+            stream_seek_exact(is, is->scrub_target);
+            is->scrub_target = AV_NOPTS_VALUE;
+        }
+        if (virtual_clock)
+            virtual_advance(is, (int64_t)(remaining_time * 1000000.0));
+        else
+            player_sleep((int64_t)(remaining_time * 1000000.0));
         remaining_time = REFRESH_RATE;
+        if (is->reverse.active)
+            reverse_refresh(is, &remaining_time);
         if (is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh))
             video_refresh(is, &remaining_time);
+        if (audio_adaptive)
+            audio_adapt(is);
+        if (is->prefetch.tid)
+            prefetch_update_position(is);
+        if (metrics_filename)
+            metrics_update(is);
+        if (alloc_stats)
+            alloc_stats_update(is);
+        if (seek_test)
+            seek_test_update(is);
         SDL_PumpEvents();
     }
 }
@@ -4122,6 +9403,487 @@ static void seek_chapter(VideoState *is, int incr)
                                  AV_TIME_BASE_Q), 0, 0);
 }
 
+/* consume the decoded pictures as soon as they are queued, converting them like upload_texture() would */
+static int benchmark_video_sink(void *arg)
+{
+    VideoState *is = arg;
+    struct SwsContext *sws_ctx = NULL;
+    uint8_t *pixels[4] = { NULL };
+    int pitch[4], w = 0, h = 0;
+    Frame *vp;
+
+    benchmark_thread_begin(is, BENCHMARK_THREAD_VIDEO_SINK);
+    while ((vp = frame_queue_peek_readable(&is->pictq))) {
+        AVFrame *frame = vp->frame;
+
+        if (benchmark_filters && frame->format != AV_PIX_FMT_BGRA) {
+            if (frame->width != w || frame->height != h) {
+                av_freep(&pixels[0]);
+                if (av_image_alloc(pixels, pitch, frame->width, frame->height, AV_PIX_FMT_BGRA, 32) < 0)
+                    break;
+                w = frame->width;
+                h = frame->height;
+            }
+            sws_ctx = sws_getCachedContext(sws_ctx, w, h, frame->format, w, h,
+                                           AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
+            if (sws_ctx)
+                sws_scale(sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, h, pixels, pitch);
+        }
+        is->bench.nb_video_frames++;
+        frame_queue_next(&is->pictq);
+    }
+    benchmark_thread_end(is, BENCHMARK_THREAD_VIDEO_SINK);
+    av_freep(&pixels[0]);
+    sws_freeContext(sws_ctx);
+    return 0;
+}
+
+/* consume the decoded samples as soon as they are queued */
+static int benchmark_audio_sink(void *arg)
+{
+    VideoState *is = arg;
+    Frame *af;
+
+    benchmark_thread_begin(is, BENCHMARK_THREAD_AUDIO_SINK);
+    while ((af = frame_queue_peek_readable(&is->sampq))) {
+        is->bench.nb_audio_frames++;
+        is->bench.nb_audio_samples += af->frame->nb_samples;
+        frame_queue_next(&is->sampq);
+    }
+    benchmark_thread_end(is, BENCHMARK_THREAD_AUDIO_SINK);
+    return 0;
+}
+
+/* replaces event_loop() in benchmark mode: drain the queues until read_thread reaches the end */
+static void benchmark_loop(VideoState *is)
+{
+    SDL_Thread *video_sink, *audio_sink;
+    SDL_Event event;
+
+    is->bench.start_time = av_gettime_relative();
+    video_sink = SDL_CreateThread(benchmark_video_sink, "benchmark_video_sink", is);
+    audio_sink = SDL_CreateThread(benchmark_audio_sink, "benchmark_audio_sink", is);
+    if (!video_sink || !audio_sink)
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
+
+    while (video_sink && audio_sink && SDL_WaitEvent(&event))
+        if (event.type == FF_QUIT_EVENT || event.type == SDL_QUIT)
+            break;
+    is->bench.end_time = av_gettime_relative();
+
+    packet_queue_abort(&is->videoq);
+    packet_queue_abort(&is->audioq);
+    frame_queue_signal(&is->pictq);
+    frame_queue_signal(&is->sampq);
+    SDL_WaitThread(video_sink, NULL);
+    SDL_WaitThread(audio_sink, NULL);
+    do_exit(is);
+}
+
+static int bench_packet_producer(void *arg)
+{
+    PacketQueue *q = arg;
+    AVPacket pkt;
+    int i;
+
+    if (av_new_packet(&pkt, BENCH_PACKET_SIZE) < 0)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < BENCH_NB_PACKETS; i++) {
+        AVPacket copy = { 0 };
+        if (av_packet_ref(&copy, &pkt) < 0 || packet_queue_put(q, &copy) < 0)
+            break;
+    }
+    av_packet_unref(&pkt);
+    return 0;
+}
+
+/* packet_queue_put()/get(), in the same thread and between a producer and a consumer thread */
+static void bench_packet_queue(void)
+{
+    PacketQueue q;
+    AVPacket pkt, out;
+    SDL_Thread *producer;
+    int64_t start;
+    int i, serial;
+
+    if (packet_queue_init(&q) < 0 || av_new_packet(&pkt, BENCH_PACKET_SIZE) < 0)
+        return;
+    packet_queue_start(&q);
+    packet_queue_get(&q, &out, 0, &serial);
+
+    start = av_gettime_relative();
+    for (i = 0; i < BENCH_NB_PACKETS; i++) {
+        AVPacket copy = { 0 };
+        if (av_packet_ref(&copy, &pkt) < 0 || packet_queue_put(&q, &copy) < 0 ||
+            packet_queue_get(&q, &out, 1, &serial) <= 0)
+            break;
+        av_packet_unref(&out);
+    }
+    bench_report("packet_queue_put_get", NULL, (av_gettime_relative() - start) * 1000.0 / i, "ns/packet", i);
+
+    start = av_gettime_relative();
+    if ((producer = SDL_CreateThread(bench_packet_producer, "bench_packet_producer", &q))) {
+        for (i = 0; i < BENCH_NB_PACKETS && packet_queue_get(&q, &out, 1, &serial) > 0; i++)
+            av_packet_unref(&out);
+        SDL_WaitThread(producer, NULL);
+        bench_report("packet_queue_threaded", NULL, (av_gettime_relative() - start) * 1000.0 / i, "ns/packet", i);
+    }
+
+    av_packet_unref(&pkt);
+    packet_queue_abort(&q);
+    packet_queue_destroy(&q);
+}
+
+static int bench_frame_producer(void *arg)
+{
+    FrameQueue *f = arg;
+    Frame *vp;
+    int i;
+
+    for (i = 0; i < BENCH_NB_FRAMES && (vp = frame_queue_peek_writable(f)); i++) {
+        vp->pts    = i;
+        vp->serial = 1;
+        frame_queue_push(f);
+    }
+    return 0;
+}
+
+/* one picture queue hand-off between a decoder thread and the display */
+static void bench_frame_queue(void)
+{
+    PacketQueue q;
+    FrameQueue f;
+    SDL_Thread *producer;
+    int64_t start;
+    int i;
+
+    if (packet_queue_init(&q) < 0 || frame_queue_init(&f, &q, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
+        return;
+    packet_queue_start(&q);
+
+    start = av_gettime_relative();
+    if ((producer = SDL_CreateThread(bench_frame_producer, "bench_frame_producer", &f))) {
+        for (i = 0; i < BENCH_NB_FRAMES && frame_queue_peek_readable(&f); i++)
+            frame_queue_next(&f);
+        SDL_WaitThread(producer, NULL);
+        bench_report("frame_queue_threaded", NULL, (av_gettime_relative() - start) * 1000.0 / i, "ns/frame", i);
+    }
+
+    packet_queue_abort(&q);
+    frame_queue_destory(&f);
+    packet_queue_destroy(&q);
+}
+
+/* the swr_convert() audio_decode_frame() does for a 48kHz FLTP source on a 44.1kHz S16 device */
+static void bench_resample(void)
+{
+    struct SwrContext *swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 44100,
+                                                AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLTP, 48000, 0, NULL);
+    AVFrame *frame = av_frame_alloc();
+    uint8_t *out = NULL;
+    unsigned int out_size = 0;
+    int64_t start;
+    int i, j, out_count;
+
+    if (!swr || !frame || swr_init(swr) < 0)
+        goto end;
+    frame->format         = AV_SAMPLE_FMT_FLTP;
+    frame->channel_layout = AV_CH_LAYOUT_STEREO;
+    frame->sample_rate    = 48000;
+    frame->nb_samples     = 1024;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        goto end;
+    for (j = 0; j < frame->nb_samples; j++)
+        ((float *)frame->data[0])[j] = ((float *)frame->data[1])[j] = sinf(j * 0.05f) * 0.5f;
+    out_count = (int64_t)frame->nb_samples * 44100 / 48000 + 256;
+    av_fast_malloc(&out, &out_size, av_samples_get_buffer_size(NULL, 2, out_count, AV_SAMPLE_FMT_S16, 0));
+    if (!out)
+        goto end;
+
+    start = av_gettime_relative();
+    for (i = 0; i < BENCH_NB_AUDIO_FRAMES; i++)
+        if (swr_convert(swr, &out, out_count, (const uint8_t **)frame->extended_data, frame->nb_samples) < 0)
+            break;
+    bench_report("audio_resample_fltp48k_s16_44k", NULL, (av_gettime_relative() - start) * 1000.0 / i, "ns/frame", i);
+
+    end:
+    av_freep(&out);
+    av_frame_free(&frame);
+    swr_free(&swr);
+}
+
+/* log and count a failed check of the micro benchmarks, they make the run exit with 1 */
+static void bench_check(int ok, const char *what, const char *kernel, enum AVSampleFormat fmt, int nb_samples)
+{
+    if (ok)
+        return;
+    av_log(NULL, AV_LOG_ERROR, "%s %s on %s is wrong for %d samples\n", what, kernel, av_get_sample_fmt_name(fmt), nb_samples);
+    bench_failures++;
+}
+
+/* every gain kernel the cpu has on a stereo callback of 1024 samples, checked
+   against the C version, and the silent and unity gain paths of audio_gain() */
+static void bench_gain(void)
+{
+    static const enum AVSampleFormat formats[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT };
+    const int nb_samples = 2 * 1024, volume = 77;
+    uint8_t *src = av_malloc(nb_samples * sizeof(float));
+    uint8_t *ref = av_malloc(nb_samples * sizeof(float));
+    uint8_t *dst = av_malloc(nb_samples * sizeof(float));
+    int cpu_flags = av_get_cpu_flags();
+    int64_t start;
+    int i, j, k, f;
+
+    if (!src || !ref || !dst) {
+        bench_failures++;
+        goto end;
+    }
+    /* include the extremes and odd tails, the kernels must match bit for bit */
+    for (j = 0; j < nb_samples; j++)
+        ((int16_t *)src)[j] = (int16_t)((j * 2654435761u) >> 16);
+    ((int16_t *)src)[0] = INT16_MIN;
+    ((int16_t *)src)[1] = INT16_MAX;
+
+    for (f = 0; f < FF_ARRAY_ELEMS(formats); f++) {
+        int bps = av_get_bytes_per_sample(formats[f]);
+
+        if (formats[f] == AV_SAMPLE_FMT_FLT)
+            for (j = 0; j < nb_samples; j++)
+                ((float *)src)[j] = sinf(j * 0.05f) * (j & 1 ? 1.5f : 0.5f);
+        for (k = 0; k < FF_ARRAY_ELEMS(gain_kernels); k++) {
+            const GainKernels *kernels = &gain_kernels[k];
+            GainFunc func = formats[f] == AV_SAMPLE_FMT_FLT ? kernels->flt : kernels->s16;
+            GainFunc c    = formats[f] == AV_SAMPLE_FMT_FLT ? gain_flt_c   : gain_s16_c;
+            char name[64];
+
+            if ((cpu_flags & kernels->cpu_flag) != kernels->cpu_flag)
+                continue;
+            for (j = nb_samples - 3; j <= nb_samples; j++) {
+                c(ref, src, j, volume);
+                func(dst, src, j, volume);
+                bench_check(!memcmp(ref, dst, j * bps), "Gain kernel", kernels->name, formats[f], j);
+            }
+
+            start = av_gettime_relative();
+            for (i = 0; i < BENCH_NB_AUDIO_FRAMES; i++)
+                func(dst, src, nb_samples, volume);
+            snprintf(name, sizeof(name), "audio_gain_%s_%s", av_get_sample_fmt_name(formats[f]), kernels->name);
+            bench_report(name, NULL, (av_gettime_relative() - start) * 1000.0 / i, "ns/callback", i);
+        }
+
+        /* the three paths of audio_gain(), dst filled with garbage first */
+        memset(ref, 0, nb_samples * bps);
+        memset(dst, 0x55, nb_samples * bps);
+        audio_gain(dst, NULL, nb_samples * bps, formats[f], volume);
+        bench_check(!memcmp(ref, dst, nb_samples * bps), "audio_gain()", "silence", formats[f], nb_samples);
+        memset(dst, 0x55, nb_samples * bps);
+        audio_gain(dst, src, nb_samples * bps, formats[f], 0);
+        bench_check(!memcmp(ref, dst, nb_samples * bps), "audio_gain()", "volume 0", formats[f], nb_samples);
+        memset(dst, 0x55, nb_samples * bps);
+        audio_gain(dst, src, nb_samples * bps, formats[f], SDL_MIX_MAXVOLUME);
+        bench_check(!memcmp(src, dst, nb_samples * bps), "audio_gain()", "unity gain", formats[f], nb_samples);
+        (formats[f] == AV_SAMPLE_FMT_FLT ? gain_flt_c : gain_s16_c)(ref, src, nb_samples, volume);
+        memset(dst, 0x55, nb_samples * bps);
+        audio_gain(dst, src, nb_samples * bps, formats[f], volume);
+        bench_check(!memcmp(ref, dst, nb_samples * bps), "audio_gain()", gain->name, formats[f], nb_samples);
+    }
+
+    end:
+    av_free(src);
+    av_free(ref);
+    av_free(dst);
+}
+
+/* cpu share of the level meter on 7.1 at 48 kHz, in percent of real time */
+static void bench_meter(void)
+{
+    static const enum AVSampleFormat formats[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT };
+    const int nb_frames = 1024, nb_buffers = 48000 * 10 / 1024;
+    struct AudioParams ap = { 48000, 8, AV_CH_LAYOUT_7POINT1 };
+    Meter *m = av_mallocz(sizeof(*m));
+    uint8_t *buf = av_malloc(nb_frames * 8 * sizeof(float));
+    int64_t start;
+    int i, j, f;
+
+    if (!m || !buf)
+        goto end;
+
+    for (f = 0; f < FF_ARRAY_ELEMS(formats); f++) {
+        char name[64];
+
+        ap.fmt = formats[f];
+        ap.frame_size = av_samples_get_buffer_size(NULL, ap.channels, 1, ap.fmt, 1);
+        for (j = 0; j < nb_frames * ap.channels; j++) {
+            float v = sinf(j * 0.01f) * 0.5f;
+            if (ap.fmt == AV_SAMPLE_FMT_FLT)
+                ((float *)buf)[j] = v;
+            else
+                ((int16_t *)buf)[j] = lrintf(v * 32767);
+        }
+        memset(m, 0, sizeof(*m));
+
+        start = av_gettime_relative();
+        for (i = 0; i < nb_buffers; i++)
+            meter_process(m, buf, nb_frames, &ap);
+        snprintf(name, sizeof(name), "audio_meter_7.1_%s", av_get_sample_fmt_name(ap.fmt));
+        bench_report(name, NULL, (av_gettime_relative() - start) * 100.0 * ap.freq / (1000000.0 * nb_frames * i), "%cpu", i);
+    }
+
+    end:
+    av_free(m);
+    av_free(buf);
+}
+
+/* cpu share of the -speed time stretcher on stereo at 48 kHz, in percent of real time */
+static void bench_stretch(void)
+{
+    static const double speeds[] = { 0.5, 1.5, 2.0 };
+    const int nb_frames = 1024, nb_buffers = 48000 * 10 / 1024;
+    float *buf = av_malloc(nb_frames * 2 * sizeof(float));
+    Stretch *st = stretch_alloc(2, 48000);
+    uint8_t *out;
+    int64_t start;
+    int i, j, s;
+
+    if (!st || !buf)
+        goto end;
+    for (j = 0; j < nb_frames * 2; j++)
+        buf[j] = sinf(j * 0.01f) * 0.5f;
+
+    for (s = 0; s < FF_ARRAY_ELEMS(speeds); s++) {
+        char name[64];
+
+        stretch_reset(st);
+        start = av_gettime_relative();
+        for (i = 0; i < nb_buffers; i++)
+            if (stretch_process(st, (uint8_t *)buf, nb_frames, AV_SAMPLE_FMT_FLT, speeds[s], &out) < 0)
+                break;
+        snprintf(name, sizeof(name), "audio_stretch_%.1fx_stereo_flt", speeds[s]);
+        bench_report(name, NULL, (av_gettime_relative() - start) * 100.0 * 48000 / (1000000.0 * nb_frames * i), "%cpu", i);
+    }
+
+    end:
+    stretch_free(&st);
+    av_free(buf);
+}
+
+/* upload_texture() of a native and of a converted pixel format, on a software renderer */
+static void bench_upload_texture(void)
+{
+    static const enum AVPixelFormat formats[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV422P };
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, 1920, 1080, 32, SDL_PIXELFORMAT_ARGB8888);
+    SDL_Texture *texture = NULL;
+    struct SwsContext *sws_ctx = NULL;
+    int64_t start;
+    int i, f;
+
+    if (!surface || !(renderer = SDL_CreateSoftwareRenderer(surface)) || SDL_GetRendererInfo(renderer, &renderer_info) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not create a software renderer: %s\n", SDL_GetError());
+        goto end;
+    }
+
+    for (f = 0; f < FF_ARRAY_ELEMS(formats); f++) {
+        AVFrame *frame = av_frame_alloc();
+        char name[64];
+
+        if (!frame)
+            break;
+        frame->format = formats[f];
+        frame->width  = 1920;
+        frame->height = 1080;
+        if (av_frame_get_buffer(frame, 32) < 0) {
+            av_frame_free(&frame);
+            break;
+        }
+        for (i = 0; i < 3; i++)
+            memset(frame->data[i], 0x80, frame->linesize[i] * AV_CEIL_RSHIFT(frame->height, i ? 1 : 0));
+
+        start = av_gettime_relative();
+        for (i = 0; i < BENCH_NB_UPLOADS; i++)
+            if (upload_texture(&texture, frame, &sws_ctx) < 0)
+                break;
+        snprintf(name, sizeof(name), "upload_texture_1080p_%s", av_get_pix_fmt_name(formats[f]));
+        bench_report(name, NULL, (av_gettime_relative() - start) / 1000.0 / FFMAX(i, 1), "ms/frame", i);
+        av_frame_free(&frame);
+    }
+
+    end:
+    if (texture)
+        SDL_DestroyTexture(texture);
+    sws_freeContext(sws_ctx);
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    renderer = NULL;
+    if (surface)
+        SDL_FreeSurface(surface);
+}
+
+/* time from avformat_seek_file() to the first decoded picture, at deterministic pseudo random targets */
+static void bench_seek(const char *filename)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    AVCodec *codec = NULL;
+    AVFrame *frame = av_frame_alloc();
+    AVPacket pkt;
+    Histogram latency;
+    uint32_t seed = 1;
+    int stream_index, i;
+
+    histogram_init(&latency, "seek to first picture", "us");
+    if (!frame || avformat_open_input(&ic, filename, NULL, NULL) < 0 || avformat_find_stream_info(ic, NULL) < 0 ||
+        ic->duration <= 0)
+        goto end;
+    if ((stream_index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0 ||
+        !(avctx = avcodec_alloc_context3(codec)) ||
+        avcodec_parameters_to_context(avctx, ic->streams[stream_index]->codecpar) < 0 ||
+        avcodec_open2(avctx, codec, NULL) < 0)
+        goto end;
+
+    for (i = 0; i < BENCH_NB_SEEKS; i++) {
+        int64_t start, target;
+        int got_frame = 0;
+
+        seed   = seed * 1664525 + 1013904223;
+        target = (ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0) + av_rescale(seed >> 8, ic->duration, 1 << 24);
+
+        start = av_gettime_relative();
+        if (avformat_seek_file(ic, -1, INT64_MIN, target, INT64_MAX, 0) < 0)
+            break;
+        avcodec_flush_buffers(avctx);
+        while (!got_frame && av_read_frame(ic, &pkt) >= 0) {
+            if (pkt.stream_index == stream_index && avcodec_send_packet(avctx, &pkt) >= 0)
+                got_frame = avcodec_receive_frame(avctx, frame) >= 0;
+            av_packet_unref(&pkt);
+        }
+        if (got_frame)
+            histogram_add(&latency, av_gettime_relative() - start);
+        av_frame_unref(frame);
+    }
+    bench_report("seek_p50", filename, histogram_percentile(&latency, 50), "us", latency.count);
+    bench_report("seek_p95", filename, histogram_percentile(&latency, 95), "us", latency.count);
+    bench_report("seek_p99", filename, histogram_percentile(&latency, 99), "us", latency.count);
+
+    end:
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    av_frame_free(&frame);
+}
+
+/* -bench_micro: run the micro benchmarks, the seek one on filename if given */
+static void bench_micro_run(const char *filename)
+{
+    bench_packet_queue();
+    bench_frame_queue();
+    bench_resample();
+    bench_gain();
+    bench_meter();
+    bench_stretch();
+    bench_upload_texture();
+    if (filename)
+        bench_seek(filename);
+}
+
 /* handle an event sent by the GUI */
 static void event_loop(VideoState *cur_stream)
 {
@@ -4131,6 +9893,8 @@ static void event_loop(VideoState *cur_stream)
     for (;;) {
         double x;
         refresh_loop_wait_event(cur_stream, &event);
+        /* seeks requested while handling the event are timed from when it happened */
+        cur_stream->input_time = av_gettime_relative() - 1000LL * FFMAX((int)(SDL_GetTicks() - event.common.timestamp), 0);
         switch (event.type) {
             case SDL_KEYDOWN:
                 if (exit_on_keydown || event.key.keysym.sym == SDLK_ESCAPE || event.key.keysym.sym == SDLK_q) {
@@ -4147,11 +9911,25 @@ static void event_loop(VideoState *cur_stream)
                         break;
                     case SDLK_p:
                     case SDLK_SPACE:
+                        reverse_leave(cur_stream);
                         toggle_pause(cur_stream);
                         break;
                     case SDLK_m:
                         toggle_mute(cur_stream);
                         break;
+                    case SDLK_l:
+                        show_meter = !show_meter;
+                        cur_stream->force_refresh = 1;
+                        break;
+                    case SDLK_LEFTBRACKET:
+                        set_playback_speed(cur_stream, playback_speed - PLAYBACK_SPEED_STEP);
+                        break;
+                    case SDLK_RIGHTBRACKET:
+                        set_playback_speed(cur_stream, playback_speed + PLAYBACK_SPEED_STEP);
+                        break;
+                    case SDLK_BACKSPACE:
+                        set_playback_speed(cur_stream, 1.0);
+                        break;
                     case SDLK_KP_MULTIPLY:
                     case SDLK_0:
                         update_volume(cur_stream, 1, SDL_VOLUME_STEP);
@@ -4161,12 +9939,20 @@ static void event_loop(VideoState *cur_stream)
                         update_volume(cur_stream, -1, SDL_VOLUME_STEP);
                         break;
                     case SDLK_s: // S: Step to next frame
+                        reverse_leave(cur_stream);
                         step_to_next_frame(cur_stream);
                         break;
+                    case SDLK_b: // B: Step to previous frame
+                        reverse_enter(cur_stream, 0);
+                        break;
+                    case SDLK_r: // R: Toggle reverse playback
+                        reverse_toggle(cur_stream);
+                        break;
                     case SDLK_a:
                         stream_cycle_channel(cur_stream, AVMEDIA_TYPE_AUDIO);
                         break;
                     case SDLK_v:
+                        reverse_leave(cur_stream);
                         stream_cycle_channel(cur_stream, AVMEDIA_TYPE_VIDEO);
                         break;
                     case SDLK_c:
@@ -4187,6 +9973,7 @@ static void event_loop(VideoState *cur_stream)
                         }
                         break;
                     case SDLK_PAGEUP:
+                        reverse_leave(cur_stream);
                         if (cur_stream->ic->nb_chapters <= 1) {
                             incr = 600.0;
                             goto do_seek;
@@ -4194,6 +9981,7 @@ static void event_loop(VideoState *cur_stream)
                         seek_chapter(cur_stream, 1);
                         break;
                     case SDLK_PAGEDOWN:
+                        reverse_leave(cur_stream);
                         if (cur_stream->ic->nb_chapters <= 1) {
                             incr = -600.0;
                             goto do_seek;
@@ -4212,6 +10000,7 @@ static void event_loop(VideoState *cur_stream)
                     case SDLK_DOWN:
                         incr = -60.0;
                     do_seek:
+                        reverse_leave(cur_stream);
                         if (seek_by_bytes) {
                             pos = -1;
                             if (pos < 0 && cur_stream->video_stream >= 0)
@@ -4228,12 +10017,16 @@ static void event_loop(VideoState *cur_stream)
                             stream_seek(cur_stream, pos, incr, 1);
                         } else {
                             pos = get_master_clock(cur_stream);
-                            if (isnan(pos))
+                            /* keep stepping from the pending target while key repeats are coalesced */
+                            if (isnan(pos) || cur_stream->seek_req)
                                 pos = (double)cur_stream->seek_pos / AV_TIME_BASE;
                             pos += incr;
                             if (cur_stream->ic->start_time != AV_NOPTS_VALUE && pos < cur_stream->ic->start_time / (double)AV_TIME_BASE)
                                 pos = cur_stream->ic->start_time / (double)AV_TIME_BASE;
                             stream_seek(cur_stream, (int64_t)(pos * AV_TIME_BASE), (int64_t)(incr * AV_TIME_BASE), 0);
+                            /* held key: fast forward/rewind on the proxy while the decoders catch up */
+                            if (event.key.repeat && cur_stream->video_st)
+                                proxy_preview(cur_stream, (int64_t)(pos * AV_TIME_BASE));
                         }
                         break;
                     default:
@@ -4245,7 +10038,8 @@ static void event_loop(VideoState *cur_stream)
                     do_exit(cur_stream);
                     break;
                 }
-                if (event.button.button == SDL_BUTTON_LEFT) {
+                if (event.button.button == SDL_BUTTON_LEFT &&
+                    event.button.y < cur_stream->ytop + cur_stream->height - peaks_bar_height(cur_stream)) {
                     static int64_t last_mouse_left_click = 0;
                     if (av_gettime_relative() - last_mouse_left_click <= 500000) {
                         toggle_full_screen(cur_stream);
@@ -4262,7 +10056,10 @@ static void event_loop(VideoState *cur_stream)
                 }
                 cursor_last_shown = av_gettime_relative();
                 if (event.type == SDL_MOUSEBUTTONDOWN) {
-                    if (event.button.button != SDL_BUTTON_RIGHT)
+                    /* right click anywhere, left click on the waveform seek bar */
+                    if (event.button.button != SDL_BUTTON_RIGHT &&
+                        (event.button.button != SDL_BUTTON_LEFT ||
+                         event.button.y < cur_stream->ytop + cur_stream->height - peaks_bar_height(cur_stream)))
                         break;
                     x = event.button.x;
                 } else {
@@ -4270,6 +10067,7 @@ static void event_loop(VideoState *cur_stream)
                         break;
                     x = event.motion.x;
                 }
+                reverse_leave(cur_stream);
                 if (seek_by_bytes || cur_stream->ic->duration <= 0) {
                     uint64_t size =  avio_size(cur_stream->ic->pb);
                     stream_seek(cur_stream, size*x/cur_stream->width, 0, 1);
@@ -4292,7 +10090,16 @@ static void event_loop(VideoState *cur_stream)
                     ts = frac * cur_stream->ic->duration;
                     if (cur_stream->ic->start_time != AV_NOPTS_VALUE)
                         ts += cur_stream->ic->start_time;
-                    stream_seek(cur_stream, ts, 0, 0);
+                    if (event.type == SDL_MOUSEMOTION && cur_stream->video_st) {
+                        /* dragging: show the nearest proxy picture or cached keyframe, seek coarsely only on a miss */
+                        if (!proxy_preview(cur_stream, ts) && !scrub_cache_preview(cur_stream, ts))
+                            stream_seek(cur_stream, ts, 0, 0);
+                        cur_stream->scrub_target = ts;
+                        cur_stream->scrub_last_motion = av_gettime_relative();
+                    } else {
+                        cur_stream->scrub_target = AV_NOPTS_VALUE;
+                        stream_seek(cur_stream, ts, 0, 0);
+                    }
                 }
                 break;
             case SDL_WINDOWEVENT:
@@ -4725,6 +10532,52 @@ static int opt_frame_pix_fmt(void *optctx, const char *opt, const char *arg)
     return opt_default(NULL, "pixel_format", arg);
 }
 
+/* parse -virtual_seeks, a comma separated list of at=target pairs in seconds */
+static int opt_virtual_seeks(void *optctx, const char *opt, const char *arg)
+{
+    const char *p = arg;
+
+    while (*p) {
+        char *end;
+        VirtualSeek *seeks;
+        double at, target;
+
+        at = av_strtod(p, &end);
+        if (end == p || *end != '=')
+            goto fail;
+        p = end + 1;
+        target = av_strtod(p, &end);
+        if (end == p || (*end && *end != ','))
+            goto fail;
+        p = *end ? end + 1 : end;
+
+        if (!(seeks = av_realloc_array(virtual_seeks, nb_virtual_seeks + 1, sizeof(*seeks))))
+            return AVERROR(ENOMEM);
+        virtual_seeks = seeks;
+        virtual_seeks[nb_virtual_seeks].at     = (int64_t)(at * 1000000);
+        virtual_seeks[nb_virtual_seeks].target = (int64_t)(target * AV_TIME_BASE);
+        nb_virtual_seeks++;
+    }
+    return 0;
+
+    fail:
+    av_log(NULL, AV_LOG_ERROR, "Invalid value for %s: %s, expected at=target[,at=target...]\n", opt, arg);
+    return AVERROR(EINVAL);
+}
+
+static int opt_audio_backend(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "callback"))
+        audio_backend_queue = 0;
+    else if (!strcmp(arg, "queue"))
+        audio_backend_queue = 1;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
+        exit(1);
+    }
+    return 0;
+}
+
 static int opt_sync(void *optctx, const char *opt, const char *arg)
 {
     if (!strcmp(arg, "audio"))
@@ -5349,6 +11202,8 @@ static const OptionDefinition program_options[] = {
         { "nodisp", OPT_BOOL, { &display_disable }, "disable graphical display" },
         { "noborder", OPT_BOOL, { &borderless }, "borderless window" },
         { "volume", OPT_INT | HAS_ARG, { &startup_volume}, "set startup volume 0=min 100=max", "volume" },
+        { "speed", OPT_DOUBLE | HAS_ARG, { &playback_speed }, "set playback speed, 0.5 to 4, audio keeps its pitch", "speed" },
+        { "meter", OPT_BOOL, { &show_meter }, "show per channel peak, RMS and loudness meters over the video", "" },
         { "f", HAS_ARG, { .func_arg = opt_format }, "force format", "fmt" },
         { "pix_fmt", HAS_ARG | OPT_EXPERT | OPT_VIDEO, { .func_arg = opt_frame_pix_fmt }, "set pixel format", "format" },
         { "stats", OPT_BOOL | OPT_EXPERT, { &show_status }, "show status", "" },
@@ -5357,6 +11212,13 @@ static const OptionDefinition program_options[] = {
         { "drp", OPT_INT | HAS_ARG | OPT_EXPERT, { &decoder_reorder_pts }, "let decoder reorder pts 0=off 1=on -1=auto", ""},
         { "lowres", OPT_INT | HAS_ARG | OPT_EXPERT, { &lowres }, "", "" },
         { "sync", HAS_ARG | OPT_EXPERT, { .func_arg = opt_sync }, "set audio-video sync. type (type=audio/video/ext)", "type" },
+        { "virtual_clock", OPT_BOOL | OPT_EXPERT, { &virtual_clock }, "play on a virtual timeline with a null audio sink, as fast as decoding allows and deterministically", "" },
+        { "clock_drift", OPT_DOUBLE | HAS_ARG | OPT_EXPERT, { &clock_drift }, "make the null audio sink of the virtual clock run fast (or slow if negative) by this many ppm", "ppm" },
+        { "virtual_seeks", HAS_ARG | OPT_EXPERT, { .func_arg = opt_virtual_seeks }, "seek at points of the virtual timeline, in seconds", "at=target[,at=target...]" },
+        { "seek_test", OPT_INT | HAS_ARG | OPT_EXPERT, { &seek_test }, "run this many exact seeks to random positions, print the per stage latencies and quit", "N" },
+        { "sync_report", OPT_BOOL | OPT_EXPERT, { &sync_report }, "print A/V sync histograms per sync type at exit", "" },
+        { "audio_adaptive", OPT_BOOL | OPT_EXPERT, { &audio_adaptive }, "start with the smallest audio buffer and grow it on underruns", "" },
+        { "audio_backend", HAS_ARG | OPT_EXPERT, { .func_arg = opt_audio_backend }, "feed the audio device from its callback or push to it with SDL_QueueAudio from a thread", "callback/queue" },
         { "autoexit", OPT_BOOL | OPT_EXPERT, { &autoexit }, "exit at the end", "" },
         { "exitonkeydown", OPT_BOOL | OPT_EXPERT, { &exit_on_keydown }, "exit on key down", "" },
         { "exitonmousedown", OPT_BOOL | OPT_EXPERT, { &exit_on_mousedown }, "exit on mouse down", "" },
@@ -5379,6 +11241,23 @@ static const OptionDefinition program_options[] = {
         { "autorotate", OPT_BOOL, { &autorotate }, "automatically rotate video", "" },
         { "find_stream_info", OPT_BOOL | OPT_INPUT | OPT_EXPERT, { &find_stream_info },
           "read and decode the streams to fill missing information with heuristics" },
+        { "prefetch_mem", OPT_INT | HAS_ARG | OPT_EXPERT, { &prefetch_mem }, "memory budget for prefetching the arrow key seek targets, 0 disables it", "MiB" },
+        { "prefetch_keyframe", OPT_BOOL | OPT_EXPERT, { &prefetch_keyframe }, "decode the keyframe of prefetched seek targets", "" },
+        { "scrub_cache", OPT_INT | HAS_ARG | OPT_EXPERT, { &scrub_cache_mem }, "memory cap of the keyframe cache used while scrubbing, 0 disables it", "MiB" },
+        { "benchmark", OPT_BOOL | OPT_EXPERT, { &benchmark }, "decode as fast as possible without display or audio output and print throughput statistics", "" },
+        { "benchmark_filters", OPT_BOOL | OPT_EXPERT, { &benchmark_filters }, "run the filter graphs and the pixel conversion in benchmark mode", "" },
+        { "metrics", OPT_STRING | HAS_ARG | OPT_EXPERT, { &metrics_filename }, "periodically write playback metrics to a file or FIFO, - for stdout", "file" },
+        { "metrics_format", OPT_STRING | HAS_ARG | OPT_EXPERT, { &metrics_format }, "format of the metrics lines (json or csv)", "format" },
+        { "metrics_interval", OPT_INT | HAS_ARG | OPT_EXPERT, { &metrics_interval }, "interval between metrics lines in milliseconds", "ms" },
+        { "alloc_stats", OPT_BOOL | OPT_EXPERT, { &alloc_stats }, "print the allocations of the per-frame paths every second", "" },
+        { "alloc_check", OPT_BOOL | OPT_EXPERT, { &alloc_check }, "fail with exit status 1 if playback keeps allocating once warmed up", "" },
+        { "trace", OPT_STRING | HAS_ARG | OPT_EXPERT, { &trace_filename }, "write a Chrome trace (chrome://tracing, Perfetto) of the pipeline stages at exit", "file" },
+        { "bench_micro", OPT_BOOL | OPT_EXPERT, { &bench_micro }, "run the queue, resampling, texture upload and (on the input) seek micro benchmarks", "" },
+        { "bench_results", OPT_STRING | HAS_ARG | OPT_EXPERT, { &bench_results }, "append benchmark results as JSON lines to this file", "file" },
+        { "reverse_mem", OPT_INT | HAS_ARG | OPT_EXPERT, { &reverse_mem }, "memory cap of the decoded GOPs kept for reverse playback", "MiB" },
+        { "proxy", OPT_BOOL | OPT_EXPERT, { &proxy_enable }, "generate a low resolution proxy of local files next to them and scrub on it", "" },
+        { "proxy_height", OPT_INT | HAS_ARG | OPT_EXPERT, { &proxy_height }, "picture height of the generated proxy", "height" },
+        { "waveform", OPT_BOOL, { &peaks_enable }, "build a waveform overview of the audio of local files next to them and show it as a seek bar", "" },
         { NULL, },
 };
 
@@ -5429,8 +11308,11 @@ void show_help_default(const char *opt, const char *arg)
            "f                   toggle full screen\n"
            "p, SPC              pause\n"
            "m                   toggle mute\n"
+           "l                   toggle audio level meter\n"
            "9, 0                decrease and increase volume respectively\n"
            "/, *                decrease and increase volume respectively\n"
+           "[, ]                decrease and increase playback speed by 0.25x\n"
+           "backspace           reset playback speed to 1x\n"
            "a                   cycle audio channel in the current program\n"
            "v                   cycle video channel\n"
            "t                   cycle subtitle channel in the current program\n"
@@ -5441,6 +11323,7 @@ void show_help_default(const char *opt, const char *arg)
            "down/up             seek backward/forward 1 minute\n"
            "page down/page up   seek backward/forward 10 minutes\n"
            "right mouse click   seek to percentage in file corresponding to fraction of width\n"
+           "left click on the waveform bar (-waveform) seek there\n"
            "left double-click   toggle full screen\n"
     );
 }
@@ -7424,6 +13307,11 @@ int main(int argc, char * argv[])
     // Set SIGTERM - "terminate", termination request signal handler
     signal(SIGTERM, sigterm_handler);
 
+#ifdef SIGPIPE
+    // a -metrics FIFO whose reader went away must not terminate the player
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
     // show program banner: contains program copyright, version and libs configuration
     show_banner(argc, argv, program_options);
 
@@ -7431,7 +13319,7 @@ int main(int argc, char * argv[])
     parse_options(NULL, argc, argv, program_options, opt_input_file);
 
     // if no input file was provided in the command line arguments
-    if (!input_filename)
+    if (!input_filename && !bench_micro)
     {
         // print program usage information
         show_usage();
@@ -7444,20 +13332,44 @@ int main(int argc, char * argv[])
         exit(1);
     }
 
-    // if output to display is disabled
-    if (display_disable)
+    // benchmark modes decode everything as fast as possible without any output
+    if (benchmark || bench_micro)
+    {
+        display_disable = 1;
+        autoexit = 1;
+        loop = 1;
+        framedrop = 0;
+
+        // nothing seeks or scrubs, keep the second demuxer and the keyframe conversions out of the numbers
+        prefetch_mem = 0;
+        scrub_cache_mem = 0;
+    }
+
+    // the virtual clock keeps the video pipeline even without a display
+    else if (display_disable && !virtual_clock)
     {
         video_disable = 1;
     }
 
+    // the seek test percentiles are exact for the samples a histogram keeps
+    if (seek_test > HISTOGRAM_NB_SAMPLES)
+    {
+        av_log(NULL, AV_LOG_WARNING, "-seek_test %d is limited to %d seeks\n", seek_test, HISTOGRAM_NB_SAMPLES);
+        seek_test = HISTOGRAM_NB_SAMPLES;
+    }
+
     // SDL video, audio and timer subsystems are to be initialized
     sdl_flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
 
+    // the sync logic reads the time from the virtual timeline, audio goes to the null sink
+    time_source = virtual_clock ? &virtual_time_source : &wall_time_source;
+
     // if audio output is disabled
-    if (audio_disable)
+    if (audio_disable || benchmark || bench_micro || virtual_clock)
     {
-        // remove SDL audio subsystem
+        // remove SDL audio subsystem, keep the events read_thread reports the end with
         sdl_flags &= ~SDL_INIT_AUDIO;
+        sdl_flags |= SDL_INIT_EVENTS;
     }
     else
     {
@@ -7501,6 +13413,38 @@ int main(int argc, char * argv[])
     // data and size members have to be initialized separately
     flush_pkt.data = (uint8_t *)&flush_pkt;
 
+    // the check is built on the allocation counters
+    if (alloc_check)
+    {
+        alloc_stats = 1;
+    }
+
+    // hot path messages are written by their own thread
+    log_ring_init();
+
+    // volume kernels for the cpu flags in effect after -cpuflags
+    audio_gain_init();
+
+    // the push thread cannot have the device closed under it
+    if (audio_backend_queue && audio_adaptive)
+    {
+        av_log(NULL, AV_LOG_WARNING, "-audio_adaptive needs the callback audio backend, disabled\n");
+        audio_adaptive = 0;
+    }
+
+    // start tracing before any thread is created
+    if (trace_filename)
+    {
+        trace_init();
+    }
+
+    // micro benchmarks do not open the input for playback
+    if (bench_micro)
+    {
+        bench_micro_run(input_filename);
+        do_exit(NULL);
+    }
+
     // if output to display is not disabled
     if (!display_disable)
     {
@@ -7550,7 +13494,10 @@ int main(int argc, char * argv[])
         do_exit(NULL);
     }
 
-    event_loop(video_state);
+    if (benchmark)
+        benchmark_loop(video_state);
+    else
+        event_loop(video_state);
 
     /* never returns */
 
@@ -16,6 +16,8 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <time.h>
@@ -30,6 +32,10 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_thread.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 /**
  * Prevents SDL from overriding main().
  */
@@ -38,9 +44,12 @@
 #endif
 
 /**
- * Debug flag.
+ * Debug flag: prints the timing of every frame, which can stall playback on a
+ * slow terminal. Off unless built with -D_DEBUG_=1.
  */
-#define _DEBUG_ 1
+#ifndef _DEBUG_
+#define _DEBUG_ 0
+#endif
 
 /**
  * SDL audio buffer size in samples.
@@ -148,6 +157,7 @@ typedef struct VideoState
     int                 audioStream;
     AVStream *          audio_st;
     AVCodecContext *    audio_ctx;
+    enum AVSampleFormat audio_out_fmt;      // sample format the audio device was opened with
     PacketQueue         audioq;
     uint8_t             audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) /2];
     unsigned int        audio_buf_size;
@@ -179,6 +189,12 @@ typedef struct VideoState
     double              audio_diff_threshold;
     int                 audio_diff_avg_count;
 
+    /**
+     * Audio resampler, kept for the whole playback so the drift compensation
+     * set on it carries over from one frame to the next.
+     */
+    struct AudioResamplingState * audio_resampling;
+
     /**
      * VideoPicture Queue.
      */
@@ -224,6 +240,14 @@ typedef struct VideoState
      */
     long    maxFramesToDecode;
     int     currentFrameIndex;
+
+    /**
+     * Residual A/V difference left by the audio correction, measured on every
+     * audio frame once the average is established and printed on exit.
+     */
+    double  drift_sum;
+    double  drift_max;
+    int     drift_count;
 } VideoState;
 
 /**
@@ -235,12 +259,9 @@ typedef struct AudioResamplingState
     int64_t in_channel_layout;
     uint64_t out_channel_layout;
     int out_nb_channels;
-    int out_linesize;
-    int in_nb_samples;
-    int64_t out_nb_samples;
-    int64_t max_out_nb_samples;
-    uint8_t ** resampled_data;
-    int resampled_data_size;
+    int in_sample_rate;
+    enum AVSampleFormat in_sample_fmt;
+    enum AVSampleFormat out_sample_fmt;
 
 } AudioResamplingState;
 
@@ -321,8 +342,7 @@ double synchronize_video(
 
 int synchronize_audio(
         VideoState * videoState,
-        short * samples,
-        int samples_size
+        int nb_samples
 );
 
 void video_refresh_timer(void * userdata);
@@ -379,6 +399,13 @@ static int audio_resampling(
         VideoState * videoState,
         AVFrame * decoded_audio_frame,
         enum AVSampleFormat out_sample_fmt,
+        uint8_t * out_buf,
+        int out_buf_size,
+        int wanted_nb_samples
+);
+
+static int audio_interleave(
+        AVFrame * decoded_audio_frame,
         uint8_t * out_buf
 );
 
@@ -397,7 +424,7 @@ void stream_seek(VideoState * videoState, int64_t pos, int rel);
 int main(int argc, char * argv[])
 {
     // if the given number of command line arguments is wrong
-    if ( argc != 3 )
+    if ( argc < 3 || argc > 5 )
     {
         // print help menu and exit
         printHelpMenu();
@@ -437,6 +464,32 @@ int main(int argc, char * argv[])
 
     videoState->av_sync_type = DEFAULT_AV_SYNC_TYPE;
 
+    // parse the optional master clock input by the user
+    if (argc > 3)
+    {
+        if (!strcmp(argv[3], "audio"))
+        {
+            videoState->av_sync_type = AV_SYNC_AUDIO_MASTER;
+        }
+        else if (!strcmp(argv[3], "video"))
+        {
+            videoState->av_sync_type = AV_SYNC_VIDEO_MASTER;
+        }
+        else if (!strcmp(argv[3], "ext"))
+        {
+            videoState->av_sync_type = AV_SYNC_EXTERNAL_MASTER;
+        }
+        else
+        {
+            // print help menu and exit
+            printHelpMenu();
+            return -1;
+        }
+    }
+
+    // parse the optional residual drift bound (in ms) input by the user
+    double maxDrift = argc > 4 ? strtod(argv[4], &pEnd) / 1000.0 : -1;
+
     // start the decoding thread to read data from the AVFormatContext
     videoState->decode_tid = SDL_CreateThread(decode_thread, "Decoding Thread", videoState);
 
@@ -553,10 +606,45 @@ int main(int argc, char * argv[])
         }
     }
 
+    // the audio is only corrected when it is not the master clock
+    int exitCode = 0;
+    if (videoState->av_sync_type != AV_SYNC_AUDIO_MASTER)
+    {
+        if (videoState->drift_count > 0)
+        {
+            double avgDrift = videoState->drift_sum / videoState->drift_count;
+
+            printf(
+                    "Residual A/V drift: avg %.1f ms max %.1f ms over %d audio frames, correction threshold %.1f ms.\n",
+                    avgDrift * 1000.0,
+                    videoState->drift_max * 1000.0,
+                    videoState->drift_count,
+                    videoState->audio_diff_threshold * 1000.0
+            );
+
+            if (maxDrift >= 0 && avgDrift > maxDrift)
+            {
+                printf("Residual A/V drift over the %.1f ms bound.\n", maxDrift * 1000.0);
+                exitCode = 1;
+            }
+        }
+        else if (maxDrift >= 0)
+        {
+            // nothing was measured, the check cannot pass
+            printf("No residual A/V drift measured.\n");
+            exitCode = 1;
+        }
+    }
+
     // clean up memory
+    if (videoState->audio_resampling)
+    {
+        swr_free(&videoState->audio_resampling->swr_ctx);
+        av_freep(&videoState->audio_resampling);
+    }
     av_free(videoState);
 
-    return 0;
+    return exitCode;
 }
 
 /**
@@ -565,8 +653,9 @@ int main(int argc, char * argv[])
 void printHelpMenu()
 {
     printf("Invalid arguments.\n\n");
-    printf("Usage: ./tutorial07 <filename> <max-frames-to-decode>\n\n");
+    printf("Usage: ./tutorial07 <filename> <max-frames-to-decode> [audio|video|ext] [max-drift-ms]\n\n");
     printf("e.g: ./tutorial07 /home/rambodrahmani/Videos/video.mp4 200\n");
+    printf("     ./tutorial07 /home/rambodrahmani/Videos/video.mp4 200 ext 100\n");
 }
 
 /**
@@ -762,9 +851,16 @@ int decode_thread(void * arg)
         {
             if (ret == AVERROR_EOF)
             {
-                // media EOF reached, quit
-                videoState->quit = 1;
-                break;
+                // media EOF reached, quit once the queued packets have been played
+                if (videoState->audioq.nb_packets == 0 && videoState->videoq.nb_packets == 0)
+                {
+                    videoState->quit = 1;
+                    break;
+                }
+
+                SDL_Delay(10);
+
+                continue;
             }
             else if (videoState->pFormatCtx->pb->error == 0)
             {
@@ -872,7 +968,9 @@ int stream_component_open(VideoState * videoState, int stream_index)
 
         // Set audio settings from codec info
         wanted_specs.freq = codecCtx->sample_rate;
-        wanted_specs.format = AUDIO_S16SYS;
+        // float decoders (aac, mp3, opus...) are played as float so the samples
+        // only have to be interleaved, everything else is converted to s16
+        wanted_specs.format = av_get_packed_sample_fmt(codecCtx->sample_fmt) == AV_SAMPLE_FMT_FLT ? AUDIO_F32SYS : AUDIO_S16SYS;
         wanted_specs.channels = codecCtx->channels;
         wanted_specs.silence = 0;
         wanted_specs.samples = SDL_AUDIO_BUFFER_SIZE;
@@ -889,6 +987,8 @@ int stream_component_open(VideoState * videoState, int stream_index)
             printf("SDL_OpenAudio: %s.\n", SDL_GetError());
             return -1;
         }
+
+        videoState->audio_out_fmt = specs.format == AUDIO_F32SYS ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
     }
 
     // initialize the AVCodecContext to use the given AVCodec
@@ -911,6 +1011,13 @@ int stream_component_open(VideoState * videoState, int stream_index)
             videoState->audio_buf_size = 0;
             videoState->audio_buf_index = 0;
 
+            // averaging coefficient for the A-V difference: the differences older
+            // than AUDIO_DIFF_AVG_NB audio frames weigh less than 1% of the
+            // average. Drifts shorter than two device buffers are left alone.
+            videoState->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+            videoState->audio_diff_avg_count = 0;
+            videoState->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
+
             // zero out the block of memory pointed by videoState->audio_pkt
             memset(&videoState->audio_pkt, 0, sizeof(videoState->audio_pkt));
 
@@ -1364,96 +1471,70 @@ double synchronize_video(VideoState * videoState, AVFrame * src_frame, double pt
  * When we are ready to find the average difference, we simply calculate
  * avg_diff = diff_sum * (1-c).
  *
+ * Rather than truncating the buffer or padding it with copies of the last
+ * sample, which is audible, we only return how many samples the decoded frame
+ * should last. The resampler then stretches or squeezes the frame to that
+ * length (see swr_set_compensation() in audio_resampling()), so the correction
+ * costs no extra pass over the samples.
+ *
  * @param   videoState      the global VideoState reference.
- * @param   samples         global VideoState reference audio buffer.
- * @param   samples_size    last decoded audio AVFrame size after resampling.
+ * @param   nb_samples      number of samples (per channel) of the last decoded
+ *                          audio AVFrame.
  *
- * @return
+ * @return                  the number of samples (per channel) the frame should
+ *                          be played with.
  */
-int synchronize_audio(VideoState * videoState, short * samples, int samples_size)
+int synchronize_audio(VideoState * videoState, int nb_samples)
 {
-    int n;
-    double ref_clock;
+    int wanted_nb_samples = nb_samples;
 
-    n = 2 * videoState->audio_ctx->channels;
-
-    // check if
+    // check if audio is not the master clock
     if (videoState->av_sync_type != AV_SYNC_AUDIO_MASTER)
     {
         double diff, avg_diff;
-        int wanted_size, min_size, max_size /*, nb_samples */;
+        int min_nb_samples, max_nb_samples;
 
-        ref_clock = get_master_clock(videoState);
-        diff = get_audio_clock(videoState) - ref_clock;
+        diff = get_audio_clock(videoState) - get_master_clock(videoState);
 
-        if (diff < AV_NOSYNC_THRESHOLD)
+        if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD)
         {
             // accumulate the diffs
             videoState->audio_diff_cum = diff + videoState->audio_diff_avg_coef * videoState->audio_diff_cum;
 
             if (videoState->audio_diff_avg_count < AUDIO_DIFF_AVG_NB)
             {
+                // not enough measures to have a correct estimate
                 videoState->audio_diff_avg_count++;
             }
             else
             {
                 avg_diff = videoState->audio_diff_cum * (1.0 - videoState->audio_diff_avg_coef);
 
+                // record the drift the correction has left, for the exit report
+                videoState->drift_sum += fabs(avg_diff);
+                videoState->drift_max = FFMAX(videoState->drift_max, fabs(avg_diff));
+                videoState->drift_count++;
+
                 /**
                  * So we're doing pretty well; we know approximately how off the audio
-                 * is from the video or whatever we're using for a clock. So let's now
-                 * calculate how many samples we need to add or lop off by putting this
-                 * code where the "Shrinking/expanding buffer code" section is:
+                 * is from the video or whatever we're using for a clock. The correction
+                 * follows the smoothed difference, not the last measure, so a single
+                 * late callback does not make the pitch wobble, and it is limited to
+                 * SAMPLE_CORRECTION_PERCENT_MAX percent of the frame.
                  */
                 if (fabs(avg_diff) >= videoState->audio_diff_threshold)
                 {
-                    wanted_size = samples_size + ((int)(diff * videoState->audio_ctx->sample_rate) * n);
-                    min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-                    max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
+                    wanted_nb_samples = nb_samples + (int)(avg_diff * videoState->audio_ctx->sample_rate);
+                    min_nb_samples = nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+                    max_nb_samples = nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100;
 
-                    if(wanted_size < min_size)
+                    if (wanted_nb_samples < min_nb_samples)
                     {
-                        wanted_size = min_size;
+                        wanted_nb_samples = min_nb_samples;
                     }
-                    else if (wanted_size > max_size)
+                    else if (wanted_nb_samples > max_nb_samples)
                     {
-                        wanted_size = max_size;
-                    }
-
-                    /**
-                     * Now we have to actually correct the audio. You may have noticed that our
-                     * synchronize_audio function returns a sample size, which will then tell us
-                     * how many bytes to send to the stream. So we just have to adjust the sample
-                     * size to the wanted_size. This works for making the sample size smaller.
-                     * But if we want to make it bigger, we can't just make the sample size larger
-                     * because there's no more data in the buffer! So we have to add it. But what
-                     * should we add? It would be foolish to try and extrapolate audio, so let's
-                     * just use the audio we already have by padding out the buffer with the
-                     * value of the last sample.
-                     */
-                    if(wanted_size < samples_size)
-                    {
-                        /* remove samples */
-                        samples_size = wanted_size;
-                    }
-                    else if(wanted_size > samples_size)
-                    {
-                        uint8_t *samples_end, *q;
-                        int nb;
-
-                        /* add samples by copying final sample*/
-                        nb = (samples_size - wanted_size);
-                        samples_end = (uint8_t *)samples + samples_size - n;
-                        q = samples_end + n;
-
-                        while(nb > 0)
-                        {
-                            memcpy(q, samples_end, n);
-                            q += n;
-                            nb -= n;
-                        }
-
-                        samples_size = wanted_size;
+                        wanted_nb_samples = max_nb_samples;
                     }
                 }
             }
@@ -1466,7 +1547,7 @@ int synchronize_audio(VideoState * videoState, short * samples, int samples_size
         }
     }
 
-    return samples_size;
+    return wanted_nb_samples;
 }
 
 /**
@@ -1637,7 +1718,7 @@ double get_audio_clock(VideoState * videoState)
 
     int bytes_per_sec = 0;
 
-    int n = 2 * videoState->audio_ctx->channels;
+    int n = av_get_bytes_per_sample(videoState->audio_out_fmt) * videoState->audio_ctx->channels;
 
     if (videoState->audio_st)
     {
@@ -2173,8 +2254,6 @@ void audio_callback(void * userdata, Uint8 * stream, int len)
             }
             else
             {
-                audio_size = synchronize_audio(videoState, (int16_t *)videoState->audio_buf, audio_size);
-
                 // cast to usigned just to get rid of annoying warning messages
                 videoState->audio_buf_size = (unsigned)audio_size;
             }
@@ -2227,7 +2306,6 @@ int audio_decode_frame(VideoState * videoState, uint8_t * audio_buf, int buf_siz
     static int audio_pkt_size = 0;
 
     double pts;
-    int n;
 
     // allocate a new frame, used to decode audio packets
     static AVFrame * avFrame = NULL;
@@ -2308,13 +2386,32 @@ int audio_decode_frame(VideoState * videoState, uint8_t * audio_buf, int buf_siz
             // if we decoded an entire audio frame
             if (got_frame)
             {
-                // apply audio resampling to the decoded frame
-                data_size = audio_resampling(
-                        videoState,
-                        avFrame,
-                        AV_SAMPLE_FMT_S16,
-                        audio_buf
-                );
+                // how long the frame should last to catch up with the master clock
+                int wanted_nb_samples = synchronize_audio(videoState, avFrame->nb_samples);
+
+                // frames already in the device format (or its planar variant)
+                // are copied as they are while no drift correction is needed,
+                // the others go through the resampler. Once the resampler is
+                // in use it is kept, it may still hold samples of the last frame.
+                if (av_get_packed_sample_fmt(avFrame->format) == videoState->audio_out_fmt &&
+                    avFrame->channels <= 2 &&
+                    wanted_nb_samples == avFrame->nb_samples &&
+                    !videoState->audio_resampling)
+                {
+                    data_size = audio_interleave(avFrame, audio_buf);
+                }
+                else
+                {
+                    // apply audio resampling to the decoded frame
+                    data_size = audio_resampling(
+                            videoState,
+                            avFrame,
+                            videoState->audio_out_fmt,
+                            audio_buf,
+                            buf_size,
+                            wanted_nb_samples
+                    );
+                }
 
                 assert(data_size <= buf_size);
             }
@@ -2325,11 +2422,11 @@ int audio_decode_frame(VideoState * videoState, uint8_t * audio_buf, int buf_siz
                 continue;
             }
 
-            // keep audio_clock up-to-date
+            // keep audio_clock up-to-date: it follows the stream time of the
+            // decoded samples, not how long the drift corrected output lasts
             pts = videoState->audio_clock;
             *pts_ptr = pts;
-            n = 2 * videoState->audio_ctx->channels;
-            videoState->audio_clock += (double)data_size / (double)(n * videoState->audio_ctx->sample_rate);
+            videoState->audio_clock += (double)avFrame->nb_samples / (double)avFrame->sample_rate;
 
             if (avPacket->data)
             {
@@ -2381,252 +2478,254 @@ int audio_decode_frame(VideoState * videoState, uint8_t * audio_buf, int buf_siz
 /**
  * Resamples the audio data retrieved using FFmpeg before playing it.
  *
+ * The resampler is created on the first call and kept in the VideoState, it is
+ * only set up again when the decoded frames change format, sample rate or
+ * channel layout. The samples are converted straight into the output buffer.
+ *
+ * When wanted_nb_samples differs from the number of decoded samples the
+ * resampler is asked to compensate the difference over the frame, which
+ * stretches or squeezes it by up to SAMPLE_CORRECTION_PERCENT_MAX percent
+ * without audible clicks.
+ *
  * @param   videoState          the global VideoState reference.
  * @param   decoded_audio_frame the decoded audio frame.
  * @param   out_sample_fmt      audio output sample format (e.g. AV_SAMPLE_FMT_S16).
  * @param   out_buf             audio output buffer.
+ * @param   out_buf_size        size in bytes of the audio output buffer.
+ * @param   wanted_nb_samples   number of samples (per channel) the frame should
+ *                              last, see synchronize_audio().
  *
  * @return                      the size of the resampled audio data.
  */
-static int audio_resampling(VideoState * videoState, AVFrame * decoded_audio_frame, enum AVSampleFormat out_sample_fmt, uint8_t * out_buf)
+static int audio_resampling(VideoState * videoState, AVFrame * decoded_audio_frame, enum AVSampleFormat out_sample_fmt, uint8_t * out_buf, int out_buf_size, int wanted_nb_samples)
 {
-    // get an instance of the AudioResamplingState struct
-    AudioResamplingState * arState = getAudioResampling(videoState->audio_ctx->channel_layout);
-
-    if (!arState->swr_ctx)
-    {
-        printf("swr_alloc error.\n");
-        return -1;
-    }
+    AudioResamplingState * arState = videoState->audio_resampling;
+    int out_sample_rate = videoState->audio_ctx->sample_rate;
+    int64_t in_channel_layout;
+    uint8_t * out[] = { out_buf };
+    int out_count;
+    int ret;
 
     // get input audio channels
-    arState->in_channel_layout = (videoState->audio_ctx->channels ==
-                                  av_get_channel_layout_nb_channels(videoState->audio_ctx->channel_layout)) ?
-                                 videoState->audio_ctx->channel_layout :
-                                 av_get_default_channel_layout(videoState->audio_ctx->channels);
+    in_channel_layout = (decoded_audio_frame->channels ==
+                         av_get_channel_layout_nb_channels(decoded_audio_frame->channel_layout)) ?
+                        decoded_audio_frame->channel_layout :
+                        av_get_default_channel_layout(decoded_audio_frame->channels);
 
     // check input audio channels correctly retrieved
-    if (arState->in_channel_layout <= 0)
+    if (in_channel_layout <= 0)
     {
         printf("in_channel_layout error.\n");
         return -1;
     }
 
-    // set output audio channels based on the input audio channels
-    if (videoState->audio_ctx->channels == 1)
-    {
-        arState->out_channel_layout = AV_CH_LAYOUT_MONO;
-    }
-    else if (videoState->audio_ctx->channels == 2)
-    {
-        arState->out_channel_layout = AV_CH_LAYOUT_STEREO;
-    }
-    else
-    {
-        arState->out_channel_layout = AV_CH_LAYOUT_SURROUND;
-    }
-
-    // retrieve number of audio samples (per channel)
-    arState->in_nb_samples = decoded_audio_frame->nb_samples;
-    if (arState->in_nb_samples <= 0)
+    // check the number of audio samples (per channel)
+    if (decoded_audio_frame->nb_samples <= 0)
     {
         printf("in_nb_samples error.\n");
         return -1;
     }
 
-    // Set SwrContext parameters for resampling
-    av_opt_set_int(
-            arState->swr_ctx,
-            "in_channel_layout",
-            arState->in_channel_layout,
-            0
-    );
-
-    // Set SwrContext parameters for resampling
-    av_opt_set_int(
-            arState->swr_ctx,
-            "in_sample_rate",
-            videoState->audio_ctx->sample_rate,
-            0
-    );
-
-    // Set SwrContext parameters for resampling
-    av_opt_set_sample_fmt(
-            arState->swr_ctx,
-            "in_sample_fmt",
-            videoState->audio_ctx->sample_fmt,
-            0
-    );
-
-    // Set SwrContext parameters for resampling
-    av_opt_set_int(
-            arState->swr_ctx,
-            "out_channel_layout",
-            arState->out_channel_layout,
-            0
-    );
-
-    // Set SwrContext parameters for resampling
-    av_opt_set_int(
-            arState->swr_ctx,
-            "out_sample_rate",
-            videoState->audio_ctx->sample_rate,
-            0
-    );
-
-    // Set SwrContext parameters for resampling
-    av_opt_set_sample_fmt(
-            arState->swr_ctx,
-            "out_sample_fmt",
-            out_sample_fmt,
-            0
-    );
-
-    // initialize SWR context after user parameters have been set
-    int ret = swr_init(arState->swr_ctx);;
-    if (ret < 0)
+    // get the instance of the AudioResamplingState struct, allocated once
+    if (!arState)
     {
-        printf("Failed to initialize the resampling context.\n");
-        return -1;
+        arState = videoState->audio_resampling = getAudioResampling(in_channel_layout);
     }
 
-    arState->max_out_nb_samples = arState->out_nb_samples = av_rescale_rnd(
-            arState->in_nb_samples,
-            videoState->audio_ctx->sample_rate,
-            videoState->audio_ctx->sample_rate,
-            AV_ROUND_UP
-    );
-
-    // check rescaling was successful
-    if (arState->max_out_nb_samples <= 0)
+    if (!arState->swr_ctx)
     {
-        printf("av_rescale_rnd error.\n");
+        printf("swr_alloc error.\n");
         return -1;
     }
 
-    // get number of output audio channels
-    arState->out_nb_channels = av_get_channel_layout_nb_channels(arState->out_channel_layout);
+    // (re)configure the resampler only when the decoded frames changed
+    if (!swr_is_initialized(arState->swr_ctx) ||
+        arState->in_channel_layout != in_channel_layout ||
+        arState->in_sample_rate != decoded_audio_frame->sample_rate ||
+        arState->in_sample_fmt != decoded_audio_frame->format ||
+        arState->out_sample_fmt != out_sample_fmt)
+    {
+        arState->in_channel_layout = in_channel_layout;
+        arState->in_sample_rate = decoded_audio_frame->sample_rate;
+        arState->in_sample_fmt = decoded_audio_frame->format;
+        arState->out_sample_fmt = out_sample_fmt;
 
-    // allocate data pointers array for arState->resampled_data and fill data
-    // pointers and linesize accordingly
-    ret = av_samples_alloc_array_and_samples(
-            &arState->resampled_data,
-            &arState->out_linesize,
-            arState->out_nb_channels,
-            arState->out_nb_samples,
-            out_sample_fmt,
-            0
-    );
+        // set output audio channels based on the input audio channels
+        if (videoState->audio_ctx->channels == 1)
+        {
+            arState->out_channel_layout = AV_CH_LAYOUT_MONO;
+        }
+        else if (videoState->audio_ctx->channels == 2)
+        {
+            arState->out_channel_layout = AV_CH_LAYOUT_STEREO;
+        }
+        else
+        {
+            arState->out_channel_layout = AV_CH_LAYOUT_SURROUND;
+        }
 
-    // check memory allocation for the resampled data was successful
-    if (ret < 0)
-    {
-        printf("av_samples_alloc_array_and_samples() error: Could not allocate destination samples.\n");
-        return -1;
-    }
+        // get number of output audio channels
+        arState->out_nb_channels = av_get_channel_layout_nb_channels(arState->out_channel_layout);
 
-    // retrieve output samples number taking into account the progressive delay
-    arState->out_nb_samples = av_rescale_rnd(
-            swr_get_delay(arState->swr_ctx, videoState->audio_ctx->sample_rate) + arState->in_nb_samples,
-            videoState->audio_ctx->sample_rate,
-            videoState->audio_ctx->sample_rate,
-            AV_ROUND_UP
-    );
+        // Set SwrContext parameters for resampling
+        av_opt_set_int(
+                arState->swr_ctx,
+                "in_channel_layout",
+                arState->in_channel_layout,
+                0
+        );
 
-    // check output samples number was correctly rescaled
-    if (arState->out_nb_samples <= 0)
-    {
-        printf("av_rescale_rnd error\n");
-        return -1;
-    }
+        // Set SwrContext parameters for resampling
+        av_opt_set_int(
+                arState->swr_ctx,
+                "in_sample_rate",
+                arState->in_sample_rate,
+                0
+        );
 
-    if (arState->out_nb_samples > arState->max_out_nb_samples)
-    {
-        // free memory block and set pointer to NULL
-        av_free(arState->resampled_data[0]);
+        // Set SwrContext parameters for resampling
+        av_opt_set_sample_fmt(
+                arState->swr_ctx,
+                "in_sample_fmt",
+                arState->in_sample_fmt,
+                0
+        );
+
+        // Set SwrContext parameters for resampling
+        av_opt_set_int(
+                arState->swr_ctx,
+                "out_channel_layout",
+                arState->out_channel_layout,
+                0
+        );
+
+        // Set SwrContext parameters for resampling
+        av_opt_set_int(
+                arState->swr_ctx,
+                "out_sample_rate",
+                out_sample_rate,
+                0
+        );
 
-        // Allocate a samples buffer for out_nb_samples samples
-        ret = av_samples_alloc(
-                arState->resampled_data,
-                &arState->out_linesize,
-                arState->out_nb_channels,
-                arState->out_nb_samples,
+        // Set SwrContext parameters for resampling
+        av_opt_set_sample_fmt(
+                arState->swr_ctx,
+                "out_sample_fmt",
                 out_sample_fmt,
-                1
+                0
         );
 
-        // check samples buffer correctly allocated
+        // initialize SWR context after user parameters have been set
+        ret = swr_init(arState->swr_ctx);
         if (ret < 0)
         {
-            printf("av_samples_alloc failed.\n");
+            printf("Failed to initialize the resampling context.\n");
             return -1;
         }
-
-        arState->max_out_nb_samples = arState->out_nb_samples;
     }
 
-    if (arState->swr_ctx)
+    // spread the drift correction over the whole frame
+    if (wanted_nb_samples != decoded_audio_frame->nb_samples)
     {
-        // do the actual audio data resampling
-        ret = swr_convert(
+        ret = swr_set_compensation(
                 arState->swr_ctx,
-                arState->resampled_data,
-                arState->out_nb_samples,
-                (const uint8_t **) decoded_audio_frame->data,
-                decoded_audio_frame->nb_samples
+                (wanted_nb_samples - decoded_audio_frame->nb_samples) * out_sample_rate / arState->in_sample_rate,
+                wanted_nb_samples * out_sample_rate / arState->in_sample_rate
         );
 
-        // check audio conversion was successful
         if (ret < 0)
         {
-            printf("swr_convert_error.\n");
+            printf("swr_set_compensation() failed.\n");
             return -1;
         }
+    }
 
-        // get the required buffer size for the given audio parameters
-        arState->resampled_data_size = av_samples_get_buffer_size(
-                &arState->out_linesize,
-                arState->out_nb_channels,
-                ret,
-                out_sample_fmt,
-                1
-        );
+    // the output buffer is large enough for the longest corrected frame plus
+    // the samples the resampler may still hold, so convert directly into it
+    out_count = out_buf_size / (arState->out_nb_channels * av_get_bytes_per_sample(out_sample_fmt));
 
-        // check audio buffer size
-        if (arState->resampled_data_size < 0)
-        {
-            printf("av_samples_get_buffer_size error.\n");
-            return -1;
-        }
-    }
-    else
+    // do the actual audio data resampling
+    ret = swr_convert(
+            arState->swr_ctx,
+            out,
+            out_count,
+            (const uint8_t **) decoded_audio_frame->extended_data,
+            decoded_audio_frame->nb_samples
+    );
+
+    // check audio conversion was successful
+    if (ret < 0)
     {
-        printf("swr_ctx null error.\n");
+        printf("swr_convert_error.\n");
         return -1;
     }
 
-    // copy the resampled data to the output buffer
-    memcpy(out_buf, arState->resampled_data[0], arState->resampled_data_size);
+    if (ret == out_count)
+    {
+        // the remaining samples would be played with the next frame, too late
+        printf("audio buffer is probably too small.\n");
+        if (swr_init(arState->swr_ctx) < 0)
+        {
+            swr_free(&arState->swr_ctx);
+        }
+    }
 
-    /*
-     * Memory Cleanup.
-     */
-    if (arState->resampled_data)
+    return ret * arState->out_nb_channels * av_get_bytes_per_sample(out_sample_fmt);
+}
+
+/**
+ * Copies a decoded audio frame whose samples already have the device format
+ * to the output buffer, interleaving planar frames. Stereo float frames are
+ * interleaved 4 samples at a time with SSE2 when available.
+ *
+ * @param   decoded_audio_frame the decoded audio frame.
+ * @param   out_buf             audio output buffer.
+ *
+ * @return                      the size of the copied audio data.
+ */
+static int audio_interleave(AVFrame * decoded_audio_frame, uint8_t * out_buf)
+{
+    int channels = decoded_audio_frame->channels;
+    int nb_samples = decoded_audio_frame->nb_samples;
+    int bytes_per_sample = av_get_bytes_per_sample(decoded_audio_frame->format);
+    int data_size = nb_samples * channels * bytes_per_sample;
+    int i = 0, ch;
+
+    if (!av_sample_fmt_is_planar(decoded_audio_frame->format) || channels == 1)
     {
-        // free memory block and set pointer to NULL
-        av_freep(&arState->resampled_data[0]);
+        memcpy(out_buf, decoded_audio_frame->data[0], data_size);
+        return data_size;
     }
 
-    av_freep(&arState->resampled_data);
-    arState->resampled_data = NULL;
+#if defined(__SSE2__) || defined(_M_X64)
+    if (channels == 2 && bytes_per_sample == 4)
+    {
+        const float * left = (const float *) decoded_audio_frame->data[0];
+        const float * right = (const float *) decoded_audio_frame->data[1];
+        float * out = (float *) out_buf;
+
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            __m128 l = _mm_loadu_ps(left + i);
+            __m128 r = _mm_loadu_ps(right + i);
 
-    if (arState->swr_ctx)
+            _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+        }
+    }
+#endif
+
+    for (; i < nb_samples; i++)
     {
-        // free the allocated SwrContext and set the pointer to NULL
-        swr_free(&arState->swr_ctx);
+        for (ch = 0; ch < channels; ch++)
+        {
+            memcpy(out_buf + (i * channels + ch) * bytes_per_sample,
+                   decoded_audio_frame->data[ch] + i * bytes_per_sample,
+                   bytes_per_sample);
+        }
     }
 
-    return arState->resampled_data_size;
+    return data_size;
 }
 
 /**
@@ -2646,12 +2745,9 @@ AudioResamplingState * getAudioResampling(uint64_t channel_layout)
     audioResampling->in_channel_layout = channel_layout;
     audioResampling->out_channel_layout = AV_CH_LAYOUT_STEREO;
     audioResampling->out_nb_channels = 0;
-    audioResampling->out_linesize = 0;
-    audioResampling->in_nb_samples = 0;
-    audioResampling->out_nb_samples = 0;
-    audioResampling->max_out_nb_samples = 0;
-    audioResampling->resampled_data = NULL;
-    audioResampling->resampled_data_size = 0;
+    audioResampling->in_sample_rate = 0;
+    audioResampling->in_sample_fmt = AV_SAMPLE_FMT_NONE;
+    audioResampling->out_sample_fmt = AV_SAMPLE_FMT_NONE;
 
     return audioResampling;
 }